@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+#include "config.h"
+
+#define CACHE_LINE 64
+
+typedef struct access_ring {
+    // Голова пишется только владельцем, хвост - только потоком записи
+    _Atomic uint32_t head __attribute__((aligned(CACHE_LINE)));
+    _Atomic uint32_t tail __attribute__((aligned(CACHE_LINE)));
+    _Atomic int in_use;
+    struct access_ring* next;
+    access_record records[ACCESS_LOG_RING_SIZE];
+} access_ring;
+
+static _Atomic(access_ring*) rings = NULL;
+static int log_enabled = 0;
+
+static const char* log_path = NULL;
+static long max_bytes = DEFAULT_ACCESS_LOG_MAX_BYTES;
+static int keep_files = DEFAULT_ACCESS_LOG_KEEP;
+static int log_fd = -1;
+static long log_size = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread access_ring* local_ring = NULL;
+static __thread access_record* current = NULL;
+
+static void release_ring(void* arg) {
+    access_ring* ring = (access_ring*)arg;
+    atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// Кольца переиспользуются, как шарды метрик: потоков много, но живых
+// одновременно не больше числа соединений. Недочитанные записи в кольце
+// остаются и уйдут на диск вместе с записями нового владельца
+static access_ring* acquire_ring(void) {
+    if (local_ring != NULL) {
+        return local_ring;
+    }
+    pthread_once(&key_once, make_key);
+
+    access_ring* ring = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = aligned_alloc(CACHE_LINE, sizeof(*ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->in_use, 1);
+
+        access_ring* first = atomic_load(&rings);
+        do {
+            ring->next = first;
+        } while (!atomic_compare_exchange_weak(&rings, &first, ring));
+    }
+
+    local_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+void access_log_begin(access_record* rec) {
+    if (!log_enabled) {
+        return;
+    }
+    memset(rec, 0, sizeof(*rec));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->timestamp_us = (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+    current = rec;
+}
+
+void access_log_status(int status) {
+    if (current != NULL && status > 0) {
+        current->status = (uint16_t)status;
+    }
+}
+
+void access_log_stage(metric_stage s, uint64_t usec) {
+    if (current != NULL) {
+        current->stage_us[s] = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+    }
+}
+
+// Кольцо полно - запись теряется: ждать диск в потоке запроса нельзя
+void access_log_end(void) {
+    access_record* rec = current;
+    if (rec == NULL) {
+        return;
+    }
+    current = NULL;
+
+    access_ring* ring = acquire_ring();
+    if (ring == NULL) {
+        metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+        return;
+    }
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ACCESS_LOG_RING_SIZE) {
+        metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+        return;
+    }
+    ring->records[head & (ACCESS_LOG_RING_SIZE - 1)] = *rec;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static int write_full(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int open_log_file(void) {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    log_size = fstat(log_fd, &st) == 0 ? (long)st.st_size : 0;
+    if (log_size == 0) {
+        access_log_header header = {.version = ACCESS_LOG_VERSION, .record_size = sizeof(access_record)};
+        memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+        if (write_full(log_fd, &header, sizeof(header)) != 0) {
+            return -1;
+        }
+        log_size = sizeof(header);
+    }
+    return 0;
+}
+
+// path -> path.1 -> ... -> path.keep, самый старый удаляется
+static void rotate_log(void) {
+    close(log_fd);
+    log_fd = -1;
+
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    for (int i = keep_files - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log_path, i);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+        (void)rename(from, to);
+    }
+    if (keep_files > 0) {
+        snprintf(to, sizeof(to), "%s.1", log_path);
+        (void)rename(log_path, to);
+    } else {
+        (void)unlink(log_path);
+    }
+
+    if (open_log_file() != 0) {
+        perror("access log reopen failed");
+    }
+}
+
+static size_t drain_rings(access_record* batch, size_t cap) {
+    size_t n = 0;
+    access_ring* ring = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; ring != NULL && n < cap; ring = ring->next) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head && n < cap) {
+            batch[n++] = ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+            tail++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return n;
+}
+
+static void* access_log_writer(void* arg) {
+    (void)arg;
+    access_record* batch = malloc(sizeof(access_record) * ACCESS_LOG_BATCH);
+    if (batch == NULL) {
+        perror("access log batch malloc");
+        return NULL;
+    }
+
+    while (1) {
+        size_t n = drain_rings(batch, ACCESS_LOG_BATCH);
+        if (n == 0) {
+            struct timespec pause = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_FLUSH_MS * 1000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (log_fd == -1 && open_log_file() != 0) {
+            // Диск недоступен: записи выбрасываем, но кольца не держим
+            metrics_add(METRIC_ACCESS_LOG_DROPPED, (int64_t)n);
+            continue;
+        }
+
+        size_t len = n * sizeof(access_record);
+        if (write_full(log_fd, batch, len) != 0) {
+            perror("access log write failed");
+            metrics_add(METRIC_ACCESS_LOG_DROPPED, (int64_t)n);
+            close(log_fd);
+            log_fd = -1;
+            continue;
+        }
+        log_size += (long)len;
+        if (max_bytes > 0 && log_size >= max_bytes) {
+            rotate_log();
+        }
+    }
+    return NULL;
+}
+
+// PROXY_ACCESS_LOG - путь к файлу; не задан - журнал выключен
+int init_access_log(void) {
+    log_path = config_get_str("PROXY_ACCESS_LOG", NULL);
+    if (log_path == NULL || *log_path == '\0') {
+        return 0;
+    }
+    max_bytes = config_get_long("PROXY_ACCESS_LOG_MAX_BYTES", DEFAULT_ACCESS_LOG_MAX_BYTES);
+    keep_files = (int)config_get_long("PROXY_ACCESS_LOG_KEEP", DEFAULT_ACCESS_LOG_KEEP);
+
+    if (open_log_file() != 0) {
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, access_log_writer, NULL) != 0) {
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    log_enabled = 1;
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdint.h>
+
+#include "metrics.h"
+
+// Бинарный журнал запросов. Поток соединения кладет запись фиксированного
+// размера в свое SPSC-кольцо без блокировок, отдельный поток пачками
+// сбрасывает кольца на диск и ротирует файлы. Читается утилитой access_log_decode.
+
+#define ACCESS_LOG_MAGIC "PXAL"
+#define ACCESS_LOG_VERSION 1
+// Степень двойки: индексы в кольце берутся по маске
+#define ACCESS_LOG_RING_SIZE 256
+#define ACCESS_LOG_BATCH 1024
+#define ACCESS_LOG_FLUSH_MS 200
+#define DEFAULT_ACCESS_LOG_MAX_BYTES (64L * 1024 * 1024)
+#define DEFAULT_ACCESS_LOG_KEEP 5
+
+typedef enum {
+    ACCESS_NO_CACHE,
+    ACCESS_HIT,
+    ACCESS_MISS,
+    ACCESS_STALE,
+    ACCESS_STALE_ERROR
+} access_result;
+
+typedef struct {
+    uint64_t timestamp_us;    // CLOCK_REALTIME начала запроса
+    uint64_t key_hash;        // cache_key_hash() ключа, 0 - некэшируемый запрос
+    uint64_t bytes;           // отдано клиенту
+    uint32_t stage_us[STAGES_NUM];
+    uint16_t status;
+    uint8_t method;
+    uint8_t result;
+} access_record;
+
+_Static_assert(sizeof(access_record) == 48, "access_record is a file format");
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+} access_log_header;
+
+int init_access_log(void);
+
+void access_log_begin(access_record* rec);
+
+void access_log_status(int status);
+
+void access_log_stage(metric_stage s, uint64_t usec);
+
+void access_log_end(void);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "access_log.h"
+
+// Печать бинарного журнала запросов: access_log_decode [-c] файл...
+// Без -c - строки для глаз, с -c - CSV для таблиц и скриптов.
+
+static const char* method_names[] = {"GET", "HEAD", "POST", "OTHER"};
+static const char* result_names[] = {"-", "HIT", "MISS", "STALE", "STALE_ERROR"};
+static const char* stage_names[STAGES_NUM] = {"parse", "lookup", "connect", "ttfb", "total"};
+
+static const char* method_name(uint8_t m) {
+    return m < sizeof(method_names) / sizeof(method_names[0]) ? method_names[m] : "?";
+}
+
+static const char* result_name(uint8_t r) {
+    return r < sizeof(result_names) / sizeof(result_names[0]) ? result_names[r] : "?";
+}
+
+static void print_record(const access_record* rec, int csv) {
+    if (csv) {
+        printf("%" PRIu64 ",%016" PRIx64 ",%s,%u,%" PRIu64 ",%s", rec->timestamp_us, rec->key_hash,
+               method_name(rec->method), rec->status, rec->bytes, result_name(rec->result));
+        for (int s = 0; s < STAGES_NUM; s++) {
+            printf(",%u", rec->stage_us[s]);
+        }
+        printf("\n");
+        return;
+    }
+
+    time_t sec = (time_t)(rec->timestamp_us / 1000000);
+    struct tm tm;
+    char when[32];
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    printf("%s.%06" PRIu64 "Z %-4s %3u %-11s %10" PRIu64 "B key=%016" PRIx64, when,
+           rec->timestamp_us % 1000000, method_name(rec->method), rec->status,
+           result_name(rec->result), rec->bytes, rec->key_hash);
+    for (int s = 0; s < STAGES_NUM; s++) {
+        printf(" %s=%uus", stage_names[s], rec->stage_us[s]);
+    }
+    printf("\n");
+}
+
+static int decode_file(const char* path, int csv) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    access_log_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not an access log\n", path);
+        fclose(f);
+        return -1;
+    }
+    if (header.version != ACCESS_LOG_VERSION || header.record_size != sizeof(access_record)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", path, header.version,
+                header.record_size);
+        fclose(f);
+        return -1;
+    }
+
+    access_record rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        print_record(&rec, csv);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int csv = 0;
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        csv = 1;
+        first = 2;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-c] access.log...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (csv) {
+        printf("timestamp_us,key_hash,method,status,bytes,result");
+        for (int s = 0; s < STAGES_NUM; s++) {
+            printf(",%s_us", stage_names[s]);
+        }
+        printf("\n");
+    }
+
+    int rc = EXIT_SUCCESS;
+    for (int i = first; i < argc; i++) {
+        if (decode_file(argv[i], csv) != 0) {
+            rc = EXIT_FAILURE;
+        }
+    }
+    return rc;
+}
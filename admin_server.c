@@ -0,0 +1,165 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "admin_server.h"
+#include "http_utils.h"
+
+typedef struct {
+    const char* path;
+    admin_handler handler;
+} admin_route;
+
+static admin_route routes[MAX_ADMIN_HANDLERS];
+static int routes_num = 0;
+
+// Регистрация идет из main до start_admin_server, поэтому без блокировок
+int admin_register(const char* path, admin_handler handler) {
+    if (routes_num >= MAX_ADMIN_HANDLERS) {
+        return -1;
+    }
+    routes[routes_num].path = path;
+    routes[routes_num].handler = handler;
+    routes_num++;
+    return 0;
+}
+
+static admin_handler find_route(const char* path, size_t len) {
+    for (int i = 0; i < routes_num; i++) {
+        if (strlen(routes[i].path) == len && memcmp(routes[i].path, path, len) == 0) {
+            return routes[i].handler;
+        }
+    }
+    return NULL;
+}
+
+static void send_status(int sock, const char* status) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.0 %s\r\n"
+                     "Connection: close\r\n"
+                     "Content-Length: 0\r\n"
+                     "\r\n", status);
+    (void)send_all(sock, head, (size_t)n);
+}
+
+static void serve_admin_client(int sock) {
+    char req[ADMIN_REQUEST_SIZE];
+    size_t len = 0;
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(sock, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0) {
+            return;
+        }
+        len += (size_t)n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    if (strncmp(req, "GET ", 4) != 0) {
+        send_status(sock, "405 Method Not Allowed");
+        return;
+    }
+    const char* path = req + 4;
+    size_t path_len = strcspn(path, " ?\r\n");
+
+    admin_handler handler = find_route(path, path_len);
+    if (handler == NULL) {
+        send_status(sock, "404 Not Found");
+        return;
+    }
+
+    dynbuf body = {0};
+    if (handler(&body) != 0) {
+        free_dynbuf(&body);
+        send_status(sock, "500 Internal Server Error");
+        return;
+    }
+
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Connection: close\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n", body.len);
+    if (send_all(sock, head, (size_t)n) == 0 && body.len > 0) {
+        (void)send_all(sock, body.data, body.len);
+    }
+    free_dynbuf(&body);
+}
+
+// Запросы сюда редкие (scrape раз в несколько секунд), один поток обслуживает
+// их по очереди и не трогает полосы основного сервера
+static void* admin_loop(void* arg) {
+    int server = (int)(long)arg;
+    while (1) {
+        int sock = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            perror("admin accept failed");
+            continue;
+        }
+        struct timeval tv = {.tv_sec = ADMIN_RECV_TIMEOUT_SEC, .tv_usec = 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve_admin_client(sock);
+        close(sock);
+    }
+    return NULL;
+}
+
+static int admin_sock = -1;
+
+int admin_server_fd(void) {
+    return admin_sock;
+}
+
+// Сокет уже слушает: свой или полученный от старого процесса при обновлении
+int start_admin_server_on(int sock) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_loop, (void*)(long)sock) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    admin_sock = sock;
+    return 0;
+}
+
+int start_admin_server(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEADDR) failed");
+    }
+
+    // Только локально: наружу статистику не отдаем
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    if (start_admin_server_on(sock) != 0) {
+        close(sock);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __ADMIN_SERVER_H__
+#define __ADMIN_SERVER_H__
+
+#include "dynamic_buffer.h"
+
+// Служебный HTTP на 127.0.0.1: /metrics и прочие отчеты, которые
+// модули регистрируют через admin_register
+#define MAX_ADMIN_HANDLERS 16
+#define ADMIN_REQUEST_SIZE 4096
+#define ADMIN_RECV_TIMEOUT_SEC 2
+
+// Обработчик дописывает тело ответа в out; -1 - ответить 500
+typedef int (*admin_handler)(dynbuf* out);
+
+int admin_register(const char* path, admin_handler handler);
+
+int start_admin_server(int port);
+
+int start_admin_server_on(int sock);
+
+int admin_server_fd(void);
+
+#endif
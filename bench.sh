@@ -0,0 +1,58 @@
+#!/bin/sh
+# Прогон сценариев нагрузки: оптимизированный прокси + stub_origin + bench_load.
+# Результат - JSON-массив в $BENCH_OUT (по строке на сценарий), к каждой
+# строке дописываются RSS прокси после сценария и пиковый RSS.
+#
+# Переменные: BENCH_DURATION (сек на сценарий), BENCH_PROXY_PORT,
+# BENCH_ORIGIN_PORT, BENCH_ORIGIN_DELAY_MS, BENCH_OUT.
+
+set -u
+
+DURATION=${BENCH_DURATION:-10}
+PROXY_PORT=${BENCH_PROXY_PORT:-18231}
+ORIGIN_PORT=${BENCH_ORIGIN_PORT:-18232}
+ORIGIN_DELAY=${BENCH_ORIGIN_DELAY_MS:-0}
+OUT=${BENCH_OUT:-bench_results.json}
+
+./stub_origin -d "$ORIGIN_DELAY" "$ORIGIN_PORT" &
+ORIGIN_PID=$!
+PROXY_PORT=$PROXY_PORT ./proxy_server_bench >/dev/null 2>&1 &
+PROXY_PID=$!
+trap 'kill $PROXY_PID $ORIGIN_PID 2>/dev/null' EXIT INT TERM
+sleep 1
+
+rss_kb() {
+    awk -v k="$1:" '$1 == k { print $2 }' "/proc/$PROXY_PID/status"
+}
+
+first=1
+echo "[" > "$OUT"
+
+run() {
+    name=$1
+    shift
+    line=$(./bench_load -p "$PROXY_PORT" -o "$ORIGIN_PORT" -n "$name" -t "$DURATION" "$@")
+    if [ -z "$line" ]; then
+        echo "scenario $name failed" >&2
+        return
+    fi
+    line=$(echo "$line" | sed "s/}\$/,\"rss_kb\":$(rss_kb VmRSS),\"peak_rss_kb\":$(rss_kb VmHWM)}/")
+    echo "$line"
+    if [ $first -eq 0 ]; then
+        echo "," >> "$OUT"
+    fi
+    first=0
+    printf "%s" "$line" >> "$OUT"
+}
+
+run all-hit        -c 32 -k 1 -s 8192
+run all-miss       -c 32 -u -s 8192
+run zipf           -c 32 -k 10000 -z 0.9 -s 16384
+run zipf-open      -c 256 -r 2000 -k 10000 -z 0.9 -s 16384
+run chunked-miss   -c 32 -u -C -s 65536
+run large-fanout   -c 32 -k 1 -s 16777216
+run slow-clients   -c 64 -k 1 -s 1048576 -R 262144
+
+echo "" >> "$OUT"
+echo "]" >> "$OUT"
+echo "results written to $OUT"
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Генератор нагрузки для make bench. Ходит через прокси в stub_origin и
+// печатает одну JSON-строку с результатом сценария.
+//
+// Замкнутый цикл (по умолчанию): -c потоков, каждый шлет следующий запрос
+// сразу после ответа. Открытый цикл (-r): запросы назначаются с частотой r,
+// задержка считается от назначенного момента, -c ограничивает число
+// одновременно висящих запросов.
+//
+// bench_load -p порт_прокси -o порт_origin [-n имя] [-t секунд] [-c потоков]
+//            [-r запросов/с] [-k ключей] [-z zipf_s] [-u] [-s размер]
+//            [-C] [-R байт/с на клиента]
+//   -k 1        все запросы в один объект (после первого - попадания)
+//   -u          каждый запрос в новый объект (только промахи)
+//   -z s        популярность ключей по Zipf с параметром s
+//   -C          origin отвечает chunked вместо Content-Length
+//   -R          медленный клиент: читает ответ не быстрее заданного темпа
+
+#define BENCH_RECV_BUF 65536
+#define BENCH_SLOW_RCVBUF 16384
+#define BENCH_LATENCY_CHUNK 65536
+
+typedef struct {
+    const char* name;
+    int proxy_port;
+    int origin_port;
+    double duration;
+    int threads;
+    double rate;
+    long keys;
+    double zipf;
+    int unique;
+    long size;
+    int chunked;
+    long read_rate;
+} bench_opts;
+
+typedef struct {
+    uint32_t* latency_us;
+    size_t latency_num;
+    size_t latency_cap;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t rng;
+} bench_worker;
+
+static bench_opts opts = {.name = "bench", .duration = 10, .threads = 32, .keys = 1, .size = 8192};
+static double* zipf_cdf = NULL;
+static uint64_t run_id = 0;
+static uint64_t start_us = 0;
+static uint64_t stop_us = 0;
+static _Atomic uint64_t next_ticket = 0;
+static _Atomic uint64_t unique_seq = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static int build_zipf(void) {
+    zipf_cdf = malloc((size_t)opts.keys * sizeof(*zipf_cdf));
+    if (zipf_cdf == NULL) {
+        return -1;
+    }
+    double sum = 0;
+    for (long i = 0; i < opts.keys; i++) {
+        sum += 1.0 / pow((double)(i + 1), opts.zipf);
+        zipf_cdf[i] = sum;
+    }
+    for (long i = 0; i < opts.keys; i++) {
+        zipf_cdf[i] /= sum;
+    }
+    return 0;
+}
+
+static uint64_t pick_key(bench_worker* w) {
+    if (opts.unique) {
+        return atomic_fetch_add(&unique_seq, 1);
+    }
+    if (opts.keys <= 1) {
+        return 0;
+    }
+    if (zipf_cdf == NULL) {
+        return next_random(&w->rng) % (uint64_t)opts.keys;
+    }
+    double u = (double)(next_random(&w->rng) >> 11) / (double)(1ULL << 53);
+    long lo = 0;
+    long hi = opts.keys - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (uint64_t)lo;
+}
+
+static int connect_proxy(void) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (opts.read_rate > 0) {
+        int rcvbuf = BENCH_SLOW_RCVBUF;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(opts.proxy_port);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Один запрос целиком; 0 - получен ответ 2xx
+static int do_request(bench_worker* w, char* buf) {
+    uint64_t key = pick_key(w);
+    char req[512];
+    // run_id в пути, чтобы прогоны не попадали в кэш друг друга
+    int n = snprintf(req, sizeof(req),
+                     "GET http://127.0.0.1:%d/%c%ld/%llx/%llu HTTP/1.0\r\n"
+                     "Host: 127.0.0.1:%d\r\nConnection: close\r\n\r\n",
+                     opts.origin_port, opts.chunked ? 'c' : 's', opts.size, (unsigned long long)run_id,
+                     (unsigned long long)key, opts.origin_port);
+
+    int sock = connect_proxy();
+    if (sock == -1) {
+        return -1;
+    }
+    if (send(sock, req, (size_t)n, MSG_NOSIGNAL) != n) {
+        close(sock);
+        return -1;
+    }
+
+    int status = 0;
+    uint64_t received = 0;
+    uint64_t began = now_us();
+    ssize_t r;
+    while ((r = recv(sock, buf, BENCH_RECV_BUF, 0)) > 0) {
+        if (received == 0 && r >= 12 && strncmp(buf, "HTTP/1.", 7) == 0) {
+            status = atoi(buf + 9);
+        }
+        received += (uint64_t)r;
+        if (opts.read_rate > 0) {
+            uint64_t due = began + received * 1000000ULL / (uint64_t)opts.read_rate;
+            uint64_t now = now_us();
+            if (due > now) {
+                usleep((useconds_t)(due - now));
+            }
+        }
+    }
+    close(sock);
+    w->bytes += received;
+    return (r == 0 && status >= 200 && status < 300) ? 0 : -1;
+}
+
+static void record_latency(bench_worker* w, uint64_t usec) {
+    if (w->latency_num == w->latency_cap) {
+        size_t cap = w->latency_cap == 0 ? BENCH_LATENCY_CHUNK : w->latency_cap * 2;
+        uint32_t* p = realloc(w->latency_us, cap * sizeof(*p));
+        if (p == NULL) {
+            return;
+        }
+        w->latency_us = p;
+        w->latency_cap = cap;
+    }
+    w->latency_us[w->latency_num++] = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+}
+
+static void* bench_thread(void* arg) {
+    bench_worker* w = (bench_worker*)arg;
+    char* buf = malloc(BENCH_RECV_BUF);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    while (1) {
+        uint64_t due;
+        if (opts.rate > 0) {
+            uint64_t ticket = atomic_fetch_add(&next_ticket, 1);
+            due = start_us + (uint64_t)((double)ticket * 1e6 / opts.rate);
+            if (due >= stop_us) {
+                break;
+            }
+            uint64_t now = now_us();
+            if (due > now) {
+                usleep((useconds_t)(due - now));
+            }
+        } else {
+            due = now_us();
+            if (due >= stop_us) {
+                break;
+            }
+        }
+
+        int rc = do_request(w, buf);
+        w->requests++;
+        if (rc != 0) {
+            w->errors++;
+        } else {
+            record_latency(w, now_us() - due);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const uint32_t* sorted, size_t n, double q) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t idx = (size_t)(q * (double)(n - 1));
+    return (double)sorted[idx] / 1000.0;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s -p proxy_port -o origin_port [-n name] [-t sec] [-c threads] [-r rate] "
+                    "[-k keys] [-z zipf_s] [-u] [-s size] [-C] [-R read_rate]\n", name);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:o:n:t:c:r:k:z:us:CR:")) != -1) {
+        switch (opt) {
+        case 'p': opts.proxy_port = atoi(optarg); break;
+        case 'o': opts.origin_port = atoi(optarg); break;
+        case 'n': opts.name = optarg; break;
+        case 't': opts.duration = atof(optarg); break;
+        case 'c': opts.threads = atoi(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'k': opts.keys = atol(optarg); break;
+        case 'z': opts.zipf = atof(optarg); break;
+        case 'u': opts.unique = 1; break;
+        case 's': opts.size = atol(optarg); break;
+        case 'C': opts.chunked = 1; break;
+        case 'R': opts.read_rate = atol(optarg); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (opts.proxy_port <= 0 || opts.origin_port <= 0 || opts.threads <= 0 || opts.keys <= 0 ||
+        opts.duration <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (opts.zipf > 0 && opts.keys > 1 && build_zipf() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    run_id = ((uint64_t)getpid() << 32) ^ now_us();
+    bench_worker* workers = calloc((size_t)opts.threads, sizeof(*workers));
+    pthread_t* tids = calloc((size_t)opts.threads, sizeof(*tids));
+    if (workers == NULL || tids == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    start_us = now_us();
+    stop_us = start_us + (uint64_t)(opts.duration * 1e6);
+    int started = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        workers[i].rng = run_id * 2654435761ULL + (uint64_t)i * 0x9e3779b97f4a7c15ULL + 1;
+        if (pthread_create(&tids[i], NULL, bench_thread, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = (double)(now_us() - start_us) / 1e6;
+
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    size_t total = 0;
+    for (int i = 0; i < started; i++) {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        total += workers[i].latency_num;
+    }
+    uint32_t* all = malloc((total > 0 ? total : 1) * sizeof(*all));
+    if (all == NULL) {
+        return EXIT_FAILURE;
+    }
+    size_t off = 0;
+    for (int i = 0; i < started; i++) {
+        memcpy(all + off, workers[i].latency_us, workers[i].latency_num * sizeof(*all));
+        off += workers[i].latency_num;
+        free(workers[i].latency_us);
+    }
+    qsort(all, total, sizeof(*all), compare_u32);
+
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"duration_s\":%.3f,"
+           "\"requests\":%llu,\"errors\":%llu,\"rps\":%.1f,\"mb_per_s\":%.2f,"
+           "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}\n",
+           opts.name, opts.rate > 0 ? "open" : "closed", opts.threads, elapsed,
+           (unsigned long long)requests, (unsigned long long)errors, (double)requests / elapsed,
+           (double)bytes / elapsed / 1e6, percentile_ms(all, total, 0.5), percentile_ms(all, total, 0.9),
+           percentile_ms(all, total, 0.99), percentile_ms(all, total, 0.999),
+           total > 0 ? (double)all[total - 1] / 1000.0 : 0.0);
+
+    free(all);
+    free(workers);
+    free(tids);
+    free(zipf_cdf);
+    return errors > 0 && errors == requests ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,71 +1,180 @@
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 #include "cache_map.h"
 #include "http_request.h"
 #include "http_utils.h"
+#include "mem_budget.h"
+#include "epoch.h"
+#include "shm_cache.h"
+
+// Общий сегмент нужен release_cache_node(), у которой нет мапы под рукой
+static shm_cache* shared_cache = NULL;
 
 void init_cache_map(Cache_Map* map) {
     if (map == NULL) {
         return;
     }
 
-    map->first = NULL;
+    for (size_t i = 0; i < CACHE_MAP_BUCKETS; i++) {
+        atomic_init(&map->buckets[i], NULL);
+    }
+    map->count = 0;
     map->total_size = 0;
-    map->num_requests = 0;
-    
-    pthread_rwlock_init(&map->lock, NULL);
+    map->max_size = MAX_SIZE_CACHE_MAP;
+    reset_cache_map_requests(map);
+    map->cleaner_fd = -1;
+    map->cleaner_percent = 100;
+    atomic_init(&map->cleaner_woken_ms, 0);
+    map->shared = NULL;
+
+    pthread_mutex_init(&map->lock, NULL);
+}
+
+void cache_map_attach_shared(Cache_Map* map, shm_cache* shared) {
+    if (map == NULL) {
+        return;
+    }
+    map->shared = shared;
+    shared_cache = shared;
+}
+
+void cache_map_stats(Cache_Map* map, size_t* entries, size_t* bytes, size_t* limit) {
+    if (map->shared != NULL) {
+        shm_cache_stats(map->shared, entries, bytes, limit);
+        return;
+    }
+    pthread_mutex_lock(&map->lock);
+    *entries = map->count;
+    pthread_mutex_unlock(&map->lock);
+    *bytes = atomic_load(&map->total_size);
+    *limit = atomic_load(&map->max_size);
 }
 
 void destroy_cache_map(Cache_Map* map) {
     if (map == NULL) {
         return;
     } 
-    Cache_Node* current = map->first, *tmp;
-    while (current != NULL) {
-        tmp = current->next;
-        destroy_cache_node(&current);
-        current = tmp;
+    for (size_t i = 0; i < CACHE_MAP_BUCKETS; i++) {
+        Cache_Node* current = atomic_load(&map->buckets[i]), *tmp;
+        while (current != NULL) {
+            tmp = atomic_load(&current->next);
+            evict_cache_node(&current);
+            current = tmp;
+        }
+        atomic_store(&map->buckets[i], NULL);
     }
-    map->first = NULL;
+    map->count = 0;
     map->total_size = 0;
-    pthread_rwlock_destroy(&map->lock);
+    epoch_reclaim();
+    pthread_mutex_destroy(&map->lock);
+}
+
+uint64_t cache_key_hash(const char* key) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int64_t cache_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec;
+}
+
+uint32_t cache_map_requests(Cache_Map* map) {
+    uint32_t total = 0;
+    for (int i = 0; i < CACHE_STAT_SHARDS; i++) {
+        total += atomic_load_explicit(&map->num_requests[i].value, memory_order_relaxed);
+    }
+    return total;
+}
+
+void reset_cache_map_requests(Cache_Map* map) {
+    for (int i = 0; i < CACHE_STAT_SHARDS; i++) {
+        atomic_store_explicit(&map->num_requests[i].value, 0, memory_order_relaxed);
+    }
 }
 
-int get_cache_map(Cache_Map* map, const char* key, char** out, size_t* out_size) {
+int get_cache_map(Cache_Map* map, const char* key, Cache_Node** out) {
     if (map == NULL || key == NULL) {
         return -1;
     }
 
-    pthread_rwlock_rdlock(&map->lock);
-    Cache_Node* current = map->first;
-    
-    atomic_fetch_add_explicit(&map->num_requests, 1, memory_order_relaxed);
+    if (map->shared != NULL) {
+        return shm_cache_get(map->shared, key, out);
+    }
+
+    uint64_t hash = cache_key_hash(key);
+
+    epoch_enter();
+    // Счетчик разбит по потокам, чтобы не гонять одну кэш-линию между ядрами
+    unsigned slot = epoch_thread_slot() % CACHE_STAT_SHARDS;
+    atomic_fetch_add_explicit(&map->num_requests[slot].value, 1, memory_order_relaxed);
 
+    Cache_Node* current = atomic_load_explicit(&map->buckets[hash % CACHE_MAP_BUCKETS], memory_order_acquire);
     while (current != NULL) {
-        if (strcmp(key, current->key) == 0) {
+        if (current->hash == hash && strcmp(key, current->key) == 0) {
             atomic_fetch_add_explicit(&current->hits, 1, memory_order_relaxed);
-            if (out != NULL && out_size != NULL) {
-                char* buf = malloc(current->size);
-                if (buf == NULL) { 
-                    pthread_rwlock_unlock(&map->lock);
-                    return -1; 
-                }
-                memcpy(buf, current->response, current->size);
-                *out = buf;
-                *out_size = current->size;
+            if (out != NULL) {
+                // Ссылка мапы снимается только после эпохи, так что узел еще жив
+                atomic_fetch_add_explicit(&current->refs, 1, memory_order_relaxed);
+                *out = current;
             }
-            pthread_rwlock_unlock(&map->lock);
+            epoch_exit();
             return 0;
         }
-        // tmp = current->next;
-        current = current->next;
+        current = atomic_load_explicit(&current->next, memory_order_acquire);
     }
 
-    pthread_rwlock_unlock(&map->lock);
+    epoch_exit();
 
     return 1;
 }
 
+int retain_cache_node(Cache_Node* node) {
+    if (node == NULL) {
+        return -1;
+    }
+    if (shm_cache_owns(shared_cache, node)) {
+        return shm_cache_retain(shared_cache, node);
+    }
+    atomic_fetch_add_explicit(&node->refs, 1, memory_order_relaxed);
+    return 0;
+}
+
+void release_cache_node(Cache_Node* node) {
+    if (node == NULL) {
+        return;
+    }
+    if (shm_cache_owns(shared_cache, node)) {
+        shm_cache_release(shared_cache, node);
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&node->refs, 1, memory_order_acq_rel) == 1) {
+        evict_cache_node(&node);
+    }
+}
+
+static void release_cache_node_cb(void* node) {
+    release_cache_node((Cache_Node*)node);
+}
+
+void unlink_cache_node(Cache_Map* map, _Atomic(Cache_Node*)* prev_ptr, Cache_Node* node) {
+    Cache_Node* next = atomic_load_explicit(&node->next, memory_order_relaxed);
+    atomic_store_explicit(prev_ptr, next, memory_order_release);
+    map->count--;
+    atomic_fetch_sub_explicit(&map->total_size, node->size, memory_order_relaxed);
+
+    // Читатели могли успеть взять указатель - отпускаем ссылку мапы после эпохи
+    epoch_retire(node, release_cache_node_cb);
+}
+
 int alloc_cache_node(Cache_Node** node) {
     if (node == NULL) {
         return -1;
@@ -76,10 +185,19 @@ int alloc_cache_node(Cache_Node** node) {
     }
 
     (*node)->key = NULL;
+    (*node)->hash = 0;
     (*node)->response = NULL;
     (*node)->size = 0;
-    (*node)->next = NULL;
-    (*node)->hits = 0;
+    (*node)->head_len = 0;
+    (*node)->encoding = CACHE_ENC_IDENTITY;
+    (*node)->fresh_until = INT64_MAX;
+    (*node)->stale_revalidate_until = INT64_MAX;
+    (*node)->stale_error_until = INT64_MAX;
+    atomic_init(&(*node)->revalidating, 0);
+    atomic_init(&(*node)->revalidate_after, 0);
+    atomic_init(&(*node)->next, NULL);
+    atomic_init(&(*node)->hits, 0);
+    atomic_init(&(*node)->refs, 1);
     // pthread_rwlock_init(&(*node)->lock, NULL);
     return 0;
 } 
@@ -102,10 +220,72 @@ void destroy_cache_node(Cache_Node** node) {
     *node = NULL;
 }
 
-int add_cache_map(Cache_Map* map, const char* key, const char* response, size_t size) {
+size_t cache_node_charge(const Cache_Node* node) {
+    size_t charge = sizeof(Cache_Node);
+    if (node->key != NULL) {
+        charge += strlen(node->key) + 1;
+    }
+    return charge;
+}
+
+void evict_cache_node(Cache_Node** node) {
+    if (node == NULL || *node == NULL) {
+        return;
+    }
+    mem_budget_release(MEM_CACHE_ENTRIES, (*node)->size);
+    mem_budget_release(MEM_CACHE_OVERHEAD, cache_node_charge(*node));
+    destroy_cache_node(node);
+}
+
+size_t cache_map_available(Cache_Map* map) {
+    if (map == NULL) {
+        return 0;
+    }
+    // Общий кэш вытесняет сам, ограничение только на размер одной записи
+    if (map->shared != NULL) {
+        return shm_cache_max_item(map->shared);
+    }
+
+    size_t total = atomic_load_explicit(&map->total_size, memory_order_relaxed);
+    size_t max_size = atomic_load_explicit(&map->max_size, memory_order_relaxed);
+    if (total >= max_size) {
+        return 0;
+    }
+    return max_size - total;
+}
+
+void set_cache_map_limit(Cache_Map* map, size_t max_size) {
+    if (map == NULL) {
+        return;
+    }
+    atomic_store_explicit(&map->max_size, max_size, memory_order_relaxed);
+}
+
+static void wake_cleaner(Cache_Map* map) {
+    if (map->cleaner_fd < 0) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t now_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    int64_t last = atomic_load_explicit(&map->cleaner_woken_ms, memory_order_relaxed);
+    if (now_ms - last < CLEANER_WAKE_INTERVAL_MS ||
+        !atomic_compare_exchange_strong(&map->cleaner_woken_ms, &last, now_ms)) {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t rc = write(map->cleaner_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+int add_cache_map(Cache_Map* map, const char* key, const char* response, size_t size,
+                  const cache_meta* meta) {
     if (map == NULL || key == NULL || response == NULL || size > MAX_SIZE_CACHE_NODE) {
         return -1;
     }
+    if (map->shared != NULL) {
+        return shm_cache_add(map->shared, key, response, size, meta);
+    }
     
     Cache_Node* node;
     if (alloc_cache_node(&node) == -1) {
@@ -125,36 +305,96 @@ int add_cache_map(Cache_Map* map, const char* key, const char* response, size_t
     memcpy(node->response, response, size);
     node->size = size;
 
-    // if (get_cache_map(map, key, NULL, NULL) == 0) {
-    //     return -1;
-    // }
-
-    pthread_rwlock_wrlock(&map->lock);
-
-    if (map->total_size + size > MAX_SIZE_CACHE_MAP) {
-        pthread_rwlock_unlock(&map->lock);
+    size_t overhead = cache_node_charge(node);
+    if (mem_budget_try_reserve(MEM_CACHE_OVERHEAD, overhead) != 0) {
         destroy_cache_node(&node);
         return -1;
     }
-    
-    Cache_Node* current = map->first, *tmp;
-    while (current != NULL) {
-        tmp = current->next;
-        if (strcmp(current->key, key) == 0) {
-            pthread_rwlock_unlock(&map->lock);
-            destroy_cache_node(&node);
-            return -1;
+    if (mem_budget_try_reserve(MEM_CACHE_ENTRIES, size) != 0) {
+        mem_budget_release(MEM_CACHE_OVERHEAD, overhead);
+        destroy_cache_node(&node);
+        return -1;
+    }
+    if (meta != NULL) {
+        node->head_len = meta->head_len;
+        node->encoding = meta->encoding;
+        node->fresh_until = meta->fresh_until;
+        node->stale_revalidate_until = meta->stale_revalidate_until;
+        node->stale_error_until = meta->stale_error_until;
+    }
+
+    node->hash = cache_key_hash(key);
+    _Atomic(Cache_Node*)* bucket = &map->buckets[node->hash % CACHE_MAP_BUCKETS];
+
+    pthread_mutex_lock(&map->lock);
+
+    // Ключ уже есть - это обновление (перезапрос устаревшей записи):
+    // новый узел встает на место старого, старый уходит через эпоху
+    _Atomic(Cache_Node*)* prev_ptr = bucket;
+    Cache_Node* current;
+    while ((current = atomic_load_explicit(prev_ptr, memory_order_relaxed)) != NULL) {
+        if (current->hash == node->hash && strcmp(current->key, key) == 0) {
+            break;
         }
-        current = tmp;
+        prev_ptr = &current->next;
     }
 
-    node->next = map->first;
-    map->first = node;
-    map->total_size += node->size;
-    pthread_rwlock_unlock(&map->lock);
+    // Место старого узла освобождается вместе с заменой
+    size_t max_size = atomic_load_explicit(&map->max_size, memory_order_relaxed);
+    size_t replaced = current != NULL ? current->size : 0;
+    if (map->total_size - replaced + size > max_size) {
+        pthread_mutex_unlock(&map->lock);
+        evict_cache_node(&node);
+        wake_cleaner(map);
+        return -1;
+    }
+
+    if (current != NULL) {
+        atomic_store_explicit(&node->next, atomic_load_explicit(&current->next, memory_order_relaxed),
+                              memory_order_relaxed);
+        atomic_store_explicit(&current->next, node, memory_order_release);
+        unlink_cache_node(map, prev_ptr, current);
+    } else {
+        atomic_store_explicit(&node->next, atomic_load_explicit(bucket, memory_order_relaxed),
+                              memory_order_relaxed);
+        // release: читатель, увидевший узел, увидит и его заполненные поля
+        atomic_store_explicit(bucket, node, memory_order_release);
+    }
+    map->count++;
+    size_t total = atomic_fetch_add_explicit(&map->total_size, node->size, memory_order_relaxed) + node->size;
+    int over = total >= (max_size / 100) * map->cleaner_percent;
+    pthread_mutex_unlock(&map->lock);
+
+    if (over) {
+        wake_cleaner(map);
+    }
     return 0;
 }
 
+// 304 от origin: тело прежнее, продлеваем срок жизни того же узла на месте.
+// Если узел уже заменен или вытеснен, продлевать нечего
+int refresh_cache_map(Cache_Map* map, Cache_Node* node, const cache_meta* meta) {
+    if (map == NULL || node == NULL || meta == NULL) {
+        return -1;
+    }
+    if (map->shared != NULL) {
+        return shm_cache_refresh(map->shared, node, meta);
+    }
+
+    pthread_mutex_lock(&map->lock);
+    Cache_Node* current = atomic_load_explicit(&map->buckets[node->hash % CACHE_MAP_BUCKETS], memory_order_relaxed);
+    while (current != NULL && current != node) {
+        current = atomic_load_explicit(&current->next, memory_order_relaxed);
+    }
+    if (current != NULL) {
+        node->fresh_until = meta->fresh_until;
+        node->stale_revalidate_until = meta->stale_revalidate_until;
+        node->stale_error_until = meta->stale_error_until;
+    }
+    pthread_mutex_unlock(&map->lock);
+    return current != NULL ? 0 : -1;
+}
+
 int build_cache_key(char* dst, size_t cap,
                     const char* host, const char* port,
                     const http_request* req) {
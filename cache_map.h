@@ -7,38 +7,113 @@
 #include <stdatomic.h>
 
 #include "http_request.h"
+#include "http_compress.h"
 
 #define MAX_SIZE_CACHE_NODE (1ULL * 1024 * 1024 * 1024)
 #define MAX_SIZE_CACHE_MAP (2ULL * 1024 * 1024 * 1024)
 
+#define CACHE_MAP_BUCKETS 16384
+#define CACHE_STAT_SHARDS 64
+// Будить чистильщика чаще нет смысла: проход все равно уводит кэш ниже порога
+#define CLEANER_WAKE_INTERVAL_MS 1000
+
 typedef struct Cache_Node {
     char* key;
+    uint64_t hash;
     char* response;
     size_t size;
+    size_t head_len;
+    cache_encoding encoding;
+
+    // Время по cache_clock(): до fresh_until отдаем как есть, дальше -
+    // устаревшим, пока не кончатся окна stale-while-revalidate и stale-if-error
+    int64_t fresh_until;
+    int64_t stale_revalidate_until;
+    int64_t stale_error_until;
+    // Фоновое обновление: не больше одного на узел, после неудачи - пауза
+    _Atomic int revalidating;
+    _Atomic int64_t revalidate_after;
 
     _Atomic uint32_t hits;
+    // Одна ссылка у самой мапы, остальные у тех, кто сейчас отдает ответ
+    _Atomic uint32_t refs;
 
-    struct Cache_Node* next;
+    _Atomic(struct Cache_Node*) next;
 } Cache_Node;
 
+typedef struct cache_meta {
+    size_t head_len;
+    cache_encoding encoding;
+    int64_t fresh_until;
+    int64_t stale_revalidate_until;
+    int64_t stale_error_until;
+} cache_meta;
+
+typedef struct cache_counter_shard {
+    _Atomic uint32_t value;
+} __attribute__((aligned(64))) cache_counter_shard;
+
+struct shm_cache;
+
 typedef struct Cache_Map {
-    Cache_Node* first;
-    size_t total_size;
-    _Atomic uint32_t num_requests;
-    pthread_rwlock_t lock;
+    // Читатели ходят по бакетам без блокировок, под эпохой;
+    // писатели сериализуются через lock и публикуют узлы атомарной записью
+    _Atomic(Cache_Node*) buckets[CACHE_MAP_BUCKETS];
+    size_t count;
+    _Atomic size_t total_size;
+    _Atomic size_t max_size;
+    cache_counter_shard num_requests[CACHE_STAT_SHARDS];
+    pthread_mutex_t lock;
+
+    // eventfd чистильщика: будим его, когда кэш перерос порог
+    int cleaner_fd;
+    size_t cleaner_percent;
+    _Atomic int64_t cleaner_woken_ms;
+
+    // Режим prefork: записи живут в общем сегменте, а не в бакетах выше
+    struct shm_cache* shared;
 } Cache_Map;
 
 void init_cache_map(Cache_Map* map);
 
 void destroy_cache_map(Cache_Map* map);
 
-int get_cache_map(Cache_Map* map, const char* key, char** out, size_t* out_size);
+uint64_t cache_key_hash(const char* key);
+
+int64_t cache_clock(void);
+
+int get_cache_map(Cache_Map* map, const char* key, Cache_Node** out);
+
+int retain_cache_node(Cache_Node* node);
+
+void release_cache_node(Cache_Node* node);
+
+void cache_map_attach_shared(Cache_Map* map, struct shm_cache* shared);
+
+void cache_map_stats(Cache_Map* map, size_t* entries, size_t* bytes, size_t* limit);
+
+uint32_t cache_map_requests(Cache_Map* map);
+
+void reset_cache_map_requests(Cache_Map* map);
 
 int alloc_cache_node(Cache_Node** node);
 
 void destroy_cache_node(Cache_Node** node);
 
-int add_cache_map(Cache_Map* map, const char* key, const char* response, size_t size);
+size_t cache_node_charge(const Cache_Node* node);
+
+void evict_cache_node(Cache_Node** node);
+
+void unlink_cache_node(Cache_Map* map, _Atomic(Cache_Node*)* prev_ptr, Cache_Node* node);
+
+size_t cache_map_available(Cache_Map* map);
+
+void set_cache_map_limit(Cache_Map* map, size_t max_size);
+
+int add_cache_map(Cache_Map* map, const char* key, const char* response, size_t size,
+                  const cache_meta* meta);
+
+int refresh_cache_map(Cache_Map* map, Cache_Node* node, const cache_meta* meta);
 
 int build_cache_key(char* dst, size_t cap,
                     const char* host, const char* port,
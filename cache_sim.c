@@ -0,0 +1,878 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "capture.h"
+#include "cache_map.h"
+#include "cleanup_thread.h"
+#include "mem_budget.h"
+#include "epoch.h"
+
+// Офлайн-симулятор политик вытеснения. Читает журнал доступа (PROXY_ACCESS_LOG)
+// или трассу (PROXY_CAPTURE) и прогоняет последовательность ключ/размер через
+// LRU, LFU, GDSF, W-TinyLFU и через настоящие Cache_Map + delete_cache,
+// для каждого объема кэша печатает долю попаданий по объектам и по байтам.
+//
+// cache_sim [-c 64M,256M,1G] [-p lru,lfu,gdsf,wtinylfu,proxy] [-P процент]
+//           [-i интервал_с] трасса...
+
+#define SIM_PROXY_PERCENT_FOR_DEL 50
+#define SIM_CLEANER_INTERVAL_SEC 5
+// По умолчанию объемы - доли от суммарного размера уникальных объектов
+static const double default_fractions[] = {0.01, 0.05, 0.10, 0.25, 0.50};
+
+#define TINYLFU_WINDOW_PERCENT 1
+#define TINYLFU_PROTECTED_PERCENT 80
+#define TINYLFU_ROWS 4
+#define TINYLFU_MAX_COUNT 15
+
+typedef struct {
+    uint64_t hash;
+    uint64_t size;
+    uint64_t time_us;
+    uint32_t key;           // строка ключа в key_strings, для Cache_Map
+} sim_request;
+
+static sim_request* trace = NULL;
+static size_t trace_num = 0;
+static char** key_strings = NULL;
+static size_t key_strings_num = 0;
+
+// ---- Общая часть модельных политик: пул записей, индекс, списки, куча ----
+
+typedef enum {
+    SEG_WINDOW,
+    SEG_PROBATION,
+    SEG_PROTECTED,
+    SEG_NUM
+} sim_segment;
+
+typedef struct {
+    uint64_t key;
+    uint64_t size;
+    uint64_t tick;
+    double priority;
+    uint32_t freq;
+    int32_t prev;
+    int32_t next;
+    int32_t heap_pos;
+    uint8_t segment;
+} sim_entry;
+
+typedef struct {
+    int32_t head;
+    int32_t tail;
+    uint64_t bytes;
+} sim_list;
+
+typedef struct {
+    uint64_t capacity;
+    uint64_t used;
+    uint64_t tick;
+
+    sim_entry* entries;
+    size_t entries_num;
+    size_t entries_cap;
+    int32_t free_list;
+
+    int32_t* slots;
+    size_t slots_mask;
+    size_t live;
+
+    sim_list lists[SEG_NUM];
+
+    int32_t* heap;
+    size_t heap_num;
+    size_t heap_cap;
+    double inflation;
+
+    uint8_t* sketch;
+    size_t sketch_mask;
+    uint64_t sketch_adds;
+    uint64_t sketch_reset_at;
+} sim_cache;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static int sim_init(sim_cache* c, uint64_t capacity) {
+    memset(c, 0, sizeof(*c));
+    c->capacity = capacity;
+    c->free_list = -1;
+    for (int i = 0; i < SEG_NUM; i++) {
+        c->lists[i].head = c->lists[i].tail = -1;
+    }
+    c->slots_mask = 1023;
+    c->slots = malloc((c->slots_mask + 1) * sizeof(*c->slots));
+    if (c->slots == NULL) {
+        return -1;
+    }
+    memset(c->slots, 0xff, (c->slots_mask + 1) * sizeof(*c->slots));
+    return 0;
+}
+
+static void sim_destroy(sim_cache* c) {
+    free(c->entries);
+    free(c->slots);
+    free(c->heap);
+    free(c->sketch);
+}
+
+static int32_t sim_find(const sim_cache* c, uint64_t key) {
+    for (size_t i = mix64(key) & c->slots_mask;; i = (i + 1) & c->slots_mask) {
+        int32_t idx = c->slots[i];
+        if (idx < 0) {
+            return -1;
+        }
+        if (c->entries[idx].key == key) {
+            return idx;
+        }
+    }
+}
+
+static void index_put(int32_t* slots, size_t mask, const sim_entry* entries, int32_t idx) {
+    size_t i = mix64(entries[idx].key) & mask;
+    while (slots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = idx;
+}
+
+static int index_insert(sim_cache* c, int32_t idx) {
+    if ((c->live + 1) * 2 > c->slots_mask + 1) {
+        size_t mask = c->slots_mask * 2 + 1;
+        int32_t* slots = malloc((mask + 1) * sizeof(*slots));
+        if (slots == NULL) {
+            return -1;
+        }
+        memset(slots, 0xff, (mask + 1) * sizeof(*slots));
+        for (size_t i = 0; i <= c->slots_mask; i++) {
+            if (c->slots[i] >= 0) {
+                index_put(slots, mask, c->entries, c->slots[i]);
+            }
+        }
+        free(c->slots);
+        c->slots = slots;
+        c->slots_mask = mask;
+    }
+    index_put(c->slots, c->slots_mask, c->entries, idx);
+    c->live++;
+    return 0;
+}
+
+// Линейное пробирование: после удаления сдвигаем хвост цепочки назад
+static void index_remove(sim_cache* c, uint64_t key) {
+    size_t i = mix64(key) & c->slots_mask;
+    while (c->entries[c->slots[i]].key != key) {
+        i = (i + 1) & c->slots_mask;
+    }
+    size_t hole = i;
+    for (size_t j = (hole + 1) & c->slots_mask; c->slots[j] >= 0; j = (j + 1) & c->slots_mask) {
+        size_t home = mix64(c->entries[c->slots[j]].key) & c->slots_mask;
+        if (((j - home) & c->slots_mask) >= ((j - hole) & c->slots_mask)) {
+            c->slots[hole] = c->slots[j];
+            hole = j;
+        }
+    }
+    c->slots[hole] = -1;
+    c->live--;
+}
+
+static int32_t entry_new(sim_cache* c, uint64_t key, uint64_t size) {
+    int32_t idx;
+    if (c->free_list >= 0) {
+        idx = c->free_list;
+        c->free_list = c->entries[idx].next;
+    } else {
+        if (c->entries_num == c->entries_cap) {
+            size_t cap = c->entries_cap == 0 ? 1024 : c->entries_cap * 2;
+            sim_entry* p = realloc(c->entries, cap * sizeof(*p));
+            if (p == NULL) {
+                return -1;
+            }
+            c->entries = p;
+            c->entries_cap = cap;
+        }
+        idx = (int32_t)c->entries_num++;
+    }
+    sim_entry* e = &c->entries[idx];
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+    e->size = size;
+    e->prev = e->next = e->heap_pos = -1;
+    if (index_insert(c, idx) != 0) {
+        e->next = c->free_list;
+        c->free_list = idx;
+        return -1;
+    }
+    c->used += size;
+    return idx;
+}
+
+static void entry_free(sim_cache* c, int32_t idx) {
+    sim_entry* e = &c->entries[idx];
+    index_remove(c, e->key);
+    c->used -= e->size;
+    e->next = c->free_list;
+    c->free_list = idx;
+}
+
+static void list_push_front(sim_cache* c, sim_segment seg, int32_t idx) {
+    sim_list* l = &c->lists[seg];
+    sim_entry* e = &c->entries[idx];
+    e->segment = (uint8_t)seg;
+    e->prev = -1;
+    e->next = l->head;
+    if (l->head >= 0) {
+        c->entries[l->head].prev = idx;
+    } else {
+        l->tail = idx;
+    }
+    l->head = idx;
+    l->bytes += e->size;
+}
+
+static void list_remove(sim_cache* c, int32_t idx) {
+    sim_entry* e = &c->entries[idx];
+    sim_list* l = &c->lists[e->segment];
+    if (e->prev >= 0) {
+        c->entries[e->prev].next = e->next;
+    } else {
+        l->head = e->next;
+    }
+    if (e->next >= 0) {
+        c->entries[e->next].prev = e->prev;
+    } else {
+        l->tail = e->prev;
+    }
+    l->bytes -= e->size;
+}
+
+static int heap_less(const sim_cache* c, int32_t a, int32_t b) {
+    const sim_entry* x = &c->entries[a];
+    const sim_entry* y = &c->entries[b];
+    if (x->priority != y->priority) {
+        return x->priority < y->priority;
+    }
+    return x->tick < y->tick;
+}
+
+static void heap_set(sim_cache* c, size_t pos, int32_t idx) {
+    c->heap[pos] = idx;
+    c->entries[idx].heap_pos = (int32_t)pos;
+}
+
+static void heap_fix(sim_cache* c, size_t pos) {
+    int32_t idx = c->heap[pos];
+    while (pos > 0 && heap_less(c, idx, c->heap[(pos - 1) / 2])) {
+        heap_set(c, pos, c->heap[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+    while (1) {
+        size_t child = pos * 2 + 1;
+        if (child >= c->heap_num) {
+            break;
+        }
+        if (child + 1 < c->heap_num && heap_less(c, c->heap[child + 1], c->heap[child])) {
+            child++;
+        }
+        if (!heap_less(c, c->heap[child], idx)) {
+            break;
+        }
+        heap_set(c, pos, c->heap[child]);
+        pos = child;
+    }
+    heap_set(c, pos, idx);
+}
+
+static int heap_push(sim_cache* c, int32_t idx) {
+    if (c->heap_num == c->heap_cap) {
+        size_t cap = c->heap_cap == 0 ? 1024 : c->heap_cap * 2;
+        int32_t* p = realloc(c->heap, cap * sizeof(*p));
+        if (p == NULL) {
+            return -1;
+        }
+        c->heap = p;
+        c->heap_cap = cap;
+    }
+    heap_set(c, c->heap_num++, idx);
+    heap_fix(c, c->heap_num - 1);
+    return 0;
+}
+
+static int32_t heap_pop(sim_cache* c) {
+    int32_t top = c->heap[0];
+    c->heap_num--;
+    if (c->heap_num > 0) {
+        heap_set(c, 0, c->heap[c->heap_num]);
+        heap_fix(c, 0);
+    }
+    c->entries[top].heap_pos = -1;
+    return top;
+}
+
+// ---- Политики. Каждая возвращает 1 при попадании ----
+
+static int lru_access(sim_cache* c, uint64_t key, uint64_t size) {
+    int32_t idx = sim_find(c, key);
+    if (idx >= 0) {
+        list_remove(c, idx);
+        list_push_front(c, SEG_WINDOW, idx);
+        return 1;
+    }
+    if (size > c->capacity) {
+        return 0;
+    }
+    while (c->used + size > c->capacity) {
+        int32_t victim = c->lists[SEG_WINDOW].tail;
+        list_remove(c, victim);
+        entry_free(c, victim);
+    }
+    idx = entry_new(c, key, size);
+    if (idx >= 0) {
+        list_push_front(c, SEG_WINDOW, idx);
+    }
+    return 0;
+}
+
+// LFU и GDSF отличаются только приоритетом в куче
+static int heap_access(sim_cache* c, uint64_t key, uint64_t size, int gdsf) {
+    c->tick++;
+    int32_t idx = sim_find(c, key);
+    if (idx >= 0) {
+        sim_entry* e = &c->entries[idx];
+        e->freq++;
+        e->tick = c->tick;
+        e->priority = gdsf ? c->inflation + (double)e->freq / (double)e->size : (double)e->freq;
+        heap_fix(c, (size_t)e->heap_pos);
+        return 1;
+    }
+    if (size > c->capacity || size == 0) {
+        return 0;
+    }
+    while (c->used + size > c->capacity) {
+        int32_t victim = heap_pop(c);
+        if (gdsf) {
+            c->inflation = c->entries[victim].priority;
+        }
+        entry_free(c, victim);
+    }
+    idx = entry_new(c, key, size);
+    if (idx < 0) {
+        return 0;
+    }
+    sim_entry* e = &c->entries[idx];
+    e->freq = 1;
+    e->tick = c->tick;
+    e->priority = gdsf ? c->inflation + 1.0 / (double)size : 1.0;
+    if (heap_push(c, idx) != 0) {
+        entry_free(c, idx);
+    }
+    return 0;
+}
+
+static int lfu_access(sim_cache* c, uint64_t key, uint64_t size) {
+    return heap_access(c, key, size, 0);
+}
+
+static int gdsf_access(sim_cache* c, uint64_t key, uint64_t size) {
+    return heap_access(c, key, size, 1);
+}
+
+// W-TinyLFU: маленькое LRU-окно, за ним SLRU (probation + protected).
+// Кандидат из окна вытесняет жертву main только если count-min sketch
+// видел его чаще. Счетчики 4-битные по смыслу и периодически делятся пополам
+static uint32_t sketch_estimate(const sim_cache* c, uint64_t key) {
+    uint32_t est = TINYLFU_MAX_COUNT;
+    uint64_t h = mix64(key);
+    for (int r = 0; r < TINYLFU_ROWS; r++) {
+        uint8_t v = c->sketch[(r * (c->sketch_mask + 1)) + ((h >> (r * 16)) & c->sketch_mask)];
+        if (v < est) {
+            est = v;
+        }
+    }
+    return est;
+}
+
+static void sketch_add(sim_cache* c, uint64_t key) {
+    uint64_t h = mix64(key);
+    for (int r = 0; r < TINYLFU_ROWS; r++) {
+        uint8_t* v = &c->sketch[(r * (c->sketch_mask + 1)) + ((h >> (r * 16)) & c->sketch_mask)];
+        if (*v < TINYLFU_MAX_COUNT) {
+            (*v)++;
+        }
+    }
+    if (++c->sketch_adds >= c->sketch_reset_at) {
+        for (size_t i = 0; i < TINYLFU_ROWS * (c->sketch_mask + 1); i++) {
+            c->sketch[i] >>= 1;
+        }
+        c->sketch_adds /= 2;
+    }
+}
+
+static int tinylfu_setup(sim_cache* c, uint64_t avg_size) {
+    uint64_t expected = c->capacity / (avg_size > 0 ? avg_size : 1);
+    size_t width = 1024;
+    while (width < expected * 2 && width < (1u << 24)) {
+        width *= 2;
+    }
+    c->sketch = calloc(TINYLFU_ROWS * width, 1);
+    if (c->sketch == NULL) {
+        return -1;
+    }
+    c->sketch_mask = width - 1;
+    c->sketch_reset_at = width * 10;
+    return 0;
+}
+
+static void tinylfu_admit(sim_cache* c, int32_t cand) {
+    uint64_t window_cap = c->capacity / 100 * TINYLFU_WINDOW_PERCENT;
+    uint64_t main_cap = c->capacity - window_cap;
+    sim_entry* e = &c->entries[cand];
+    uint32_t cand_freq = sketch_estimate(c, e->key);
+
+    if (e->size > main_cap) {
+        entry_free(c, cand);
+        return;
+    }
+    while (c->lists[SEG_PROBATION].bytes + c->lists[SEG_PROTECTED].bytes + e->size > main_cap) {
+        int32_t victim = c->lists[SEG_PROBATION].tail;
+        if (victim < 0) {
+            victim = c->lists[SEG_PROTECTED].tail;
+        }
+        if (cand_freq <= sketch_estimate(c, c->entries[victim].key)) {
+            entry_free(c, cand);
+            return;
+        }
+        list_remove(c, victim);
+        entry_free(c, victim);
+    }
+    list_push_front(c, SEG_PROBATION, cand);
+}
+
+static int tinylfu_access(sim_cache* c, uint64_t key, uint64_t size) {
+    sketch_add(c, key);
+    uint64_t window_cap = c->capacity / 100 * TINYLFU_WINDOW_PERCENT;
+    uint64_t protected_cap = (c->capacity - window_cap) / 100 * TINYLFU_PROTECTED_PERCENT;
+
+    int32_t idx = sim_find(c, key);
+    if (idx >= 0) {
+        sim_segment seg = (sim_segment)c->entries[idx].segment;
+        list_remove(c, idx);
+        if (seg == SEG_WINDOW) {
+            list_push_front(c, SEG_WINDOW, idx);
+            return 1;
+        }
+        list_push_front(c, SEG_PROTECTED, idx);
+        while (c->lists[SEG_PROTECTED].bytes > protected_cap) {
+            int32_t demoted = c->lists[SEG_PROTECTED].tail;
+            list_remove(c, demoted);
+            list_push_front(c, SEG_PROBATION, demoted);
+        }
+        return 1;
+    }
+    if (size > c->capacity || size == 0) {
+        return 0;
+    }
+
+    idx = entry_new(c, key, size);
+    if (idx < 0) {
+        return 0;
+    }
+    list_push_front(c, SEG_WINDOW, idx);
+    while (c->lists[SEG_WINDOW].bytes > window_cap) {
+        int32_t cand = c->lists[SEG_WINDOW].tail;
+        list_remove(c, cand);
+        tinylfu_admit(c, cand);
+    }
+    return 0;
+}
+
+// ---- Настоящий кэш прокси ----
+
+typedef struct {
+    Cache_Map* map;
+    uint64_t capacity;
+    size_t percent_for_del;
+    uint64_t interval_us;
+    uint64_t last_clean_us;
+    const char* payload;
+} proxy_sim;
+
+// Поток очистки здесь не нужен: будим delete_cache синхронно в тех же
+// местах, где add_cache_map разбудил бы cleaner, и по таймеру трассы
+static void proxy_clean(proxy_sim* p) {
+    delete_cache(p->map, p->capacity, p->percent_for_del);
+    epoch_reclaim();
+}
+
+static int proxy_access(proxy_sim* p, const sim_request* r) {
+    const char* key = key_strings[r->key];
+    if (r->time_us >= p->last_clean_us + p->interval_us) {
+        p->last_clean_us = r->time_us;
+        proxy_clean(p);
+    }
+
+    Cache_Node* node = NULL;
+    if (get_cache_map(p->map, key, &node) == 0) {
+        release_cache_node(node);
+        return 1;
+    }
+    if (r->size > MAX_SIZE_CACHE_NODE) {
+        return 0;
+    }
+    int rc = add_cache_map(p->map, key, p->payload, r->size, NULL);
+    size_t total = atomic_load(&p->map->total_size);
+    if (rc != 0 || total >= p->capacity / 100 * p->percent_for_del) {
+        proxy_clean(p);
+    }
+    return 0;
+}
+
+// ---- Загрузка трасс ----
+
+// Строки ключей храним по одной на уникальный хэш; поле size записи
+// в таблице интернирования - номер строки
+static sim_cache interned;
+
+static int push_request(uint64_t hash, uint64_t size, uint64_t time_us, const char* key) {
+    static size_t cap = 0;
+    static size_t keys_cap = 0;
+    if (interned.slots == NULL && sim_init(&interned, UINT64_MAX) != 0) {
+        return -1;
+    }
+    if (trace_num == cap) {
+        cap = cap == 0 ? 4096 : cap * 2;
+        sim_request* p = realloc(trace, cap * sizeof(*p));
+        if (p == NULL) {
+            return -1;
+        }
+        trace = p;
+    }
+    int32_t idx = sim_find(&interned, hash);
+    if (idx < 0) {
+        if (key_strings_num == keys_cap) {
+            keys_cap = keys_cap == 0 ? 4096 : keys_cap * 2;
+            char** p = realloc(key_strings, keys_cap * sizeof(*p));
+            if (p == NULL) {
+                return -1;
+            }
+            key_strings = p;
+        }
+        key_strings[key_strings_num] = strdup(key);
+        idx = entry_new(&interned, hash, key_strings_num);
+        if (key_strings[key_strings_num] == NULL || idx < 0) {
+            return -1;
+        }
+        key_strings_num++;
+    }
+    trace[trace_num].hash = hash;
+    trace[trace_num].size = size;
+    trace[trace_num].time_us = time_us;
+    trace[trace_num].key = (uint32_t)interned.entries[idx].size;
+    trace_num++;
+    return 0;
+}
+
+static int load_access_log(FILE* f) {
+    access_log_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.record_size != sizeof(access_record)) {
+        return -1;
+    }
+    access_record rec;
+    char key[32];
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        // Только то, что прокси вообще мог положить в кэш
+        if (rec.key_hash == 0 || rec.status != 200 || rec.bytes == 0) {
+            continue;
+        }
+        snprintf(key, sizeof(key), "%016llx", (unsigned long long)rec.key_hash);
+        if (push_request(rec.key_hash, rec.bytes, rec.timestamp_us, key) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int load_capture(FILE* f) {
+    unsigned long long offset, bytes;
+    size_t head_len;
+    char origin[512];
+    while (fscanf(f, "%llu %llu %511s %zu", &offset, &bytes, origin, &head_len) == 4) {
+        if (fgetc(f) != '\n' || head_len > (1 << 20)) {
+            return -1;
+        }
+        char* head = malloc(head_len + 1);
+        if (head == NULL || fread(head, 1, head_len, f) != head_len) {
+            free(head);
+            return -1;
+        }
+        head[head_len] = '\0';
+
+        char method[16];
+        char path[4096];
+        if (bytes > 0 && sscanf(head, "%15s %4095s", method, path) == 2 && strcmp(method, "GET") == 0) {
+            char key[4700];
+            snprintf(key, sizeof(key), "%s%s", origin, path);
+            if (push_request(cache_key_hash(key), bytes, offset, key) != 0) {
+                free(head);
+                return -1;
+            }
+        }
+        free(head);
+    }
+    return 0;
+}
+
+static int load_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char magic[8];
+    int rc = -1;
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic)) {
+        if (memcmp(magic, ACCESS_LOG_MAGIC, 4) == 0) {
+            rewind(f);
+            rc = load_access_log(f);
+        } else if (memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0 && fgetc(f) == '\n') {
+            rc = load_capture(f);
+        }
+    }
+    if (rc != 0) {
+        fprintf(stderr, "%s: unreadable trace\n", path);
+    }
+    fclose(f);
+    return rc;
+}
+
+// ---- Прогон ----
+
+typedef enum {
+    POLICY_LRU,
+    POLICY_LFU,
+    POLICY_GDSF,
+    POLICY_TINYLFU,
+    POLICY_PROXY,
+    POLICIES_NUM
+} sim_policy;
+
+static const char* policy_names[POLICIES_NUM] = {"lru", "lfu", "gdsf", "wtinylfu", "proxy"};
+
+typedef int (*sim_access_fn)(sim_cache*, uint64_t, uint64_t);
+static const sim_access_fn policy_fns[POLICIES_NUM] = {lru_access, lfu_access, gdsf_access, tinylfu_access, NULL};
+
+typedef struct {
+    uint64_t hits;
+    uint64_t hit_bytes;
+} sim_result;
+
+static size_t sim_percent = SIM_PROXY_PERCENT_FOR_DEL;
+static uint64_t sim_interval_us = SIM_CLEANER_INTERVAL_SEC * 1000000ULL;
+static char* payload = NULL;
+static uint64_t avg_size = 0;
+
+static int run_model(sim_policy policy, uint64_t capacity, sim_result* res) {
+    sim_cache c;
+    if (sim_init(&c, capacity) != 0) {
+        return -1;
+    }
+    if (policy == POLICY_TINYLFU && tinylfu_setup(&c, avg_size) != 0) {
+        sim_destroy(&c);
+        return -1;
+    }
+    for (size_t i = 0; i < trace_num; i++) {
+        if (policy_fns[policy](&c, trace[i].hash, trace[i].size)) {
+            res->hits++;
+            res->hit_bytes += trace[i].size;
+        }
+    }
+    sim_destroy(&c);
+    return 0;
+}
+
+static int run_proxy(uint64_t capacity, sim_result* res) {
+    Cache_Map* map = malloc(sizeof(*map));
+    if (map == NULL) {
+        return -1;
+    }
+    init_cache_map(map);
+    set_cache_map_limit(map, capacity);
+    map->cleaner_percent = sim_percent;
+
+    proxy_sim p = {
+        .map = map,
+        .capacity = capacity,
+        .percent_for_del = sim_percent,
+        .interval_us = sim_interval_us,
+        .last_clean_us = trace_num > 0 ? trace[0].time_us : 0,
+        .payload = payload,
+    };
+    for (size_t i = 0; i < trace_num; i++) {
+        if (proxy_access(&p, &trace[i])) {
+            res->hits++;
+            res->hit_bytes += trace[i].size;
+        }
+    }
+    destroy_cache_map(map);
+    epoch_reclaim();
+    free(map);
+    return 0;
+}
+
+static uint64_t parse_size(const char* s) {
+    char* end;
+    double v = strtod(s, &end);
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; break;
+    case 'm': case 'M': v *= 1024 * 1024; break;
+    case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+    default: break;
+    }
+    return (uint64_t)v;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-c sizes] [-p policies] [-P percent_for_del] [-i interval_sec] trace...\n", name);
+}
+
+int main(int argc, char** argv) {
+    const char* sizes_arg = NULL;
+    const char* policies_arg = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:p:P:i:")) != -1) {
+        switch (opt) {
+        case 'c': sizes_arg = optarg; break;
+        case 'p': policies_arg = optarg; break;
+        case 'P': sim_percent = (size_t)atol(optarg); break;
+        case 'i': sim_interval_us = (uint64_t)(atof(optarg) * 1e6); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || sim_percent == 0 || sim_percent > 100) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (load_file(argv[i]) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (trace_num == 0) {
+        fprintf(stderr, "no cacheable requests in trace\n");
+        return EXIT_FAILURE;
+    }
+
+    // Рабочий набор: уникальные ключи и их размер (берем последний увиденный)
+    sim_cache uniq;
+    if (sim_init(&uniq, UINT64_MAX) != 0) {
+        return EXIT_FAILURE;
+    }
+    uint64_t total_bytes = 0;
+    uint64_t max_size = 0;
+    for (size_t i = 0; i < trace_num; i++) {
+        total_bytes += trace[i].size;
+        if (trace[i].size > max_size) {
+            max_size = trace[i].size;
+        }
+        int32_t idx = sim_find(&uniq, trace[i].hash);
+        if (idx < 0) {
+            (void)entry_new(&uniq, trace[i].hash, trace[i].size);
+        } else {
+            uniq.used += trace[i].size - uniq.entries[idx].size;
+            uniq.entries[idx].size = trace[i].size;
+        }
+    }
+    uint64_t unique_bytes = uniq.used;
+    size_t unique_num = uniq.live;
+    sim_destroy(&uniq);
+    avg_size = unique_bytes / (unique_num > 0 ? unique_num : 1);
+
+    uint64_t capacities[32];
+    size_t capacities_num = 0;
+    if (sizes_arg != NULL) {
+        char* copy = strdup(sizes_arg);
+        for (char* tok = strtok(copy, ","); tok != NULL && capacities_num < 32; tok = strtok(NULL, ",")) {
+            capacities[capacities_num++] = parse_size(tok);
+        }
+        free(copy);
+    } else {
+        for (size_t i = 0; i < sizeof(default_fractions) / sizeof(default_fractions[0]); i++) {
+            capacities[capacities_num++] = (uint64_t)((double)unique_bytes * default_fractions[i]);
+        }
+    }
+
+    int enabled[POLICIES_NUM] = {0};
+    if (policies_arg == NULL) {
+        for (int i = 0; i < POLICIES_NUM; i++) {
+            enabled[i] = 1;
+        }
+    } else {
+        char* copy = strdup(policies_arg);
+        for (char* tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+            int found = 0;
+            for (int i = 0; i < POLICIES_NUM; i++) {
+                if (strcasecmp(tok, policy_names[i]) == 0) {
+                    enabled[i] = found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "unknown policy %s\n", tok);
+                free(copy);
+                return EXIT_FAILURE;
+            }
+        }
+        free(copy);
+    }
+
+    // Настоящему кэшу нужно настоящее тело, чтобы было что копировать
+    if (enabled[POLICY_PROXY]) {
+        init_mem_budget(SIZE_MAX / 2);
+        payload = calloc(1, max_size > MAX_SIZE_CACHE_NODE ? MAX_SIZE_CACHE_NODE : max_size);
+        if (payload == NULL) {
+            perror("payload calloc");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("requests %zu, unique objects %zu, unique bytes %llu, requested bytes %llu\n", trace_num, unique_num,
+           (unsigned long long)unique_bytes, (unsigned long long)total_bytes);
+    printf("%-10s %14s %10s %10s\n", "policy", "capacity", "obj_hit%", "byte_hit%");
+    for (size_t ci = 0; ci < capacities_num; ci++) {
+        for (int pi = 0; pi < POLICIES_NUM; pi++) {
+            if (!enabled[pi]) {
+                continue;
+            }
+            sim_result res = {0};
+            int rc = pi == POLICY_PROXY ? run_proxy(capacities[ci], &res)
+                                        : run_model((sim_policy)pi, capacities[ci], &res);
+            if (rc != 0) {
+                fprintf(stderr, "%s: out of memory\n", policy_names[pi]);
+                continue;
+            }
+            printf("%-10s %14llu %9.2f%% %9.2f%%\n", policy_names[pi], (unsigned long long)capacities[ci],
+                   100.0 * (double)res.hits / (double)trace_num,
+                   100.0 * (double)res.hit_bytes / (double)(total_bytes > 0 ? total_bytes : 1));
+        }
+    }
+
+    free(payload);
+    for (size_t i = 0; i < key_strings_num; i++) {
+        free(key_strings[i]);
+    }
+    free(key_strings);
+    sim_destroy(&interned);
+    free(trace);
+    return EXIT_SUCCESS;
+}
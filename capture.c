@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include "capture.h"
+#include "config.h"
+#include "metrics.h"
+
+static _Atomic int capture_fd = -1;
+static uint64_t capture_start_us = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// PROXY_CAPTURE - куда писать трассу. Режим отладочный: запись идет
+// одним writev под мьютексом, на боевой нагрузке его не включают
+int init_capture(void) {
+    const char* path = config_get_str("PROXY_CAPTURE", NULL);
+    if (path == NULL) {
+        return 0;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (write(fd, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != (ssize_t)strlen(CAPTURE_MAGIC)) {
+        close(fd);
+        return -1;
+    }
+    capture_start_us = metrics_now_us();
+    capture_fd = fd;
+    return 0;
+}
+
+int capture_enabled(void) {
+    return capture_fd != -1;
+}
+
+void capture_request(uint64_t started_us, const char* host, const char* port, const dynbuf* head,
+                     uint64_t bytes) {
+    if (capture_fd == -1 || head == NULL || head->len == 0) {
+        return;
+    }
+
+    char line[512];
+    uint64_t offset = started_us > capture_start_us ? started_us - capture_start_us : 0;
+    int n = snprintf(line, sizeof(line), "%llu %llu %s:%s %zu\n", (unsigned long long)offset,
+                     (unsigned long long)bytes, host, port, head->len);
+    if (n < 0 || (size_t)n >= sizeof(line)) {
+        return;
+    }
+
+    struct iovec iov[2] = {
+        {.iov_base = line, .iov_len = (size_t)n},
+        {.iov_base = head->data, .iov_len = head->len},
+    };
+    pthread_mutex_lock(&capture_lock);
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    int fd = capture_fd;
+    ssize_t written = fd != -1 ? writev(fd, iov, 2) : -1;
+    if (written >= 0 && (size_t)written != total) {
+        // Короткая запись в обычный файл - почти наверняка кончилось место;
+        // дописывать хвост нет смысла, трасса дальше все равно битая
+        close(fd);
+        capture_fd = -1;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
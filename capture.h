@@ -0,0 +1,22 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+#include "dynamic_buffer.h"
+
+// Запись трассы запросов для trace_replay. Формат файла: строка
+// CAPTURE_MAGIC, дальше на каждый запрос строка
+// "<смещение мкс> <байт ответа> <host:port> <длина заголовка>\n"
+// и сам заголовок запроса как есть.
+
+#define CAPTURE_MAGIC "PXTRACE1\n"
+
+int init_capture(void);
+
+int capture_enabled(void);
+
+void capture_request(uint64_t started_us, const char* host, const char* port, const dynbuf* head,
+                     uint64_t bytes);
+
+#endif
@@ -2,20 +2,101 @@
 #include <stdatomic.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "cleanup_thread.h"
+#include "mem_pressure.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "probes.h"
 
 
+int init_cache_cleaner(cache_cleaner_args *args) {
+    if (args == NULL || args->map == NULL) {
+        return -1;
+    }
+
+    args->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (args->wake_fd < 0) {
+        return -1;
+    }
+    // Если PSI недоступен (старое ядро, нет прав), давление читаем по таймеру
+    args->psi_fd = open_psi_trigger();
+
+    set_cache_map_limit(args->map, args->max_size_bytes);
+    args->map->cleaner_percent = args->percent_for_del;
+    args->map->cleaner_fd = args->wake_fd;
+    return 0;
+}
+
+size_t adjust_cache_limit(size_t base, size_t current, double pressure) {
+    size_t floor = base / 100 * MIN_CACHE_PERCENT;
+
+    if (pressure >= PRESSURE_HIGH) {
+        double factor = pressure / 100.0 * PRESSURE_SHRINK_GAIN;
+        if (factor < 0.05) {
+            factor = 0.05;
+        }
+        if (factor > 0.5) {
+            factor = 0.5;
+        }
+        size_t next = current - (size_t)((double)current * factor);
+        return next < floor ? floor : next;
+    }
+
+    if (pressure < PRESSURE_LOW && current < base) {
+        size_t next = current + base / 100 * GROW_STEP_PERCENT;
+        return next > base ? base : next;
+    }
+    return current;
+}
+
 void* cache_cleaner_thread(void *arg) {
     cache_cleaner_args *a = (cache_cleaner_args*)arg;
-    if (a == NULL || a->map == NULL) {
+    if (a == NULL || a->map == NULL || a->wake_fd < 0) {
         return NULL;
     }
 
+    size_t current = a->max_size_bytes;
+
+    struct pollfd fds[2];
+    nfds_t nfds = 1;
+    fds[0].fd = a->wake_fd;
+    fds[0].events = POLLIN;
+    if (a->psi_fd >= 0) {
+        fds[1].fd = a->psi_fd;
+        fds[1].events = POLLPRI;
+        nfds = 2;
+    }
+
     while (1) {
-        sleep(a->interval_sec);
+        int rc = poll(fds, nfds, (int)(a->interval_sec * 1000));
+        if (rc < 0) {
+            continue;
+        }
 
-        delete_cache(a->map, a->max_size_bytes, a->percent_for_del);
+        if (fds[0].revents & POLLIN) {
+            uint64_t cnt;
+            ssize_t r = read(a->wake_fd, &cnt, sizeof(cnt));
+            (void)r;
+        }
+        if (nfds == 2 && (fds[1].revents & POLLERR)) {
+            // cgroup удалили или триггер сломался - дальше только по таймеру
+            close(a->psi_fd);
+            a->psi_fd = -1;
+            nfds = 1;
+        }
+
+        size_t next = adjust_cache_limit(a->max_size_bytes, current, read_memory_pressure());
+        if (next != current) {
+            current = next;
+            set_cache_map_limit(a->map, current);
+        }
+
+        delete_cache(a->map, current, a->percent_for_del);
+        // Узлы, выкинутые писателями, освобождаются, когда пройдут эпохи
+        epoch_reclaim();
     }
     return NULL;
 }
@@ -36,75 +117,94 @@ static int cmp_hits_asc(const void *a, const void *b) {
     return 0;
 }
 
+static void unlink_from_bucket(Cache_Map *map, Cache_Node *node) {
+    _Atomic(Cache_Node*) *prev_ptr = &map->buckets[node->hash % CACHE_MAP_BUCKETS];
+    Cache_Node *cur;
+    while ((cur = atomic_load_explicit(prev_ptr, memory_order_relaxed)) != NULL) {
+        if (cur == node) {
+            unlink_cache_node(map, prev_ptr, cur);
+            return;
+        }
+        prev_ptr = &cur->next;
+    }
+}
+
 int delete_cache(Cache_Map *map, size_t max_size_bytes, size_t percent_for_del) {
     if (map == NULL || percent_for_del > 100) {
         return -1;
     }
+    // Общий кэш вытесняет по LRU сам, при выделении чанков
+    if (map->shared != NULL) {
+        return 0;
+    }
     
-    pthread_rwlock_wrlock(&map->lock);
+    pthread_mutex_lock(&map->lock);
 
     if (map->total_size < (max_size_bytes * percent_for_del) / 100) {
-        pthread_rwlock_unlock(&map->lock);
+        pthread_mutex_unlock(&map->lock);
         return 0; 
     }
     
-    uint32_t num_reqs = atomic_load_explicit(&map->num_requests, memory_order_relaxed);
-    if (num_reqs == 0) {
-        pthread_rwlock_unlock(&map->lock);
+    // Без запросов вытеснять незачем, но если лимит урезали под давлением
+    // памяти, кэш нужно ужать и в тишине
+    uint32_t num_reqs = cache_map_requests(map);
+    if (num_reqs == 0 && map->total_size <= max_size_bytes) {
+        pthread_mutex_unlock(&map->lock);
         return 0;
     }
 
-    size_t n = 0;
-    Cache_Node* current = map->first;
-    while(current != NULL) {
-        n++;
-        current = current->next;
-    }
-
+    size_t n = map->count;
     if (n == 0) {
-        pthread_rwlock_unlock(&map->lock);
+        pthread_mutex_unlock(&map->lock);
         return 0;
     }
 
     Cache_Node **arr = malloc(n * sizeof(*arr));
     if (!arr) {
-        pthread_rwlock_unlock(&map->lock);
+        pthread_mutex_unlock(&map->lock);
         return -1;
     }
 
     size_t i = 0;
-    current = map->first;
-    while(current != NULL) {
-        arr[i] = current;
-        i++;
-        current = current->next;
+    for (size_t b = 0; b < CACHE_MAP_BUCKETS && i < n; b++) {
+        Cache_Node* current = atomic_load_explicit(&map->buckets[b], memory_order_relaxed);
+        while(current != NULL && i < n) {
+            arr[i] = current;
+            i++;
+            current = atomic_load_explicit(&current->next, memory_order_relaxed);
+        }
     }
+    n = i;
 
-    qsort(arr, n, sizeof(*arr), cmp_hits_asc);
-
-    size_t k = n / 3;
-    if (k == 0 && n > 0) k = 1;
+    uint64_t started_us = metrics_now_us();
+    size_t size_before = map->total_size;
+    size_t evicted = 0;
+    PROBE3(evict_start, size_before, max_size_bytes, n);
 
-    uint32_t cutoff = atomic_load_explicit(&arr[k - 1]->hits, memory_order_relaxed);
-
-    Cache_Node **prev_ptr = &map->first;
-    while (*prev_ptr) {
-        Cache_Node *cur = *prev_ptr;
-        uint32_t h = atomic_load_explicit(&cur->hits, memory_order_relaxed);
-
-        if (h <= cutoff) {
-            *prev_ptr = cur->next;
-            map->total_size -= cur->size;
-            destroy_cache_node(&cur);
-            continue;
-        }
+    qsort(arr, n, sizeof(*arr), cmp_hits_asc);
 
-        atomic_store_explicit(&cur->hits, 0, memory_order_relaxed);
-        prev_ptr = &cur->next;
+    size_t low_percent = percent_for_del > CLEANER_LOW_WATER_GAP_PERCENT ?
+                         percent_for_del - CLEANER_LOW_WATER_GAP_PERCENT : 0;
+    size_t low_water = (max_size_bytes * low_percent) / 100;
+
+    // Самые редко запрашиваемые уходят, пока кэш не опустится до нижней отметки
+    size_t i_evict = 0;
+    while (i_evict < n && map->total_size > low_water) {
+        unlink_from_bucket(map, arr[i_evict]);
+        metrics_add(METRIC_EVICTIONS, 1);
+        evicted++;
+        i_evict++;
+    }
+    for (size_t j = i_evict; j < n; j++) {
+        atomic_store_explicit(&arr[j]->hits, 0, memory_order_relaxed);
     }
 
-    atomic_store_explicit(&map->num_requests, 0, memory_order_relaxed);
+    reset_cache_map_requests(map);
     free(arr);
-    pthread_rwlock_unlock(&map->lock);
+    size_t size_after = map->total_size;
+    pthread_mutex_unlock(&map->lock);
+    PROBE3(evict_done, evicted, size_before - size_after, metrics_now_us() - started_us);
+
+    epoch_reclaim();
     return 0;
 }
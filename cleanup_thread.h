@@ -4,15 +4,32 @@
 #include <stdlib.h>
 #include "cache_map.h"
 
+// avg10 из PSI в процентах: выше HIGH - ужимаем кэш, ниже LOW - отращиваем обратно
+#define PRESSURE_HIGH 1.0
+#define PRESSURE_LOW 0.1
+#define PRESSURE_SHRINK_GAIN 5.0
+#define MIN_CACHE_PERCENT 10
+#define GROW_STEP_PERCENT 10
+// Чистка начинается на percent_for_del и идет до отметки на столько ниже:
+// иначе кэш висит на пороге и каждая вставка запускает новый проход
+#define CLEANER_LOW_WATER_GAP_PERCENT 10
+
 typedef struct {
     Cache_Map *map;
     size_t max_size_bytes;        
     unsigned long interval_sec;        
     size_t percent_for_del;         
+
+    int wake_fd;
+    int psi_fd;
 } cache_cleaner_args;
 
+int init_cache_cleaner(cache_cleaner_args *args);
+
 void* cache_cleaner_thread(void *arg);
 
+size_t adjust_cache_limit(size_t base, size_t current, double pressure);
+
 int delete_cache(Cache_Map *map, size_t max_size_bytes, size_t percent_for_del);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+
+#include "conc_limiter.h"
+#include "config.h"
+#include "metrics.h"
+
+// Gradient в духе Netflix concurrency-limits: сравниваем текущую задержку с
+// долгой средней. Пока они близки, лимит растет на sqrt(limit) (это запас
+// очереди), когда текущая задержка растет, лимит сжимается пропорционально.
+#define GRADIENT_TOLERANCE 1.5
+#define GRADIENT_SMOOTHING 0.2
+#define GRADIENT_LONG_WINDOW 600
+#define GRADIENT_WARMUP 10
+#define DROP_BACKOFF 0.9
+
+struct conc_origin {
+    char* name;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    double limit;
+    int in_flight;
+    int queued;
+    double long_rtt;
+    unsigned long samples;
+    unsigned long rejected;
+};
+
+static struct {
+    conc_algorithm algorithm;
+    double initial;
+    double min_limit;
+    double max_limit;
+    long queue_timeout_ms;
+    int max_queue;
+    uint64_t aimd_timeout_ns;
+
+    pthread_mutex_t table_lock;
+    conc_origin* table[CONC_MAX_ORIGINS];
+    int origins;
+    // Когда origin'ов больше таблицы, остальные делят один общий лимит
+    conc_origin* overflow;
+} limiter = {
+    .algorithm = CONC_GRADIENT,
+    .initial = CONC_INITIAL_LIMIT,
+    .min_limit = CONC_MIN_LIMIT,
+    .max_limit = CONC_MAX_LIMIT,
+    .queue_timeout_ms = CONC_QUEUE_TIMEOUT_MS,
+    .max_queue = CONC_MAX_QUEUE,
+    .aimd_timeout_ns = (uint64_t)CONC_AIMD_TIMEOUT_MS * 1000000ULL,
+    .table_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static double clamp_limit(double limit) {
+    if (limit < limiter.min_limit) {
+        return limiter.min_limit;
+    }
+    if (limit > limiter.max_limit) {
+        return limiter.max_limit;
+    }
+    return limit;
+}
+
+void init_conc_limiter(void) {
+    const char* algo = config_get_str("PROXY_CONC_ALGORITHM", "gradient");
+    if (strcmp(algo, "aimd") == 0) {
+        limiter.algorithm = CONC_AIMD;
+    } else if (strcmp(algo, "fixed") == 0) {
+        limiter.algorithm = CONC_FIXED;
+    } else {
+        limiter.algorithm = CONC_GRADIENT;
+    }
+
+    limiter.min_limit = (double)config_get_long("PROXY_CONC_MIN", CONC_MIN_LIMIT);
+    if (limiter.min_limit < 1) {
+        limiter.min_limit = 1;
+    }
+    limiter.max_limit = (double)config_get_long("PROXY_CONC_MAX", CONC_MAX_LIMIT);
+    if (limiter.max_limit < limiter.min_limit) {
+        limiter.max_limit = limiter.min_limit;
+    }
+    limiter.initial = clamp_limit((double)config_get_long("PROXY_CONC_INITIAL", CONC_INITIAL_LIMIT));
+    limiter.queue_timeout_ms = config_get_long("PROXY_CONC_QUEUE_MS", CONC_QUEUE_TIMEOUT_MS);
+    limiter.max_queue = (int)config_get_long("PROXY_CONC_MAX_QUEUE", CONC_MAX_QUEUE);
+    limiter.aimd_timeout_ns = (uint64_t)config_get_long("PROXY_CONC_AIMD_TIMEOUT_MS", CONC_AIMD_TIMEOUT_MS) * 1000000ULL;
+}
+
+static conc_origin* create_origin(const char* name) {
+    conc_origin* o = calloc(1, sizeof(*o));
+    if (o == NULL) {
+        return NULL;
+    }
+    o->name = strdup(name);
+    if (o->name == NULL) {
+        free(o);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&o->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&o->lock, NULL);
+
+    o->limit = limiter.initial;
+    return o;
+}
+
+static unsigned long origin_hash(const char* s) {
+    unsigned long h = 5381;
+    while (*s) {
+        h = h * 33 + (unsigned char)*s++;
+    }
+    return h;
+}
+
+// Записи origin'ов живут до конца процесса: их немного, а без удаления
+// указатель из permit'а всегда остается валидным
+static conc_origin* find_origin(const char* host, const char* port, int create) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s:%s", host, port);
+
+    unsigned long h = origin_hash(name);
+    conc_origin* found = NULL;
+
+    pthread_mutex_lock(&limiter.table_lock);
+    for (int i = 0; i < CONC_MAX_ORIGINS; i++) {
+        int idx = (int)((h + (unsigned long)i) % CONC_MAX_ORIGINS);
+        conc_origin* o = limiter.table[idx];
+        if (o == NULL) {
+            if (create && limiter.origins < CONC_MAX_ORIGINS * 3 / 4) {
+                o = create_origin(name);
+                if (o != NULL) {
+                    limiter.table[idx] = o;
+                    limiter.origins++;
+                }
+                found = o;
+            }
+            break;
+        }
+        if (strcmp(o->name, name) == 0) {
+            found = o;
+            break;
+        }
+    }
+
+    if (found == NULL && create) {
+        if (limiter.overflow == NULL) {
+            limiter.overflow = create_origin("*");
+        }
+        found = limiter.overflow;
+    }
+    pthread_mutex_unlock(&limiter.table_lock);
+    return found;
+}
+
+// Разрешение запроса, который обслуживает этот поток: заголовок ответа
+// разбирается в http_utils, и отметку времени он ставит сюда
+static __thread conc_permit* current = NULL;
+
+int conc_acquire(const char* host, const char* port, conc_permit* permit) {
+    permit->origin = NULL;
+    permit->start_ns = 0;
+    permit->head_ns = 0;
+
+    conc_origin* o = find_origin(host, port, 1);
+    if (o == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&o->lock);
+    if (o->in_flight >= (int)o->limit) {
+        if (o->queued >= limiter.max_queue || limiter.queue_timeout_ms <= 0) {
+            o->rejected++;
+            pthread_mutex_unlock(&o->lock);
+            return -1;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += limiter.queue_timeout_ms / 1000;
+        deadline.tv_nsec += (limiter.queue_timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        o->queued++;
+        metrics_add(METRIC_UPSTREAM_QUEUE, 1);
+        while (o->in_flight >= (int)o->limit) {
+            if (pthread_cond_timedwait(&o->cond, &o->lock, &deadline) == ETIMEDOUT &&
+                o->in_flight >= (int)o->limit) {
+                o->queued--;
+                metrics_add(METRIC_UPSTREAM_QUEUE, -1);
+                o->rejected++;
+                pthread_mutex_unlock(&o->lock);
+                return -1;
+            }
+        }
+        o->queued--;
+        metrics_add(METRIC_UPSTREAM_QUEUE, -1);
+    }
+    o->in_flight++;
+    pthread_mutex_unlock(&o->lock);
+
+    permit->origin = o;
+    permit->start_ns = now_ns();
+    current = permit;
+    return 0;
+}
+
+void conc_first_byte(void) {
+    conc_permit* p = current;
+    if (p != NULL && p->origin != NULL && p->head_ns == 0) {
+        p->head_ns = now_ns() - p->start_ns;
+    }
+}
+
+static void update_gradient(conc_origin* o, double rtt) {
+    o->samples++;
+    if (o->samples <= GRADIENT_WARMUP) {
+        o->long_rtt += (rtt - o->long_rtt) / (double)o->samples;
+    } else {
+        double alpha = 2.0 / (GRADIENT_LONG_WINDOW + 1);
+        o->long_rtt = o->long_rtt * (1 - alpha) + rtt * alpha;
+    }
+
+    // Долгая средняя сильно выше текущей: нагрузка спала, пусть догоняет быстрее
+    if (o->long_rtt / rtt > 2.0) {
+        o->long_rtt *= 0.95;
+    }
+
+    // Недогруженный лимит ничего не говорит о том, сколько выдержит origin
+    if (o->in_flight + 1 < o->limit / 2) {
+        return;
+    }
+
+    double gradient = GRADIENT_TOLERANCE * o->long_rtt / rtt;
+    if (gradient < 0.5) {
+        gradient = 0.5;
+    } else if (gradient > 1.0) {
+        gradient = 1.0;
+    }
+
+    double new_limit = o->limit * gradient + sqrt(o->limit);
+    o->limit = clamp_limit(o->limit * (1 - GRADIENT_SMOOTHING) + new_limit * GRADIENT_SMOOTHING);
+}
+
+static void update_aimd(conc_origin* o, uint64_t rtt_ns) {
+    if (rtt_ns > limiter.aimd_timeout_ns) {
+        o->limit = clamp_limit(o->limit * DROP_BACKOFF);
+        return;
+    }
+    if ((o->in_flight + 1) * 2 >= (int)o->limit) {
+        o->limit = clamp_limit(o->limit + 1.0 / o->limit);
+    }
+}
+
+void conc_release(conc_permit* permit, conc_outcome outcome) {
+    conc_origin* o = permit->origin;
+    if (o == NULL) {
+        return;
+    }
+    permit->origin = NULL;
+    if (current == permit) {
+        current = NULL;
+    }
+
+    uint64_t rtt_ns = permit->head_ns != 0 ? permit->head_ns : now_ns() - permit->start_ns;
+    if (rtt_ns == 0) {
+        rtt_ns = 1;
+    }
+
+    pthread_mutex_lock(&o->lock);
+    o->in_flight--;
+    double before = o->limit;
+
+    if (limiter.algorithm != CONC_FIXED) {
+        if (outcome == CONC_DROPPED) {
+            o->limit = clamp_limit(o->limit * DROP_BACKOFF);
+        } else if (outcome == CONC_SUCCESS) {
+            if (limiter.algorithm == CONC_GRADIENT) {
+                update_gradient(o, (double)rtt_ns);
+            } else {
+                update_aimd(o, rtt_ns);
+            }
+        }
+    }
+
+    if (o->queued > 0) {
+        if ((int)o->limit > (int)before) {
+            pthread_cond_broadcast(&o->cond);
+        } else {
+            pthread_cond_signal(&o->cond);
+        }
+    }
+    pthread_mutex_unlock(&o->lock);
+}
+
+int conc_origin_limit(const char* host, const char* port, int* in_flight) {
+    conc_origin* o = find_origin(host, port, 0);
+    if (o == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&o->lock);
+    int limit = (int)o->limit;
+    if (in_flight != NULL) {
+        *in_flight = o->in_flight;
+    }
+    pthread_mutex_unlock(&o->lock);
+    return limit;
+}
@@ -0,0 +1,51 @@
+#ifndef __CONC_LIMITER_H__
+#define __CONC_LIMITER_H__
+
+#include <stdint.h>
+
+// Адаптивный лимит параллельных запросов в upstream, отдельно на каждый origin.
+// Лимит подстраивается по наблюдаемой задержке промахов (gradient или AIMD),
+// лишние запросы ждут в очереди до дедлайна, потом получают отказ.
+
+#define CONC_INITIAL_LIMIT 4
+#define CONC_MIN_LIMIT 1
+#define CONC_MAX_LIMIT 256
+#define CONC_QUEUE_TIMEOUT_MS 1000
+#define CONC_MAX_QUEUE 64
+#define CONC_MAX_ORIGINS 1024
+// Для AIMD: ответ дольше этого считается перегрузкой
+#define CONC_AIMD_TIMEOUT_MS 5000
+
+typedef enum {
+    CONC_GRADIENT,
+    CONC_AIMD,
+    CONC_FIXED
+} conc_algorithm;
+
+typedef enum {
+    CONC_SUCCESS,   // задержка учитывается
+    CONC_DROPPED,   // upstream не ответил: лимит уменьшается
+    CONC_IGNORE     // запрос оборвал клиент, задержка ни о чем не говорит
+} conc_outcome;
+
+typedef struct conc_origin conc_origin;
+
+typedef struct {
+    conc_origin* origin;
+    uint64_t start_ns;
+    // От захвата до заголовка ответа; передача тела клиенту в задержку
+    // не входит, иначе большие объекты и медленные клиенты давят лимит
+    uint64_t head_ns;
+} conc_permit;
+
+void init_conc_limiter(void);
+
+int conc_acquire(const char* host, const char* port, conc_permit* permit);
+
+void conc_first_byte(void);
+
+void conc_release(conc_permit* permit, conc_outcome outcome);
+
+int conc_origin_limit(const char* host, const char* port, int* in_flight);
+
+#endif
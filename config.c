@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "config.h"
+
+long config_get_long(const char* name, long def) {
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return def;
+    }
+
+    errno = 0;
+    char* end = NULL;
+    long n = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0') {
+        return def;
+    }
+    return n;
+}
+
+double config_get_double(const char* name, double def) {
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return def;
+    }
+
+    errno = 0;
+    char* end = NULL;
+    double d = strtod(value, &end);
+    if (errno != 0 || end == value || *end != '\0') {
+        return def;
+    }
+    return d;
+}
+
+int config_get_bool(const char* name, int def) {
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return def;
+    }
+
+    if (strcmp(value, "1") == 0 || strcasecmp(value, "yes") == 0 ||
+        strcasecmp(value, "true") == 0 || strcasecmp(value, "on") == 0) {
+        return 1;
+    }
+    if (strcmp(value, "0") == 0 || strcasecmp(value, "no") == 0 ||
+        strcasecmp(value, "false") == 0 || strcasecmp(value, "off") == 0) {
+        return 0;
+    }
+    return def;
+}
+
+const char* config_get_str(const char* name, const char* def) {
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return def;
+    }
+    return value;
+}
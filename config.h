@@ -0,0 +1,17 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stdlib.h>
+
+// Все настройки прокси читаются из переменных окружения (как PROXY_PORT).
+// Если переменная не задана или не парсится, возвращается значение по умолчанию.
+
+long config_get_long(const char* name, long def);
+
+double config_get_double(const char* name, double def);
+
+int config_get_bool(const char* name, int def);
+
+const char* config_get_str(const char* name, const char* def);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "conn_deadline.h"
+#include "config.h"
+
+static timer_wheel wheel;
+static int wheel_running = 0;
+
+static uint64_t header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS;
+static uint64_t upstream_timeout_ms = DEFAULT_UPSTREAM_TIMEOUT_MS;
+static uint64_t idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+static uint64_t lifetime_ms = DEFAULT_LIFETIME_MS;
+static uint64_t min_rate = DEFAULT_MIN_RATE;
+
+// Соединение, которое обслуживает этот поток: io_recv/send_all отмечают
+// в нем активность, не зная ничего о дедлайнах
+static __thread conn_deadline* current = NULL;
+
+static uint64_t read_timeout(const char* name, long def) {
+    long v = config_get_long(name, def);
+    return v > 0 ? (uint64_t)v : 0;
+}
+
+int init_conn_deadlines(void) {
+    header_timeout_ms = read_timeout("PROXY_HEADER_TIMEOUT_MS", DEFAULT_HEADER_TIMEOUT_MS);
+    upstream_timeout_ms = read_timeout("PROXY_UPSTREAM_TIMEOUT_MS", DEFAULT_UPSTREAM_TIMEOUT_MS);
+    idle_timeout_ms = read_timeout("PROXY_IDLE_TIMEOUT_MS", DEFAULT_IDLE_TIMEOUT_MS);
+    lifetime_ms = read_timeout("PROXY_MAX_LIFETIME_MS", DEFAULT_LIFETIME_MS);
+    min_rate = read_timeout("PROXY_MIN_RATE", DEFAULT_MIN_RATE);
+
+    init_timer_wheel(&wheel);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, timer_wheel_thread, &wheel) != 0) {
+        perror("error creating timer thread");
+        return -1;
+    }
+    pthread_detach(tid);
+    wheel_running = 1;
+    return 0;
+}
+
+static void expire(conn_deadline* d, int how) {
+    int up = atomic_load(&d->upstream_sock);
+    if (how == DEADLINE_UPSTREAM_EXPIRED && up < 0) {
+        how = DEADLINE_EXPIRED;
+    }
+
+    atomic_store(&d->expired, how);
+    if (how == DEADLINE_EXPIRED) {
+        shutdown(d->client_sock, SHUT_RDWR);
+    }
+    if (up >= 0) {
+        shutdown(up, SHUT_RDWR);
+    }
+}
+
+static uint64_t earliest(uint64_t a, uint64_t b) {
+    if (a == 0) {
+        return b;
+    }
+    if (b == 0) {
+        return a;
+    }
+    return a < b ? a : b;
+}
+
+// Таймер не перевзводится на каждый recv: он просыпается к ближайшему
+// возможному дедлайну и сам проверяет, была ли с тех пор активность
+static uint64_t check_deadline(timer_entry* t, uint64_t now) {
+    conn_deadline* d = (conn_deadline*)((char*)t - offsetof(conn_deadline, timer));
+
+    uint64_t phase_deadline = atomic_load_explicit(&d->phase_deadline_ms, memory_order_relaxed);
+    uint64_t idle_deadline = 0;
+    if (idle_timeout_ms > 0) {
+        idle_deadline = atomic_load_explicit(&d->last_activity_ms, memory_order_relaxed) + idle_timeout_ms;
+    }
+
+    // Не дождались ответа upstream: рвем только его, клиент получит 504
+    if (phase_deadline != 0 && now >= phase_deadline &&
+        atomic_load_explicit(&d->phase, memory_order_relaxed) == DEADLINE_UPSTREAM) {
+        expire(d, DEADLINE_UPSTREAM_EXPIRED);
+        return 0;
+    }
+
+    uint64_t next = earliest(d->lifetime_deadline_ms, earliest(phase_deadline, idle_deadline));
+    if (next != 0 && now >= next) {
+        expire(d, DEADLINE_EXPIRED);
+        return 0;
+    }
+
+    if (min_rate > 0 && atomic_load_explicit(&d->phase, memory_order_relaxed) == DEADLINE_TRANSFER) {
+        // Окно скорости считается заново в каждой фазе передачи: ожидание
+        // ответа upstream не должно засчитываться клиенту как медленное чтение
+        unsigned seq = atomic_load_explicit(&d->phase_seq, memory_order_relaxed);
+        if (d->window_start_ms == 0 || d->window_seq != seq) {
+            d->window_start_ms = now;
+            d->window_seq = seq;
+            d->window_bytes = atomic_load_explicit(&d->bytes, memory_order_relaxed);
+        } else if (now - d->window_start_ms >= MIN_RATE_WINDOW_MS) {
+            uint64_t bytes = atomic_load_explicit(&d->bytes, memory_order_relaxed);
+            uint64_t elapsed = now - d->window_start_ms;
+            if ((bytes - d->window_bytes) * 1000 / elapsed < min_rate) {
+                expire(d, DEADLINE_EXPIRED);
+                return 0;
+            }
+            d->window_start_ms = now;
+            d->window_bytes = bytes;
+        }
+        next = earliest(next, d->window_start_ms + MIN_RATE_WINDOW_MS);
+    }
+
+    if (next == 0) {
+        return 0;
+    }
+    return next > now ? next - now : 1;
+}
+
+void deadline_begin(conn_deadline* d, int client_sock) {
+    uint64_t now = timer_now_ms();
+
+    d->timer.next = NULL;
+    d->timer.prev = NULL;
+    d->timer.fn = check_deadline;
+    d->timer.pending = 0;
+    d->client_sock = client_sock;
+    atomic_store(&d->upstream_sock, -1);
+    atomic_store(&d->phase, DEADLINE_HEADER);
+    atomic_store(&d->phase_seq, 0);
+    atomic_store(&d->phase_deadline_ms, header_timeout_ms ? now + header_timeout_ms : 0);
+    atomic_store(&d->last_activity_ms, now);
+    atomic_store(&d->bytes, 0);
+    d->lifetime_deadline_ms = lifetime_ms ? now + lifetime_ms : 0;
+    d->window_start_ms = 0;
+    d->window_bytes = 0;
+    d->window_seq = 0;
+    atomic_store(&d->expired, 0);
+
+    current = d;
+    if (!wheel_running) {
+        return;
+    }
+
+    uint64_t first = earliest(header_timeout_ms, earliest(idle_timeout_ms, lifetime_ms));
+    if (first > 0) {
+        timer_wheel_add(&wheel, &d->timer, first);
+    }
+}
+
+void deadline_set_upstream(int sock) {
+    if (current != NULL) {
+        atomic_store(&current->upstream_sock, sock);
+    }
+}
+
+void deadline_phase_enter(deadline_phase phase) {
+    conn_deadline* d = current;
+    if (d == NULL) {
+        return;
+    }
+
+    uint64_t now = timer_now_ms();
+    uint64_t until = 0;
+    if (phase == DEADLINE_UPSTREAM && upstream_timeout_ms > 0) {
+        until = now + upstream_timeout_ms;
+    }
+    atomic_store(&d->phase_deadline_ms, until);
+    atomic_store(&d->last_activity_ms, now);
+    atomic_store(&d->phase, phase);
+    atomic_fetch_add(&d->phase_seq, 1);
+
+    if (!wheel_running) {
+        return;
+    }
+
+    // Дедлайн новой фазы может оказаться раньше, чем таймер собирался проснуться
+    uint64_t wake = earliest(until ? upstream_timeout_ms : 0, idle_timeout_ms);
+    if (d->lifetime_deadline_ms != 0) {
+        wake = earliest(wake, d->lifetime_deadline_ms > now ? d->lifetime_deadline_ms - now : 1);
+    }
+    if (phase == DEADLINE_TRANSFER && min_rate > 0) {
+        wake = earliest(wake, MIN_RATE_WINDOW_MS);
+    }
+    if (wake > 0) {
+        timer_wheel_add(&wheel, &d->timer, wake);
+    }
+}
+
+void deadline_touch(size_t bytes) {
+    conn_deadline* d = current;
+    if (d == NULL) {
+        return;
+    }
+    atomic_store_explicit(&d->last_activity_ms, timer_now_ms(), memory_order_relaxed);
+    atomic_fetch_add_explicit(&d->bytes, bytes, memory_order_relaxed);
+}
+
+int deadline_expired(void) {
+    conn_deadline* d = current;
+    return d != NULL ? atomic_load(&d->expired) : 0;
+}
+
+// Сколько осталось до дедлайна текущей фазы; -1 - дедлайна нет. Нужно
+// там, где shutdown() не поможет: connect() им не прервать
+int deadline_remaining_ms(void) {
+    conn_deadline* d = current;
+    if (d == NULL) {
+        return -1;
+    }
+    uint64_t until = atomic_load(&d->phase_deadline_ms);
+    if (until == 0) {
+        return -1;
+    }
+    uint64_t now = timer_now_ms();
+    if (until <= now) {
+        return 0;
+    }
+    return until - now > INT32_MAX ? INT32_MAX : (int)(until - now);
+}
+
+// Снимать таймер нужно до закрытия сокетов: иначе shutdown() может
+// прилететь в чужой дескриптор с тем же номером
+int deadline_end(void) {
+    conn_deadline* d = current;
+    if (d == NULL) {
+        return 0;
+    }
+    current = NULL;
+
+    if (wheel_running) {
+        timer_wheel_cancel(&wheel, &d->timer);
+    }
+    return atomic_load(&d->expired);
+}
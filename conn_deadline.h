@@ -0,0 +1,65 @@
+#ifndef __CONN_DEADLINE_H__
+#define __CONN_DEADLINE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "timer_wheel.h"
+
+// Дедлайны соединения: на заголовок запроса, на ответ upstream, на простой
+// без данных и на всю жизнь соединения. При истечении сокеты закрываются
+// через shutdown(), и заблокированный в recv/send поток сам все освобождает.
+
+#define DEFAULT_HEADER_TIMEOUT_MS 10000
+#define DEFAULT_UPSTREAM_TIMEOUT_MS 30000
+#define DEFAULT_IDLE_TIMEOUT_MS 30000
+#define DEFAULT_LIFETIME_MS 3600000
+// Медленнее этого (байт/с за окно) передача считается атакой slow read
+#define DEFAULT_MIN_RATE 1024
+#define MIN_RATE_WINDOW_MS 10000
+
+// Что вернет deadline_end(): соединение закрыто целиком или истек только
+// ответ upstream (клиенту еще можно отправить 504)
+#define DEADLINE_EXPIRED 1
+#define DEADLINE_UPSTREAM_EXPIRED 2
+
+typedef enum {
+    DEADLINE_HEADER,
+    DEADLINE_UPSTREAM,
+    DEADLINE_TRANSFER
+} deadline_phase;
+
+typedef struct {
+    timer_entry timer;
+    int client_sock;
+    _Atomic int upstream_sock;
+    _Atomic int phase;
+    _Atomic unsigned phase_seq;
+    _Atomic uint64_t phase_deadline_ms;
+    _Atomic uint64_t last_activity_ms;
+    _Atomic uint64_t bytes;
+    uint64_t lifetime_deadline_ms;
+    uint64_t window_start_ms;
+    uint64_t window_bytes;
+    unsigned window_seq;
+    _Atomic int expired;
+} conn_deadline;
+
+int init_conn_deadlines(void);
+
+void deadline_begin(conn_deadline* d, int client_sock);
+
+void deadline_set_upstream(int sock);
+
+void deadline_phase_enter(deadline_phase phase);
+
+void deadline_touch(size_t bytes);
+
+int deadline_expired(void);
+
+int deadline_remaining_ms(void);
+
+int deadline_end(void);
+
+#endif
@@ -8,31 +8,48 @@ int dynbuf_append_str(dynbuf *buffer, const char *s) {
     return add_dynbuf(buffer, s, strlen(s));
 }
 
+size_t dynbuf_next_cap(const dynbuf* buffer, size_t n) {
+    if (buffer->len + n <= buffer->cap) {
+        return buffer->cap;
+    }
+
+    size_t new_cap;
+
+    if (buffer->cap != 0) {
+        new_cap = buffer->cap;
+    } else {
+        new_cap = DEFAULT_SIZE;
+    }
+
+    while (new_cap < buffer->len + n) {
+        new_cap *= 2;
+    }
+    return new_cap;
+}
+
+int reserve_dynbuf(dynbuf* buffer, size_t cap) {
+    if (cap <= buffer->cap) {
+        return 0;
+    }
+
+    char* p = realloc(buffer->data, cap);
+    if (!p) {
+        return -1;
+    }
+    buffer->data = p;
+    buffer->cap = cap;
+    return 0;
+}
+
 int add_dynbuf(dynbuf* buffer, const void* src, size_t n) {
     if (n == 0) {
         return 0;
     }
 
     if (buffer->len + n > buffer->cap) {
-        
-        size_t new_cap;
-
-        if (buffer->cap != 0) {
-            new_cap = buffer->cap;
-        } else {
-            new_cap = DEFAULT_SIZE;
-        }
-
-        while (new_cap < buffer->len + n) {
-            new_cap *= 2;
-        }
-
-        char* p = realloc(buffer->data, new_cap);
-        if (!p) {
+        if (reserve_dynbuf(buffer, dynbuf_next_cap(buffer, n)) != 0) {
             return -1;
         }
-        buffer->data = p;
-        buffer->cap = new_cap;
     }
 
     memcpy(buffer->data + buffer->len, src, n);
@@ -47,4 +64,4 @@ void free_dynbuf(dynbuf* buffer) {
     free(buffer->data);
     buffer->data = NULL;
     buffer->len = buffer->cap = 0;
-}
+}
\ No newline at end of file
@@ -11,6 +11,10 @@ typedef struct {
 
 int dynbuf_append_str(dynbuf *buffer, const char *s);
 
+size_t dynbuf_next_cap(const dynbuf* buffer, size_t n);
+
+int reserve_dynbuf(dynbuf* buffer, size_t cap);
+
 int add_dynbuf(dynbuf* buffer, const void* src, size_t n);
 
 void free_dynbuf(dynbuf* buffer);
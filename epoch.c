@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+#define EPOCH_INACTIVE 0
+#define CACHE_LINE 64
+
+typedef struct epoch_record {
+    // Эпоха, в которой поток вошел в секцию, или EPOCH_INACTIVE
+    _Atomic uint64_t epoch;
+    _Atomic int in_use;
+    unsigned slot;
+    struct epoch_record* next;
+} __attribute__((aligned(CACHE_LINE))) epoch_record;
+
+typedef struct retired_node {
+    void* ptr;
+    void (*free_fn)(void*);
+    uint64_t epoch;
+    struct retired_node* next;
+} retired_node;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_record*) records = NULL;
+static _Atomic unsigned records_num = 0;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_node* retired = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static __thread epoch_record* local_record = NULL;
+
+static void release_record(void* arg) {
+    epoch_record* rec = (epoch_record*)arg;
+    atomic_store_explicit(&rec->epoch, EPOCH_INACTIVE, memory_order_release);
+    atomic_store_explicit(&rec->in_use, 0, memory_order_release);
+}
+
+static void make_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+static epoch_record* acquire_record(void) {
+    if (local_record != NULL) {
+        return local_record;
+    }
+    pthread_once(&key_once, make_key);
+
+    // Потоки живут по одному на соединение, поэтому записи переиспользуются
+    epoch_record* rec = atomic_load_explicit(&records, memory_order_acquire);
+    for (; rec != NULL; rec = rec->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rec->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (rec == NULL) {
+        rec = aligned_alloc(CACHE_LINE, sizeof(*rec));
+        if (rec == NULL) {
+            abort();
+        }
+        atomic_init(&rec->epoch, EPOCH_INACTIVE);
+        atomic_init(&rec->in_use, 1);
+        rec->slot = atomic_fetch_add(&records_num, 1);
+
+        epoch_record* head = atomic_load(&records);
+        do {
+            rec->next = head;
+        } while (!atomic_compare_exchange_weak(&records, &head, rec));
+    }
+
+    local_record = rec;
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+void epoch_enter(void) {
+    epoch_record* rec = acquire_record();
+    atomic_store_explicit(&rec->epoch, atomic_load(&global_epoch), memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&local_record->epoch, EPOCH_INACTIVE, memory_order_release);
+}
+
+unsigned epoch_thread_slot(void) {
+    return acquire_record()->slot;
+}
+
+static int try_advance(void) {
+    uint64_t current = atomic_load(&global_epoch);
+
+    epoch_record* rec = atomic_load_explicit(&records, memory_order_acquire);
+    for (; rec != NULL; rec = rec->next) {
+        uint64_t e = atomic_load_explicit(&rec->epoch, memory_order_seq_cst);
+        if (e != EPOCH_INACTIVE && e != current) {
+            return 0;
+        }
+    }
+    return atomic_compare_exchange_strong(&global_epoch, &current, current + 1);
+}
+
+void epoch_retire(void* ptr, void (*free_fn)(void*)) {
+    retired_node* r = malloc(sizeof(*r));
+    if (r == NULL) {
+        // Без записи освобождать небезопасно - лучше потерять память
+        return;
+    }
+    r->ptr = ptr;
+    r->free_fn = free_fn;
+    r->epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&retired_lock);
+    r->next = retired;
+    retired = r;
+    pthread_mutex_unlock(&retired_lock);
+}
+
+void epoch_reclaim(void) {
+    if (try_advance()) {
+        try_advance();
+    }
+    uint64_t current = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&retired_lock);
+    retired_node* ready = NULL;
+    retired_node** prev = &retired;
+    while (*prev != NULL) {
+        retired_node* r = *prev;
+        // Через две смены эпохи ни один читатель не может держать указатель
+        if (r->epoch + 2 <= current) {
+            *prev = r->next;
+            r->next = ready;
+            ready = r;
+            continue;
+        }
+        prev = &r->next;
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while (ready != NULL) {
+        retired_node* next = ready->next;
+        ready->free_fn(ready->ptr);
+        free(ready);
+        ready = next;
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stdint.h>
+
+// Эпохи для безблокировочного чтения: читатель только отмечает эпоху,
+// писатель откладывает освобождение до тех пор, пока все читатели,
+// которые могли видеть объект, не выйдут из критической секции.
+
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+void epoch_retire(void* ptr, void (*free_fn)(void*));
+
+void epoch_reclaim(void);
+
+unsigned epoch_thread_slot(void);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hash_ring.h"
+#include "cache_map.h"
+
+// Финализатор splitmix64: у FNV почти не перемешиваются последние байты,
+// а имена точек различаются как раз в конце ("host:port#17")
+uint64_t hash_ring_mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int cmp_points(const void* a, const void* b) {
+    const ring_point* pa = (const ring_point*)a;
+    const ring_point* pb = (const ring_point*)b;
+    if (pa->point < pb->point) {
+        return -1;
+    }
+    if (pa->point > pb->point) {
+        return 1;
+    }
+    return pa->node - pb->node;
+}
+
+int init_hash_ring(hash_ring* ring, const char* const* names, int nodes, int vnodes) {
+    if (ring == NULL || names == NULL || nodes <= 0 || vnodes <= 0) {
+        return -1;
+    }
+    ring->points = malloc((size_t)nodes * (size_t)vnodes * sizeof(ring_point));
+    if (ring->points == NULL) {
+        return -1;
+    }
+
+    size_t n = 0;
+    char name[512];
+    for (int i = 0; i < nodes; i++) {
+        for (int v = 0; v < vnodes; v++) {
+            snprintf(name, sizeof(name), "%s#%d", names[i], v);
+            ring->points[n].point = hash_ring_mix(cache_key_hash(name));
+            ring->points[n].node = i;
+            n++;
+        }
+    }
+    qsort(ring->points, n, sizeof(ring_point), cmp_points);
+    ring->num = n;
+    ring->nodes = nodes;
+    return 0;
+}
+
+void free_hash_ring(hash_ring* ring) {
+    if (ring == NULL) {
+        return;
+    }
+    free(ring->points);
+    ring->points = NULL;
+    ring->num = 0;
+    ring->nodes = 0;
+}
+
+// Первый подходящий узел по часовой стрелке от ключа; -1, если не годится никто
+int hash_ring_lookup(const hash_ring* ring, uint64_t key_hash, hash_ring_accept_fn accept, void* arg) {
+    if (ring == NULL || ring->num == 0) {
+        return -1;
+    }
+
+    uint64_t point = hash_ring_mix(key_hash);
+    size_t lo = 0;
+    size_t hi = ring->num;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point < point) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Отказавшие узлы пропускаем: их ключи расходятся по соседям, а не на один
+    int tried = -1;
+    for (size_t i = 0; i < ring->num; i++) {
+        int node = ring->points[(lo + i) % ring->num].node;
+        if (node == tried) {
+            continue;
+        }
+        if (accept == NULL || accept(node, arg)) {
+            return node;
+        }
+        tried = node;
+    }
+    return -1;
+}
@@ -0,0 +1,34 @@
+#ifndef __HASH_RING_H__
+#define __HASH_RING_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define HASH_RING_VNODES 160
+
+typedef struct {
+    uint64_t point;
+    int node;
+} ring_point;
+
+// Консистентное хеширование: у каждого узла vnodes точек на кольце, ключ
+// принадлежит первой точке по часовой стрелке. При уходе узла переезжают
+// только его ключи
+typedef struct {
+    ring_point* points;
+    size_t num;
+    int nodes;
+} hash_ring;
+
+// Узел годится или его надо пропустить (лежит, выброшен и т.п.)
+typedef int (*hash_ring_accept_fn)(int node, void* arg);
+
+uint64_t hash_ring_mix(uint64_t h);
+
+int init_hash_ring(hash_ring* ring, const char* const* names, int nodes, int vnodes);
+
+void free_hash_ring(hash_ring* ring);
+
+int hash_ring_lookup(const hash_ring* ring, uint64_t key_hash, hash_ring_accept_fn accept, void* arg);
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "http_compress.h"
+#include "http_utils.h"
+#include "config.h"
+#include "zerocopy.h"
+
+#define GUNZIP_CHUNK_SIZE 16384
+
+static const char* compressible_types[] = {
+    "text/",
+    "application/json",
+    "application/javascript",
+    "application/x-javascript",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rss+xml",
+    "application/atom+xml",
+    "application/ld+json",
+    "application/manifest+json",
+    "application/x-ndjson",
+    "image/svg+xml",
+    NULL
+};
+
+void init_compress_policy(compress_policy* policy) {
+    if (policy == NULL) {
+        return;
+    }
+
+    policy->enabled = config_get_bool("PROXY_CACHE_COMPRESS", 0);
+    policy->min_size = (size_t)config_get_long("PROXY_COMPRESS_MIN_SIZE", DEFAULT_COMPRESS_MIN_SIZE);
+    policy->min_ratio = config_get_double("PROXY_COMPRESS_MIN_RATIO", DEFAULT_COMPRESS_MIN_RATIO);
+    policy->level = (int)config_get_long("PROXY_COMPRESS_LEVEL", DEFAULT_COMPRESS_LEVEL);
+
+    if (policy->level < 1 || policy->level > 9) {
+        policy->level = DEFAULT_COMPRESS_LEVEL;
+    }
+    if (policy->min_ratio <= 0.0 || policy->min_ratio > 1.0) {
+        policy->min_ratio = DEFAULT_COMPRESS_MIN_RATIO;
+    }
+}
+
+int client_accepts_gzip(http_request* req) {
+    const char* ae = get_http_header(req, "Accept-Encoding");
+    if (ae == NULL) {
+        return 0;
+    }
+
+    const char* p = ae;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        const char* tok = p;
+        while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+        size_t tok_len = (size_t)(p - tok);
+
+        int is_gzip = (tok_len == 4 && strncasecmp(tok, "gzip", 4) == 0) ||
+                      (tok_len == 1 && tok[0] == '*');
+
+        // gzip;q=0 означает явный отказ
+        int refused = 0;
+        while (*p != '\0' && *p != ',') {
+            if (*p == 'q' && p[1] == '=') {
+                refused = (strtod(p + 2, NULL) <= 0.0);
+            }
+            p++;
+        }
+
+        if (is_gzip) {
+            return !refused;
+        }
+    }
+    return 0;
+}
+
+static int is_compressible_type(const char* content_type) {
+    for (int i = 0; compressible_types[i] != NULL; i++) {
+        if (strncasecmp(content_type, compressible_types[i], strlen(compressible_types[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compress_cache_response(const compress_policy* policy, const char* response, size_t size,
+                            size_t head_len, dynbuf* out) {
+    if (policy == NULL || response == NULL || out == NULL || head_len == 0 || head_len > size) {
+        return -1;
+    }
+    if (!policy->enabled) {
+        return 0;
+    }
+
+    size_t body_len = size - head_len;
+    if (body_len < policy->min_size || body_len > UINT32_MAX) {
+        return 0;
+    }
+
+    if (parse_response_status(response, head_len) != 200) {
+        return 0;
+    }
+
+    char value[256];
+    if (get_raw_header(response, head_len, "Content-Type", value, sizeof(value)) != 0 ||
+        !is_compressible_type(value)) {
+        return 0;
+    }
+    if (get_raw_header(response, head_len, "Content-Encoding", value, sizeof(value)) == 0 &&
+        strcasecmp(value, "identity") != 0) {
+        return 0;
+    }
+    if (get_raw_header(response, head_len, "Transfer-Encoding", value, sizeof(value)) == 0) {
+        return 0;
+    }
+    if (get_raw_header(response, head_len, "Content-Length", value, sizeof(value)) == 0 &&
+        strtoull(value, NULL, 10) != body_len) {
+        return 0;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 15 + 16: gzip-обертка вместо zlib
+    if (deflateInit2(&zs, policy->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    size_t bound = deflateBound(&zs, (uLong)body_len);
+    size_t limit = (size_t)((double)body_len * policy->min_ratio);
+    if (bound > limit) {
+        bound = limit;
+    }
+
+    out->data = NULL;
+    out->len = out->cap = 0;
+    if (add_dynbuf(out, response, head_len) != 0) {
+        deflateEnd(&zs);
+        free_dynbuf(out);
+        return -1;
+    }
+    char* p = realloc(out->data, head_len + bound);
+    if (p == NULL) {
+        deflateEnd(&zs);
+        free_dynbuf(out);
+        return -1;
+    }
+    out->data = p;
+    out->cap = head_len + bound;
+
+    zs.next_in = (Bytef*)(response + head_len);
+    zs.avail_in = (uInt)body_len;
+    zs.next_out = (Bytef*)(out->data + head_len);
+    zs.avail_out = (uInt)bound;
+
+    // Если в bound не влезло, то и min_ratio не выполнен
+    int rc = deflate(&zs, Z_FINISH);
+    size_t gz_len = bound - zs.avail_out;
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+        free_dynbuf(out);
+        return 0;
+    }
+
+    out->len = head_len + gz_len;
+    return 1;
+}
+
+static uint32_t gzip_isize(const char* gz, size_t gz_len) {
+    if (gz_len < 4) {
+        return 0;
+    }
+    const unsigned char* t = (const unsigned char*)gz + gz_len - 4;
+    return (uint32_t)t[0] | ((uint32_t)t[1] << 8) | ((uint32_t)t[2] << 16) | ((uint32_t)t[3] << 24);
+}
+
+static int build_encoded_head(const char* head, size_t head_len, const char* encoding,
+                              size_t body_len, dynbuf* out) {
+    const char* end = head + head_len;
+    const char* line = head;
+    int first = 1;
+
+    while (line < end) {
+        const char* eol = find_end_line(line, (size_t)(end - line));
+        if (eol == NULL || eol == line) {
+            break;
+        }
+        size_t line_len = (size_t)(eol - line) + 2;
+
+        int skip = !first &&
+                   (strncasecmp(line, "Content-Length:", 15) == 0 ||
+                    strncasecmp(line, "Content-Encoding:", 17) == 0);
+        if (!skip && add_dynbuf(out, line, line_len) != 0) {
+            return -1;
+        }
+
+        first = 0;
+        line = eol + 2;
+    }
+
+    char tmp[128];
+    int n;
+    if (encoding != NULL) {
+        n = snprintf(tmp, sizeof(tmp), "Content-Encoding: %s\r\nContent-Length: %zu\r\n"
+                     "Vary: Accept-Encoding\r\n\r\n", encoding, body_len);
+    } else {
+        n = snprintf(tmp, sizeof(tmp), "Content-Length: %zu\r\nVary: Accept-Encoding\r\n\r\n", body_len);
+    }
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        return -1;
+    }
+    return add_dynbuf(out, tmp, (size_t)n);
+}
+
+int send_cached_gzip(int sock, const char* response, size_t size, size_t head_len) {
+    if (response == NULL || head_len > size) {
+        return -1;
+    }
+
+    dynbuf head = {0};
+    if (build_encoded_head(response, head_len, "gzip", size - head_len, &head) != 0) {
+        free_dynbuf(&head);
+        return -1;
+    }
+
+    int rc;
+    if (size - head_len >= zerocopy_threshold()) {
+        rc = send_all(sock, head.data, head.len);
+        if (rc == 0) {
+            rc = send_cached_body(sock, response + head_len, size - head_len);
+        }
+    } else {
+        // Заголовок и тело одной связкой (при io_uring - один submit)
+        rc = send_all2(sock, head.data, head.len, response + head_len, size - head_len);
+    }
+    free_dynbuf(&head);
+    return rc;
+}
+
+int send_cached_gunzip(int sock, const char* response, size_t size, size_t head_len) {
+    if (response == NULL || head_len > size) {
+        return -1;
+    }
+
+    const char* gz = response + head_len;
+    size_t gz_len = size - head_len;
+
+    dynbuf head = {0};
+    if (build_encoded_head(response, head_len, NULL, gzip_isize(gz, gz_len), &head) != 0) {
+        free_dynbuf(&head);
+        return -1;
+    }
+    int rc = send_all(sock, head.data, head.len);
+    free_dynbuf(&head);
+    if (rc != 0) {
+        return -1;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        return -1;
+    }
+
+    char out[GUNZIP_CHUNK_SIZE];
+    zs.next_in = (Bytef*)gz;
+    zs.avail_in = (uInt)gz_len;
+
+    int zrc = Z_OK;
+    while (zrc != Z_STREAM_END) {
+        zs.next_out = (Bytef*)out;
+        zs.avail_out = sizeof(out);
+
+        zrc = inflate(&zs, Z_NO_FLUSH);
+        if (zrc != Z_OK && zrc != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return -1;
+        }
+
+        size_t produced = sizeof(out) - zs.avail_out;
+        if (produced > 0 && send_all(sock, out, produced) != 0) {
+            inflateEnd(&zs);
+            return -1;
+        }
+        if (produced == 0 && zs.avail_in == 0 && zrc != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return -1;
+        }
+    }
+
+    inflateEnd(&zs);
+    return 0;
+}
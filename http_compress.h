@@ -0,0 +1,36 @@
+#ifndef __HTTP_COMPRESS_H__
+#define __HTTP_COMPRESS_H__
+
+#include <stdlib.h>
+
+#include "http_request.h"
+#include "dynamic_buffer.h"
+
+#define DEFAULT_COMPRESS_MIN_SIZE 1024
+#define DEFAULT_COMPRESS_MIN_RATIO 0.9
+#define DEFAULT_COMPRESS_LEVEL 6
+
+typedef enum {
+    CACHE_ENC_IDENTITY,
+    CACHE_ENC_GZIP
+} cache_encoding;
+
+typedef struct {
+    int enabled;
+    size_t min_size;
+    double min_ratio;
+    int level;
+} compress_policy;
+
+void init_compress_policy(compress_policy* policy);
+
+int client_accepts_gzip(http_request* req);
+
+int compress_cache_response(const compress_policy* policy, const char* response, size_t size,
+                            size_t head_len, dynbuf* out);
+
+int send_cached_gzip(int sock, const char* response, size_t size, size_t head_len);
+
+int send_cached_gunzip(int sock, const char* response, size_t size, size_t head_len);
+
+#endif
@@ -91,7 +91,7 @@ void init_invalid_http_request(http_request* result) {
 
 void parse_http_request_line(http_request* result, const char* line) {
     const char *end = strstr(line, "\r\n");
-    size_t n;
+    size_t n = 0;
     if (end != NULL) {
         n = (size_t)(end - line);
     } else {
@@ -153,7 +153,7 @@ void trim_right_space(char* str) {
 
 void parse_http_header(http_request* result, const char* line) {
     const char *end = strstr(line, "\r\n");
-    size_t n;
+    size_t n = 0;
     if (end != NULL) {
         n = (size_t)(end - line);
     } else {
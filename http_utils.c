@@ -8,8 +8,20 @@
 #include <errno.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 
 #include "http_utils.h"
+#include "mem_budget.h"
+#include "uring_io.h"
+#include "conn_deadline.h"
+#include "conc_limiter.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "config.h"
+#include "probes.h"
+#include "peer.h"
 
 const char* find_end_line(const char* buffer, size_t len) {
     if (len < 2) {
@@ -116,7 +128,7 @@ http_chunk http_reader_next(int sock, http_reader_state* st,
             return (http_chunk){0};
         }
 
-        ssize_t n = recv(sock, buf + *len_buf, cap - *len_buf, 0);
+        ssize_t n = io_recv(sock, buf + *len_buf, cap - *len_buf);
         if (n <= 0) {
             if (st->state == READ_BODY && st->body_remaining == -1) {
                 st->state = READ_DONE;
@@ -131,10 +143,35 @@ http_chunk http_reader_next(int sock, http_reader_state* st,
     }
 }
 
+// Одиночные recv и send идут обычными вызовами и при io_uring: отправка
+// одной заявки с ожиданием - тот же системный вызов, только дороже.
+// Кольцо выигрывает там, где заявок несколько: связка заголовок+тело,
+// relay и multishot accept
+ssize_t io_recv(int sock, void* buf, size_t len) {
+    ssize_t n = recv(sock, buf, len, 0);
+    if (n > 0) {
+        deadline_touch((size_t)n);
+    }
+    return n;
+}
+
+int send_all2(int sock, const void* a, size_t a_len, const void* b, size_t b_len) {
+    uring_ctx* ctx = uring_current();
+    if (ctx != NULL && a_len > 0 && b_len > 0) {
+        return uring_send2(ctx, sock, a, a_len, b, b_len);
+    }
+    if (send_all(sock, a, a_len) != 0) {
+        return -1;
+    }
+    return send_all(sock, b, b_len);
+}
+
 int send_all(int sock, const void* buf, size_t len) {
+
     const char* p = (const char*)buf;
     while (len > 0) {
-        ssize_t n = send(sock, p, len, 0);
+        size_t want = len < SEND_CHUNK_SIZE ? len : SEND_CHUNK_SIZE;
+        ssize_t n = send(sock, p, want, 0);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
@@ -144,6 +181,7 @@ int send_all(int sock, const void* buf, size_t len) {
         if (n == 0) {
             return -1;
         }
+        deadline_touch((size_t)n);
         p += (size_t)n;
         len -= (size_t)n;
     }
@@ -220,6 +258,40 @@ int parse_host_and_port(http_request* req, char** out_host, char** out_port) {
 }
 
 
+// Неблокирующий connect с ожиданием не дольше дедлайна фазы: SYN в
+// черную дыру иначе ждет таймаута ядра, больше минуты
+static int connect_bounded(int sock, const struct sockaddr* addr, socklen_t addr_len) {
+    int timeout = deadline_remaining_ms();
+    if (timeout < 0) {
+        return connect(sock, addr, addr_len);
+    }
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return -1;
+    }
+    int rc = connect(sock, addr, addr_len);
+    if (rc != 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        do {
+            rc = poll(&pfd, 1, timeout);
+        } while (rc < 0 && errno == EINTR);
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (rc == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+            rc = 0;
+        } else {
+            errno = rc == 0 ? ETIMEDOUT : (err != 0 ? err : errno);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && fcntl(sock, F_SETFL, flags) != 0) {
+        return -1;
+    }
+    return rc;
+}
+
 int connect_hots(const char* host, const char* port) {
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -237,7 +309,7 @@ int connect_hots(const char* host, const char* port) {
     while (iter) {
         sock = socket(iter->ai_family, iter->ai_socktype, iter->ai_protocol);
         if (sock >= 0) {
-            if (connect(sock, iter->ai_addr, iter->ai_addrlen) == 0) {
+            if (connect_bounded(sock, iter->ai_addr, iter->ai_addrlen) == 0) {
                 freeaddrinfo(res);
                 return sock;
             }
@@ -404,6 +476,9 @@ int build_request(const http_request *req, dynbuf *out) {
         if (strcasecmp(h->key, "Upgrade") == 0) {
             continue;
         }
+        if (strcasecmp(h->key, PEER_HEADER) == 0) {
+            continue;
+        }
 
         size_t need = strlen(h->key) + 2 + strlen(h->value) + 2 + 1;
         char *line = (char*)malloc(need);
@@ -435,9 +510,155 @@ int build_request(const http_request *req, dynbuf *out) {
     return 0;
 }
 
+// Запрос в форме для вышестоящего прокси - с абсолютным URI. extra -
+// дополнительная строка заголовка без CRLF или NULL
+int build_proxy_request(const http_request* req, const char* host, const char* port,
+                        const char* extra, dynbuf* out) {
+    dynbuf plain = {0};
+    if (out == NULL || build_request(req, &plain) != 0) {
+        return -1;
+    }
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+
+    const char* sp = memchr(plain.data, ' ', plain.len);
+    if (sp == NULL || plain.len < 4 || memcmp(plain.data + plain.len - 4, "\r\n\r\n", 4) != 0) {
+        free_dynbuf(&plain);
+        return -1;
+    }
+    size_t method_len = (size_t)(sp - plain.data) + 1;
+
+    char origin[512];
+    int origin_len = snprintf(origin, sizeof(origin), "http://%s:%s", host, port);
+    int rc = -1;
+    if (origin_len > 0 && (size_t)origin_len < sizeof(origin) &&
+        add_dynbuf(out, plain.data, method_len) == 0 &&
+        add_dynbuf(out, origin, (size_t)origin_len) == 0 &&
+        add_dynbuf(out, sp + 1, plain.len - method_len - 2) == 0 &&
+        (extra == NULL || (dynbuf_append_str(out, extra) == 0 && add_dynbuf(out, "\r\n", 2) == 0)) &&
+        add_dynbuf(out, "\r\n", 2) == 0) {
+        rc = 0;
+    }
+    if (rc != 0) {
+        free_dynbuf(out);
+    }
+    free_dynbuf(&plain);
+    return rc;
+}
+
+
+int open_relay_pipe(int *relay_pipe) {
+    if (relay_pipe == NULL) {
+        return -1;
+    }
+    if (relay_pipe[0] >= 0) {
+        return 0;
+    }
+
+    if (pipe2(relay_pipe, O_CLOEXEC) != 0) {
+        relay_pipe[0] = relay_pipe[1] = -1;
+        return -1;
+    }
+    // Больше буфер канала - меньше переключений между двумя splice
+    (void)fcntl(relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    return 0;
+}
+
+void close_relay_pipe(int *relay_pipe) {
+    if (relay_pipe == NULL) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (relay_pipe[i] >= 0) {
+            close(relay_pipe[i]);
+            relay_pipe[i] = -1;
+        }
+    }
+}
+
+long splice_relay(int from_sock, int to_sock, int *relay_pipe, long len) {
+    if (relay_pipe == NULL || relay_pipe[0] < 0) {
+        return SPLICE_UNSUPPORTED;
+    }
+
+    long total = 0;
+    while (len < 0 || total < len) {
+        size_t want = RELAY_PIPE_SIZE;
+        if (len >= 0 && (size_t)(len - total) < want) {
+            want = (size_t)(len - total);
+        }
+
+        ssize_t in = splice(from_sock, NULL, relay_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                return SPLICE_UNSUPPORTED;
+            }
+            return -1;
+        }
+        if (in == 0) {
+            break;
+        }
+
+        // Все, что попало в канал, обязано уйти: иначе данные потеряются
+        size_t in_pipe = (size_t)in;
+        while (in_pipe > 0) {
+            ssize_t out = splice(relay_pipe[0], NULL, to_sock, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                return -1;
+            }
+            in_pipe -= (size_t)out;
+            deadline_touch((size_t)out);
+        }
+        total += in;
+    }
+
+    if (len >= 0 && total < len) {
+        return -1;
+    }
+    return total;
+}
 
 int proxy_body(int from_sock, int to_sock,http_reader_state *st, char *io_buf, 
-               size_t io_cap, size_t *io_len, long content_length) {
+               size_t io_cap, size_t *io_len, long content_length, int *relay_pipe) {
+    if (content_length < 0) {
+        return -1;
+    }
+
+    // Часть тела могла прийти вместе с заголовком - она уже в io_buf
+    size_t buffered = *io_len;
+    if (buffered > (size_t)content_length) {
+        buffered = (size_t)content_length;
+    }
+    if (buffered > 0) {
+        if (send_all(to_sock, io_buf, buffered) != 0) {
+            return -1;
+        }
+        memmove(io_buf, io_buf + buffered, *io_len - buffered);
+        *io_len -= buffered;
+    }
+
+    long remaining = content_length - (long)buffered;
+    st->state = READ_BODY;
+    st->body_remaining = remaining;
+    if (remaining == 0) {
+        st->state = READ_DONE;
+        return 0;
+    }
+
+    long rc = splice_relay(from_sock, to_sock, relay_pipe, remaining);
+    if (rc != SPLICE_UNSUPPORTED) {
+        st->state = READ_DONE;
+        st->body_remaining = 0;
+        return rc < 0 ? -1 : 0;
+    }
+
     while (1) {
         http_chunk c = http_reader_next(from_sock, st, io_buf, io_cap, io_len, content_length);
         if (c.data == NULL) {
@@ -450,29 +671,234 @@ int proxy_body(int from_sock, int to_sock,http_reader_state *st, char *io_buf,
         }
         free(c.data);
     }
+    return st->body_remaining == 0 ? 0 : -1;
+}
+
+static _Atomic size_t background_fill_reserved = 0;
+
+void init_background_fill_policy(background_fill_policy *policy) {
+    if (policy == NULL) {
+        return;
+    }
+
+    policy->min_percent = (int)config_get_long("PROXY_BG_FILL_MIN_PERCENT", DEFAULT_BG_FILL_MIN_PERCENT);
+    long max_left = config_get_long("PROXY_BG_FILL_MAX_LEFT", DEFAULT_BG_FILL_MAX_LEFT);
+    long budget = config_get_long("PROXY_BG_FILL_BUDGET", DEFAULT_BG_FILL_BUDGET);
+    policy->max_left = max_left > 0 ? (size_t)max_left : 0;
+    policy->budget = budget > 0 ? (size_t)budget : 0;
+}
+
+static int start_cache_fill(const char *head, size_t head_len, size_t cache_limit, dynbuf *resp_acc,
+                            size_t *expected_total) {
+    char value[64];
+    size_t expected = head_len;
+    *expected_total = 0;
+
+    if (get_raw_header(head, head_len, "Content-Length", value, sizeof(value)) == 0) {
+        errno = 0;
+        char *end = NULL;
+        unsigned long long cl = strtoull(value, &end, 10);
+        if (errno != 0 || end == value) {
+            return -1;
+        }
+        // Объект заведомо не поместится в кэш - даже не начинаем копить
+        if (cl > cache_limit || head_len + cl > cache_limit) {
+            return -1;
+        }
+        expected = head_len + (size_t)cl;
+        *expected_total = expected;
+    }
+
+    if (!mem_budget_admit_fill(expected)) {
+        return -1;
+    }
+    return reserve_dynbuf_accounted(resp_acc, expected, MEM_FILL_BUFFERS);
+}
+
+typedef struct {
+    dynbuf *acc;
+    size_t limit;
+    size_t expected;    // полный размер ответа, 0 - неизвестен
+    int active;
+} cache_fill;
+
+static int cache_fill_add(void *arg, const char *data, size_t n) {
+    cache_fill *fill = (cache_fill*)arg;
+    if (!fill->active) {
+        return -1;
+    }
+
+    if (fill->acc->len + n > fill->limit ||
+        add_dynbuf_accounted(fill->acc, data, n, MEM_FILL_BUFFERS) != 0) {
+        // Ответ перерос лимит или бюджет памяти - дальше только проксируем
+        fill->active = 0;
+        free_dynbuf_accounted(fill->acc, MEM_FILL_BUFFERS);
+        return -1;
+    }
+    return 0;
+}
+
+// Upstream закрыл соединение раньше обещанного Content-Length: клиент
+// получил что получил, но обрезанное тело в кэш попасть не должно
+static void drop_short_fill(cache_fill *fill) {
+    if (fill->active && fill->expected != 0 && fill->acc->len != fill->expected) {
+        fill->active = 0;
+        free_dynbuf_accounted(fill->acc, MEM_FILL_BUFFERS);
+    }
+}
+
+// Клиент отвалился, но ответ уже почти в кэше. Докачиваем только ответы
+// с известной длиной: иначе нельзя ни оценить остаток, ни проверить целостность
+static int reserve_background_fill(const background_fill_policy *policy, const cache_fill *fill,
+                                   size_t *reserved) {
+    if (policy == NULL || policy->budget == 0 || !fill->active || fill->expected == 0) {
+        return -1;
+    }
+
+    size_t have = fill->acc->len;
+    size_t left = have < fill->expected ? fill->expected - have : 0;
+    if (left > policy->max_left && have * 100 / fill->expected < (size_t)policy->min_percent) {
+        return -1;
+    }
+
+    size_t used = atomic_load(&background_fill_reserved);
+    do {
+        if (left > policy->budget || used > policy->budget - left) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&background_fill_reserved, &used, used + left));
+
+    *reserved = left;
     return 0;
 }
 
-int proxy_response_and_maybe_cache(int upstream_sock, int client_sock, int do_cache, dynbuf *resp_acc) {
-    char buf[8192];
+static int finish_fill_without_client(int upstream_sock, const background_fill_policy *policy,
+                                      cache_fill *fill, char *buf, size_t cap) {
+    size_t reserved = 0;
+    if (reserve_background_fill(policy, fill, &reserved) != 0) {
+        return -1;
+    }
+
+    int rc = 0;
+    while (fill->acc->len < fill->expected) {
+        size_t want = fill->expected - fill->acc->len;
+        ssize_t n = io_recv(upstream_sock, buf, want < cap ? want : cap);
+        if (n <= 0 || cache_fill_add(fill, buf, (size_t)n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    atomic_fetch_sub(&background_fill_reserved, reserved);
+    if (rc == 0) {
+        metrics_add(METRIC_BACKGROUND_FILLS, 1);
+    }
+    return rc;
+}
+
+// Статус последнего ответа upstream в этом потоке; журнал его знает,
+// только если включен, а выбросу участников группы он нужен всегда
+static __thread int last_status = 0;
+
+int upstream_last_status(void) {
+    return last_status;
+}
+
+int proxy_response_and_maybe_cache(int upstream_sock, int client_sock, size_t cache_limit, dynbuf *resp_acc,
+                                   int *relay_pipe, const background_fill_policy *bg_fill, int divert_5xx) {
+    char buf[RELAY_BUFFER_SIZE];
+    cache_fill fill = {.acc = resp_acc, .limit = cache_limit, .expected = 0, .active = (cache_limit > 0)};
+    uint64_t started_us = metrics_now_us();
+
+    // Сначала дочитываем заголовок ответа, чтобы по Content-Length решить,
+    // стоит ли вообще буферизовать тело
+    char head[MAX_RESPONSE_HEAD_SIZE];
+    size_t head_read = 0;
+    size_t head_len = 0;
+    // Обрыв до заголовка не должен унаследовать статус прошлого запроса потока
+    last_status = 0;
+
+    while (head_len == 0 && head_read < sizeof(head)) {
+        ssize_t n = io_recv(upstream_sock, head + head_read, sizeof(head) - head_read);
+        if (n <= 0) {
+            break;
+        }
+        head_read += (size_t)n;
+        head_len = response_head_len(head, head_read);
+    }
+    if (head_len == 0 && head_read < sizeof(head)) {
+        return UPSTREAM_NO_RESPONSE;
+    }
+    deadline_phase_enter(DEADLINE_TRANSFER);
+    uint64_t ttfb_us = metrics_now_us() - started_us;
+    metrics_observe(STAGE_TTFB, ttfb_us);
+    access_log_stage(STAGE_TTFB, ttfb_us);
+    if (head_len > 0) {
+        conc_first_byte();
+    }
+    int status = head_len > 0 ? parse_response_status(head, head_len) : 0;
+    access_log_status(status);
+    last_status = status;
+    PROBE3(upstream_first_byte, status, ttfb_us, head_read);
+    metrics_add(METRIC_BYTES_FROM_UPSTREAM, (int64_t)head_read);
+
+    if (divert_5xx && head_len > 0 && parse_response_status(head, head_len) >= 500) {
+        return UPSTREAM_SERVER_ERROR;
+    }
+
+    if (head_len == 0 || head_len > cache_limit) {
+        fill.active = 0;
+    }
+    if (fill.active && start_cache_fill(head, head_len, cache_limit, resp_acc, &fill.expected) != 0) {
+        fill.active = 0;
+    }
+
+    if (fill.active) {
+        cache_fill_add(&fill, head, head_read);
+    }
+    if (send_all(client_sock, head, head_read) != 0) {
+        return finish_fill_without_client(upstream_sock, bg_fill, &fill, buf, sizeof(buf));
+    }
 
     while (1) {
-        ssize_t n = recv(upstream_sock, buf, sizeof(buf), 0);
+        if (!fill.active) {
+            // Кэшировать нечего - гоним тело сокет-в-сокет через канал, минуя user space
+            long rc = splice_relay(upstream_sock, client_sock, relay_pipe, -1);
+            if (rc != SPLICE_UNSUPPORTED) {
+                if (rc > 0) {
+                    metrics_add(METRIC_BYTES_FROM_UPSTREAM, rc);
+                }
+                return rc < 0 ? -1 : 0;
+            }
+        }
+
+        uring_ctx *ctx = uring_current();
+        if (ctx != NULL) {
+            long rc = uring_relay(ctx, upstream_sock, client_sock, cache_fill_add, &fill);
+            if (rc < 0 && rc != SPLICE_UNSUPPORTED) {
+                return finish_fill_without_client(upstream_sock, bg_fill, &fill, buf, sizeof(buf));
+            }
+            if (rc != SPLICE_UNSUPPORTED) {
+                metrics_add(METRIC_BYTES_FROM_UPSTREAM, rc);
+                drop_short_fill(&fill);
+                return 0;
+            }
+        }
+
+        ssize_t n = io_recv(upstream_sock, buf, sizeof(buf));
         if (n == 0) {
+            drop_short_fill(&fill);
             return 0;
         }
         if (n < 0) {
             return -1;
         }
 
-        if (do_cache) {
-            if (add_dynbuf(resp_acc, buf, (size_t)n) != 0) {
-                do_cache = 0;
-            }
-        }
+        cache_fill_add(&fill, buf, (size_t)n);
+        metrics_add(METRIC_BYTES_FROM_UPSTREAM, n);
 
         if (send_all(client_sock, buf, (size_t)n) != 0) {
-            return -1;
+            return finish_fill_without_client(upstream_sock, bg_fill, &fill, buf, sizeof(buf));
         }
     }
 }
@@ -559,4 +985,80 @@ int proxy_response(int upstream_sock, int client_sock) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+size_t response_head_len(const char *buf, size_t len) {
+    if (buf == NULL || len < 4) {
+        return 0;
+    }
+
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+            return i + 4;
+        }
+    }
+    return 0;
+}
+
+int parse_response_status(const char *head, size_t head_len) {
+    if (head == NULL || head_len < 12 || strncmp(head, "HTTP/", 5) != 0) {
+        return -1;
+    }
+
+    const char *sp = memchr(head, ' ', head_len);
+    if (sp == NULL || (size_t)(sp - head) + 4 > head_len) {
+        return -1;
+    }
+    sp++;
+
+    if (!isdigit((unsigned char)sp[0]) || !isdigit((unsigned char)sp[1]) || !isdigit((unsigned char)sp[2])) {
+        return -1;
+    }
+    return (sp[0] - '0') * 100 + (sp[1] - '0') * 10 + (sp[2] - '0');
+}
+
+int get_raw_header(const char *head, size_t head_len, const char *key, char *out, size_t cap) {
+    if (head == NULL || key == NULL || out == NULL || cap == 0) {
+        return -1;
+    }
+
+    size_t klen = strlen(key);
+    const char *end = head + head_len;
+
+    // Первая строка - статус, заголовки начинаются после нее
+    const char *line = find_end_line(head, head_len);
+    if (line == NULL) {
+        return -1;
+    }
+    line += 2;
+
+    while (line < end) {
+        const char *eol = find_end_line(line, (size_t)(end - line));
+        if (eol == NULL || eol == line) {
+            break;
+        }
+
+        size_t line_len = (size_t)(eol - line);
+        if (line_len > klen && line[klen] == ':' && strncasecmp(line, key, klen) == 0) {
+            const char *v = line + klen + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            const char *v_end = eol;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+                v_end--;
+            }
+
+            size_t n = (size_t)(v_end - v);
+            if (n >= cap) {
+                n = cap - 1;
+            }
+            memcpy(out, v, n);
+            out[n] = '\0';
+            return 0;
+        }
+
+        line = eol + 2;
+    }
+    return -1;
+}
@@ -7,6 +7,22 @@
 #include "dynamic_buffer.h"
 
 #define MAX_BUFFER_SIZE 4096
+#define RELAY_BUFFER_SIZE 8192
+#define MAX_RESPONSE_HEAD_SIZE 16384
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define SPLICE_UNSUPPORTED -2
+// Upstream ответил 5xx, а у вызывающего есть чем его заменить: клиенту ничего не отправлено
+#define UPSTREAM_SERVER_ERROR -3
+// Upstream закрыл соединение или сломался, не прислав заголовок ответа:
+// клиенту тоже ничего не отправлено
+#define UPSTREAM_NO_RESPONSE -4
+// Блокирующий send режем на куски, чтобы дедлайны видели прогресс медленного клиента
+#define SEND_CHUNK_SIZE (256 * 1024)
+// Клиент ушел посреди ответа: докачиваем в кэш, если сделано больше
+// половины или осталось немного
+#define DEFAULT_BG_FILL_MIN_PERCENT 50
+#define DEFAULT_BG_FILL_MAX_LEFT (8 * 1024 * 1024)
+#define DEFAULT_BG_FILL_BUDGET (256 * 1024 * 1024)
 
 typedef enum {
     READ_HEAD,
@@ -19,31 +35,52 @@ typedef struct {
     long body_remaining;
 } http_reader_state;
 
+typedef struct {
+    int min_percent;
+    size_t max_left;
+    size_t budget;      // сколько байт на всех можно докачивать без клиентов
+} background_fill_policy;
+
 typedef struct {
     char* data;         
     size_t len;          
     int is_header;    
 } http_chunk;
 
+const char* find_end_line(const char* buffer, size_t len);
+
 http_chunk http_reader_next(int sock, http_reader_state* st,
                             char* buf, size_t cap, size_t* len_buf,
                             long content_length);
 
+ssize_t io_recv(int sock, void* buf, size_t len);
+
 int send_all(int sock, const void* buf, size_t len);
 
+int send_all2(int sock, const void* a, size_t a_len, const void* b, size_t b_len);
+
 long parse_content_length(http_request* req);
 
 int parse_host_and_port(http_request* req, char** out_host, char** out_port);
 
 int build_request(const http_request *req, dynbuf *out);
 
+int build_proxy_request(const http_request* req, const char* host, const char* port,
+                        const char* extra, dynbuf* out);
+
 int connect_hots(const char* host, const char* port);
 
 int read_and_parse_request_head(int client_sock, http_reader_state *st, char *io_buf, size_t io_cap, 
                                 size_t *io_len, http_request *req_out, long *content_length_out);
 
+int open_relay_pipe(int *relay_pipe);
+
+void close_relay_pipe(int *relay_pipe);
+
+long splice_relay(int from_sock, int to_sock, int *relay_pipe, long len);
+
 int proxy_body(int from_sock, int to_sock,http_reader_state *st, char *io_buf, 
-               size_t io_cap, size_t *io_len, long content_length);
+               size_t io_cap, size_t *io_len, long content_length, int *relay_pipe);
 
 long parse_content_length_from_header_line(const char *line);
 
@@ -51,6 +88,17 @@ int proxy_response(int upstream_sock, int client_sock);
 
 const char* from_absolute_path(const char *target, char *tmp, size_t tmp_cap);
 
-int proxy_response_and_maybe_cache(int upstream_sock, int client_sock, int do_cache, dynbuf *resp_acc);
+void init_background_fill_policy(background_fill_policy *policy);
+
+int upstream_last_status(void);
+
+int proxy_response_and_maybe_cache(int upstream_sock, int client_sock, size_t cache_limit, dynbuf *resp_acc,
+                                   int *relay_pipe, const background_fill_policy *bg_fill, int divert_5xx);
+
+size_t response_head_len(const char *buf, size_t len);
+
+int parse_response_status(const char *head, size_t head_len);
+
+int get_raw_header(const char *head, size_t head_len, const char *key, char *out, size_t cap);
 
 #endif
\ No newline at end of file
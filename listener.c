@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "listener.h"
+#include "config.h"
+
+void init_listener_opts(listener_opts* opts) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+
+    opts->count = (int)config_get_long("PROXY_LISTENERS", cpus);
+    if (opts->count < 1) {
+        opts->count = 1;
+    }
+    if (opts->count > MAX_LISTENERS) {
+        opts->count = MAX_LISTENERS;
+    }
+    opts->backlog = (int)config_get_long("PROXY_BACKLOG", DEFAULT_BACKLOG);
+    opts->defer_accept_sec = (int)config_get_long("PROXY_DEFER_ACCEPT", DEFAULT_DEFER_ACCEPT_SEC);
+    opts->fastopen_qlen = (int)config_get_long("PROXY_FASTOPEN", 0);
+    opts->ipv6 = config_get_bool("PROXY_IPV6", 1);
+}
+
+static int bind_socket(int family, int port) {
+    int sock = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEADDR) failed");
+    }
+    // Несколько сокетов на одном порту: ядро само раскидывает соединения между ними
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+    }
+
+    int rc;
+    if (family == AF_INET6) {
+        int v6only = 0;
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+            perror("setsockopt(IPV6_V6ONLY) failed");
+        }
+
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        rc = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        rc = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    }
+
+    if (rc == -1) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+int create_listener(int port, const listener_opts* opts) {
+    int sock = -1;
+    if (opts->ipv6) {
+        sock = bind_socket(AF_INET6, port);
+    }
+    if (sock == -1) {
+        // Нет IPv6 в ядре или контейнере - слушаем только IPv4
+        sock = bind_socket(AF_INET, port);
+    }
+    if (sock == -1) {
+        perror("error socket bind");
+        return -1;
+    }
+
+    if (opts->defer_accept_sec > 0) {
+        // Будить accept только когда пришли байты запроса
+        int sec = opts->defer_accept_sec;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &sec, sizeof(sec)) < 0) {
+            perror("setsockopt(TCP_DEFER_ACCEPT) failed");
+        }
+    }
+    if (opts->fastopen_qlen > 0) {
+        int qlen = opts->fastopen_qlen;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0) {
+            perror("setsockopt(TCP_FASTOPEN) failed");
+        }
+    }
+
+    if (listen(sock, opts->backlog) == -1) {
+        perror("error listen socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int open_listeners(int port, const listener_opts* opts, int* fds, int max_fds) {
+    int n = opts->count < max_fds ? opts->count : max_fds;
+    int opened = 0;
+
+    for (int i = 0; i < n; i++) {
+        int fd = create_listener(port, opts);
+        if (fd == -1) {
+            break;
+        }
+        fds[opened++] = fd;
+    }
+    return opened;
+}
+
+void close_listeners(int* fds, int n) {
+    for (int i = 0; i < n; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_DEFER_ACCEPT_SEC 5
+#define MAX_LISTENERS 64
+
+typedef struct {
+    int count;
+    int backlog;
+    int defer_accept_sec;
+    int fastopen_qlen;
+    int ipv6;
+} listener_opts;
+
+void init_listener_opts(listener_opts* opts);
+
+int create_listener(int port, const listener_opts* opts);
+
+int open_listeners(int port, const listener_opts* opts, int* fds, int max_fds);
+
+void close_listeners(int* fds, int n);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "mem_budget.h"
+
+// Единый учет памяти: записи кэша, служебные структуры, буферы заполнения
+// и буферы ввода-вывода соединений. Сами аллокации делают модули, здесь
+// только счетчики и решение "можно ли еще".
+static _Atomic size_t budget_limit = DEFAULT_MEM_LIMIT;
+static _Atomic size_t budget_used = 0;
+static _Atomic size_t budget_by_category[MEM_CATEGORIES_NUM];
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic int budget_waiters = 0;
+
+void init_mem_budget(size_t limit) {
+    atomic_store(&budget_limit, limit);
+    atomic_store(&budget_used, 0);
+    for (int i = 0; i < MEM_CATEGORIES_NUM; i++) {
+        atomic_store(&budget_by_category[i], 0);
+    }
+}
+
+void mem_budget_set_limit(size_t limit) {
+    atomic_store(&budget_limit, limit);
+
+    if (atomic_load(&budget_waiters) > 0) {
+        pthread_mutex_lock(&budget_lock);
+        pthread_cond_broadcast(&budget_cond);
+        pthread_mutex_unlock(&budget_lock);
+    }
+}
+
+size_t mem_budget_limit(void) {
+    return atomic_load_explicit(&budget_limit, memory_order_relaxed);
+}
+
+size_t mem_budget_used(void) {
+    return atomic_load_explicit(&budget_used, memory_order_relaxed);
+}
+
+size_t mem_budget_category(mem_category c) {
+    if ((int)c < 0 || c >= MEM_CATEGORIES_NUM) {
+        return 0;
+    }
+    return atomic_load_explicit(&budget_by_category[c], memory_order_relaxed);
+}
+
+int mem_budget_try_reserve(mem_category c, size_t n) {
+    if ((int)c < 0 || c >= MEM_CATEGORIES_NUM) {
+        return -1;
+    }
+
+    size_t limit = mem_budget_limit();
+    size_t used = atomic_load_explicit(&budget_used, memory_order_relaxed);
+    do {
+        if (n > limit || used > limit - n) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&budget_used, &used, used + n,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&budget_by_category[c], n, memory_order_relaxed);
+    return 0;
+}
+
+void mem_budget_force_reserve(mem_category c, size_t n) {
+    if ((int)c < 0 || c >= MEM_CATEGORIES_NUM) {
+        return;
+    }
+    atomic_fetch_add_explicit(&budget_used, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&budget_by_category[c], n, memory_order_relaxed);
+}
+
+void mem_budget_reserve_wait(mem_category c, size_t n, int timeout_ms) {
+    if (mem_budget_try_reserve(c, n) == 0) {
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&budget_lock);
+    atomic_fetch_add(&budget_waiters, 1);
+    int rc = 0;
+    while (mem_budget_try_reserve(c, n) != 0) {
+        if (rc == ETIMEDOUT) {
+            // Ждать дальше смысла нет: учитываем сверх лимита, чтобы не
+            // повиснуть навсегда, если память держат долгие соединения
+            mem_budget_force_reserve(c, n);
+            break;
+        }
+        rc = pthread_cond_timedwait(&budget_cond, &budget_lock, &deadline);
+    }
+    atomic_fetch_sub(&budget_waiters, 1);
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void mem_budget_release(mem_category c, size_t n) {
+    if ((int)c < 0 || c >= MEM_CATEGORIES_NUM || n == 0) {
+        return;
+    }
+    atomic_fetch_sub_explicit(&budget_by_category[c], n, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&budget_used, n, memory_order_relaxed);
+
+    if (atomic_load_explicit(&budget_waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&budget_lock);
+        pthread_cond_broadcast(&budget_cond);
+        pthread_mutex_unlock(&budget_lock);
+    }
+}
+
+int mem_budget_admit_fill(size_t expected) {
+    size_t limit = mem_budget_limit();
+    size_t high = limit / 100 * MEM_FILL_HIGH_WATERMARK;
+    size_t used = mem_budget_used();
+
+    if (used >= high || expected > high - used) {
+        return 0;
+    }
+    return 1;
+}
+
+int reserve_dynbuf_accounted(dynbuf* buffer, size_t cap, mem_category c) {
+    if (buffer == NULL || cap <= buffer->cap) {
+        return 0;
+    }
+
+    size_t delta = cap - buffer->cap;
+    if (mem_budget_try_reserve(c, delta) != 0) {
+        return -1;
+    }
+    if (reserve_dynbuf(buffer, cap) != 0) {
+        mem_budget_release(c, delta);
+        return -1;
+    }
+    return 0;
+}
+
+int add_dynbuf_accounted(dynbuf* buffer, const void* src, size_t n, mem_category c) {
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    size_t new_cap = dynbuf_next_cap(buffer, n);
+    if (reserve_dynbuf_accounted(buffer, new_cap, c) != 0) {
+        return -1;
+    }
+    return add_dynbuf(buffer, src, n);
+}
+
+void free_dynbuf_accounted(dynbuf* buffer, mem_category c) {
+    if (buffer == NULL) {
+        return;
+    }
+    mem_budget_release(c, buffer->cap);
+    free_dynbuf(buffer);
+}
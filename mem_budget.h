@@ -0,0 +1,47 @@
+#ifndef __MEM_BUDGET_H__
+#define __MEM_BUDGET_H__
+
+#include <stdlib.h>
+
+#include "dynamic_buffer.h"
+
+#define DEFAULT_MEM_LIMIT (2ULL * 1024 * 1024 * 1024 + 256ULL * 1024 * 1024)
+// Новые заполнения кэша не начинаются, если занято больше этой доли бюджета
+#define MEM_FILL_HIGH_WATERMARK 90
+#define MEM_BACKPRESSURE_WAIT_MS 200
+
+typedef enum {
+    MEM_CACHE_ENTRIES,
+    MEM_CACHE_OVERHEAD,
+    MEM_FILL_BUFFERS,
+    MEM_IO_BUFFERS,
+    MEM_CATEGORIES_NUM
+} mem_category;
+
+void init_mem_budget(size_t limit);
+
+void mem_budget_set_limit(size_t limit);
+
+size_t mem_budget_limit(void);
+
+size_t mem_budget_used(void);
+
+size_t mem_budget_category(mem_category c);
+
+int mem_budget_try_reserve(mem_category c, size_t n);
+
+void mem_budget_force_reserve(mem_category c, size_t n);
+
+void mem_budget_reserve_wait(mem_category c, size_t n, int timeout_ms);
+
+void mem_budget_release(mem_category c, size_t n);
+
+int mem_budget_admit_fill(size_t expected);
+
+int reserve_dynbuf_accounted(dynbuf* buffer, size_t cap, mem_category c);
+
+int add_dynbuf_accounted(dynbuf* buffer, const void* src, size_t n, mem_category c);
+
+void free_dynbuf_accounted(dynbuf* buffer, mem_category c);
+
+#endif
@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "mem_pressure.h"
+
+#define CGROUP2_ROOT "/sys/fs/cgroup"
+#define CGROUP1_MEMORY_ROOT "/sys/fs/cgroup/memory"
+// cgroup v1 пишет сюда почти LONG_MAX, если лимита нет
+#define CGROUP1_NO_LIMIT (1ULL << 60)
+
+static int read_file(const char* path, char* buf, size_t cap) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, cap - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+
+// Ищет в /proc/self/cgroup путь для v2 ("0::") или для v1-контроллера memory
+static int own_cgroup_path(int v2, char* out, size_t cap) {
+    FILE* f = fopen("/proc/self/cgroup", "re");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[4096];
+    int found = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+
+        char* path = NULL;
+        if (v2 && strncmp(line, "0::", 3) == 0) {
+            path = line + 3;
+        } else if (!v2) {
+            char* controllers = strchr(line, ':');
+            char* p = controllers ? strchr(controllers + 1, ':') : NULL;
+            if (p != NULL) {
+                *p = '\0';
+                if (strstr(controllers + 1, "memory") != NULL) {
+                    path = p + 1;
+                }
+            }
+        }
+
+        if (path != NULL && strlen(path) < cap) {
+            strcpy(out, path);
+            found = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static size_t cgroup2_limit(void) {
+    char rel[2048];
+    if (own_cgroup_path(1, rel, sizeof(rel)) != 0) {
+        return 0;
+    }
+
+    // Лимит может стоять на любом предке, берем минимальный
+    size_t best = 0;
+    while (1) {
+        char path[4096];
+        char value[64];
+        snprintf(path, sizeof(path), CGROUP2_ROOT "%s/memory.max",
+                 strcmp(rel, "/") == 0 ? "" : rel);
+
+        if (read_file(path, value, sizeof(value)) == 0 && strncmp(value, "max", 3) != 0) {
+            size_t v = (size_t)strtoull(value, NULL, 10);
+            if (v > 0 && (best == 0 || v < best)) {
+                best = v;
+            }
+        }
+
+        char* slash = strrchr(rel, '/');
+        if (slash == NULL || slash == rel) {
+            break;
+        }
+        *slash = '\0';
+    }
+    return best;
+}
+
+static size_t cgroup1_limit(void) {
+    char rel[2048];
+    if (own_cgroup_path(0, rel, sizeof(rel)) != 0) {
+        return 0;
+    }
+
+    char path[4096];
+    char value[64];
+    snprintf(path, sizeof(path), CGROUP1_MEMORY_ROOT "%s/memory.limit_in_bytes", rel);
+    if (read_file(path, value, sizeof(value)) != 0 &&
+        read_file(CGROUP1_MEMORY_ROOT "/memory.limit_in_bytes", value, sizeof(value)) != 0) {
+        return 0;
+    }
+
+    unsigned long long v = strtoull(value, NULL, 10);
+    if (v == 0 || v >= CGROUP1_NO_LIMIT) {
+        return 0;
+    }
+    return (size_t)v;
+}
+
+static size_t physical_memory(void) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) {
+        return 0;
+    }
+    return (size_t)pages * (size_t)page_size;
+}
+
+size_t detect_memory_limit(void) {
+    size_t phys = physical_memory();
+    size_t limit = cgroup2_limit();
+    if (limit == 0) {
+        limit = cgroup1_limit();
+    }
+    if (limit == 0 || (phys != 0 && limit > phys)) {
+        limit = phys;
+    }
+    return limit;
+}
+
+static int pressure_file(char* out, size_t cap) {
+    char rel[2048];
+    if (own_cgroup_path(1, rel, sizeof(rel)) == 0) {
+        snprintf(out, cap, CGROUP2_ROOT "%s/memory.pressure", strcmp(rel, "/") == 0 ? "" : rel);
+        if (access(out, R_OK) == 0) {
+            return 0;
+        }
+    }
+
+    snprintf(out, cap, "/proc/pressure/memory");
+    return access(out, R_OK);
+}
+
+int open_psi_trigger(void) {
+    char path[4096];
+    if (pressure_file(path, sizeof(path)) != 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char trigger[64];
+    int n = snprintf(trigger, sizeof(trigger), "some %d %d", PSI_TRIGGER_STALL_US, PSI_TRIGGER_WINDOW_US);
+    if (write(fd, trigger, (size_t)n + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+double read_memory_pressure(void) {
+    char path[4096];
+    char buf[512];
+    if (pressure_file(path, sizeof(path)) != 0 || read_file(path, buf, sizeof(buf)) != 0) {
+        return 0.0;
+    }
+
+    // some avg10=1.23 avg60=... - доля времени, когда хоть кто-то ждал память
+    const char* p = strstr(buf, "some avg10=");
+    if (p == NULL) {
+        return 0.0;
+    }
+    return strtod(p + strlen("some avg10="), NULL);
+}
@@ -0,0 +1,16 @@
+#ifndef __MEM_PRESSURE_H__
+#define __MEM_PRESSURE_H__
+
+#include <stdlib.h>
+
+// Порог срабатывания PSI-триггера: 150 мс простоя за окно в 2 с
+#define PSI_TRIGGER_STALL_US 150000
+#define PSI_TRIGGER_WINDOW_US 2000000
+
+size_t detect_memory_limit(void);
+
+int open_psi_trigger(void);
+
+double read_memory_pressure(void);
+
+#endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "mem_budget.h"
+
+#define CACHE_LINE 64
+// Границы корзин в выдаче Prometheus: степени двойки от 64 мкс до ~33 с
+#define EXPORT_MIN_POW 6
+#define EXPORT_MAX_POW 25
+
+typedef struct metrics_shard {
+    _Atomic int64_t counters[METRIC_COUNTERS_NUM];
+    _Atomic uint64_t buckets[STAGES_NUM][METRICS_BUCKETS];
+    _Atomic uint64_t sum_us[STAGES_NUM];
+    _Atomic int in_use;
+    struct metrics_shard* next;
+} __attribute__((aligned(CACHE_LINE))) metrics_shard;
+
+static _Atomic(metrics_shard*) shards = NULL;
+static Cache_Map* metrics_map = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread metrics_shard* local_shard = NULL;
+
+static const char* counter_names[METRIC_COUNTERS_NUM] = {
+    [METRIC_REQUESTS] = "proxy_requests_total",
+    [METRIC_CACHE_HITS] = "proxy_cache_hits_total",
+    [METRIC_CACHE_MISSES] = "proxy_cache_misses_total",
+    [METRIC_CACHE_STALE_HITS] = "proxy_cache_stale_while_revalidate_total",
+    [METRIC_CACHE_STALE_ERRORS] = "proxy_cache_stale_if_error_total",
+    [METRIC_CACHE_FILLS] = "proxy_cache_fills_total",
+    [METRIC_BACKGROUND_FILLS] = "proxy_cache_background_fills_total",
+    [METRIC_BYTES_FROM_CACHE] = "proxy_bytes_from_cache_total",
+    [METRIC_BYTES_FROM_UPSTREAM] = "proxy_bytes_from_upstream_total",
+    [METRIC_EVICTIONS] = "proxy_cache_evictions_total",
+    [METRIC_UPSTREAM_REJECTED] = "proxy_upstream_rejected_total",
+    [METRIC_UPSTREAM_ERRORS] = "proxy_upstream_errors_total",
+    [METRIC_TIMEOUTS] = "proxy_timeouts_total",
+    [METRIC_ACCESS_LOG_DROPPED] = "proxy_access_log_dropped_total",
+    [METRIC_PEER_FETCHES] = "proxy_peer_fetches_total",
+    [METRIC_PEER_ERRORS] = "proxy_peer_errors_total",
+    [METRIC_UPSTREAM_GROUP_FETCHES] = "proxy_upstream_group_fetches_total",
+    [METRIC_UPSTREAM_EJECTIONS] = "proxy_upstream_ejections_total",
+    [METRIC_ACTIVE_CONNECTIONS] = "proxy_active_connections",
+    [METRIC_HIT_QUEUE] = "proxy_hit_queue_depth",
+    [METRIC_UPSTREAM_QUEUE] = "proxy_upstream_queue_depth",
+};
+
+static const char* stage_names[STAGES_NUM] = {
+    [STAGE_PARSE] = "parse",
+    [STAGE_LOOKUP] = "lookup",
+    [STAGE_CONNECT] = "connect",
+    [STAGE_TTFB] = "ttfb",
+    [STAGE_TOTAL] = "total",
+};
+
+static void release_shard(void* arg) {
+    metrics_shard* shard = (metrics_shard*)arg;
+    atomic_store_explicit(&shard->in_use, 0, memory_order_release);
+}
+
+static void make_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+// Как и записи эпох: поток на соединение, поэтому шарды переиспользуются,
+// а накопленные в них значения остаются
+static metrics_shard* acquire_shard(void) {
+    if (local_shard != NULL) {
+        return local_shard;
+    }
+    pthread_once(&key_once, make_key);
+
+    metrics_shard* shard = atomic_load_explicit(&shards, memory_order_acquire);
+    for (; shard != NULL; shard = shard->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (shard == NULL) {
+        shard = aligned_alloc(CACHE_LINE, sizeof(*shard));
+        if (shard == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < METRIC_COUNTERS_NUM; i++) {
+            atomic_init(&shard->counters[i], 0);
+        }
+        for (int s = 0; s < STAGES_NUM; s++) {
+            for (int i = 0; i < METRICS_BUCKETS; i++) {
+                atomic_init(&shard->buckets[s][i], 0);
+            }
+            atomic_init(&shard->sum_us[s], 0);
+        }
+        atomic_init(&shard->in_use, 1);
+
+        metrics_shard* head = atomic_load(&shards);
+        do {
+            shard->next = head;
+        } while (!atomic_compare_exchange_weak(&shards, &head, shard));
+    }
+
+    local_shard = shard;
+    pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+void init_metrics(Cache_Map* map) {
+    metrics_map = map;
+}
+
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Пишет в шард только его владелец, поэтому хватает load+store без lock-префикса
+void metrics_add(metric_counter c, int64_t n) {
+    metrics_shard* shard = acquire_shard();
+    if (shard == NULL) {
+        return;
+    }
+    _Atomic int64_t* v = &shard->counters[c];
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+int64_t metrics_local(metric_counter c) {
+    metrics_shard* shard = acquire_shard();
+    if (shard == NULL) {
+        return 0;
+    }
+    return atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+}
+
+// Сумма по всем шардам: для решений в самом процессе, не только для /metrics
+int64_t metrics_value(metric_counter c) {
+    int64_t total = 0;
+    metrics_shard* shard = atomic_load_explicit(&shards, memory_order_acquire);
+    for (; shard != NULL; shard = shard->next) {
+        total += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+    }
+    return total;
+}
+
+static unsigned bucket_index(uint64_t v) {
+    if (v < (1u << METRICS_SUB_BITS)) {
+        return (unsigned)v;
+    }
+    unsigned e = 63 - (unsigned)__builtin_clzll(v);
+    if (e > METRICS_MAX_EXP) {
+        return METRICS_BUCKETS - 1;
+    }
+    unsigned sub = (unsigned)(v >> (e - METRICS_SUB_BITS)) & ((1u << METRICS_SUB_BITS) - 1);
+    return ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+// Верхняя (не включительно) граница корзины в микросекундах
+static uint64_t bucket_upper(unsigned i) {
+    unsigned per = 1u << METRICS_SUB_BITS;
+    if (i < per) {
+        return i + 1;
+    }
+    unsigned group = i >> METRICS_SUB_BITS;
+    unsigned sub = i & (per - 1);
+    return (uint64_t)(per + sub + 1) << (group - 1);
+}
+
+void metrics_observe(metric_stage s, uint64_t usec) {
+    metrics_shard* shard = acquire_shard();
+    if (shard == NULL) {
+        return;
+    }
+    _Atomic uint64_t* b = &shard->buckets[s][bucket_index(usec)];
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + 1, memory_order_relaxed);
+    _Atomic uint64_t* sum = &shard->sum_us[s];
+    atomic_store_explicit(sum, atomic_load_explicit(sum, memory_order_relaxed) + usec, memory_order_relaxed);
+}
+
+static int append_fmt(dynbuf* out, const char* fmt, ...) {
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(line)) {
+        return -1;
+    }
+    return add_dynbuf(out, line, (size_t)n);
+}
+
+static int render_histograms(dynbuf* out, uint64_t merged[STAGES_NUM][METRICS_BUCKETS],
+                             const uint64_t* sums) {
+    int rc = 0;
+    rc |= append_fmt(out, "# TYPE proxy_stage_latency_seconds histogram\n");
+    for (int s = 0; s < STAGES_NUM; s++) {
+        uint64_t cumulative = 0;
+        unsigned i = 0;
+        for (int p = EXPORT_MIN_POW; p <= EXPORT_MAX_POW; p++) {
+            uint64_t bound = 1ULL << p;
+            while (i < METRICS_BUCKETS && bucket_upper(i) <= bound) {
+                cumulative += merged[s][i++];
+            }
+            rc |= append_fmt(out, "proxy_stage_latency_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %llu\n",
+                             stage_names[s], (double)bound / 1e6, (unsigned long long)cumulative);
+        }
+        while (i < METRICS_BUCKETS) {
+            cumulative += merged[s][i++];
+        }
+        rc |= append_fmt(out, "proxy_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                         stage_names[s], (unsigned long long)cumulative);
+        rc |= append_fmt(out, "proxy_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n",
+                         stage_names[s], (double)sums[s] / 1e6);
+        rc |= append_fmt(out, "proxy_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+                         stage_names[s], (unsigned long long)cumulative);
+    }
+
+    // Квантили считаем по мелким корзинам - точнее, чем по экспортным границам
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    rc |= append_fmt(out, "# TYPE proxy_stage_latency_quantile_seconds gauge\n");
+    for (int s = 0; s < STAGES_NUM; s++) {
+        uint64_t total = 0;
+        for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+            total += merged[s][i];
+        }
+        if (total == 0) {
+            continue;
+        }
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * (double)total);
+            if (rank == 0) {
+                rank = 1;
+            }
+            uint64_t seen = 0;
+            unsigned i = 0;
+            for (; i < METRICS_BUCKETS; i++) {
+                seen += merged[s][i];
+                if (seen >= rank) {
+                    break;
+                }
+            }
+            if (i == METRICS_BUCKETS) {
+                i = METRICS_BUCKETS - 1;
+            }
+            rc |= append_fmt(out, "proxy_stage_latency_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+                             stage_names[s], quantiles[q], (double)bucket_upper(i) / 1e6);
+        }
+    }
+    return rc;
+}
+
+int metrics_render(dynbuf* out) {
+    int64_t counters[METRIC_COUNTERS_NUM] = {0};
+    uint64_t sums[STAGES_NUM] = {0};
+    uint64_t (*merged)[METRICS_BUCKETS] = calloc(STAGES_NUM, sizeof(*merged));
+    if (merged == NULL) {
+        return -1;
+    }
+
+    metrics_shard* shard = atomic_load_explicit(&shards, memory_order_acquire);
+    for (; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNTERS_NUM; i++) {
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int s = 0; s < STAGES_NUM; s++) {
+            for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+                merged[s][i] += atomic_load_explicit(&shard->buckets[s][i], memory_order_relaxed);
+            }
+            sums[s] += atomic_load_explicit(&shard->sum_us[s], memory_order_relaxed);
+        }
+    }
+
+    int rc = 0;
+    for (int i = 0; i < METRIC_COUNTERS_NUM; i++) {
+        const char* type = i >= METRIC_ACTIVE_CONNECTIONS ? "gauge" : "counter";
+        rc |= append_fmt(out, "# TYPE %s %s\n%s %lld\n", counter_names[i], type, counter_names[i],
+                         (long long)counters[i]);
+    }
+
+    if (metrics_map != NULL) {
+        size_t entries, bytes, limit;
+        cache_map_stats(metrics_map, &entries, &bytes, &limit);
+        rc |= append_fmt(out, "# TYPE proxy_cache_entries gauge\nproxy_cache_entries %zu\n", entries);
+        rc |= append_fmt(out, "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %zu\n", bytes);
+        rc |= append_fmt(out, "# TYPE proxy_cache_limit_bytes gauge\nproxy_cache_limit_bytes %zu\n", limit);
+    }
+    rc |= append_fmt(out, "# TYPE proxy_memory_used_bytes gauge\nproxy_memory_used_bytes %zu\n",
+                     mem_budget_used());
+    rc |= append_fmt(out, "# TYPE proxy_memory_limit_bytes gauge\nproxy_memory_limit_bytes %zu\n",
+                     mem_budget_limit());
+
+    rc |= render_histograms(out, merged, sums);
+    free(merged);
+    return rc == 0 ? 0 : -1;
+}
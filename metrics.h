@@ -0,0 +1,69 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#include "dynamic_buffer.h"
+#include "cache_map.h"
+
+// Счетчики и гистограммы задержек. Каждый поток пишет в свой шард без
+// атомарных RMW, при выдаче /metrics шарды складываются.
+
+// HDR-подобная гистограмма: 8 под-корзин на каждую степень двойки
+// микросекунд, относительная погрешность не больше 12.5%
+#define METRICS_SUB_BITS 3
+#define METRICS_MAX_EXP 36
+#define METRICS_BUCKETS (((METRICS_MAX_EXP - METRICS_SUB_BITS) + 2) << METRICS_SUB_BITS)
+
+typedef enum {
+    METRIC_REQUESTS,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_CACHE_STALE_HITS,
+    METRIC_CACHE_STALE_ERRORS,
+    METRIC_CACHE_FILLS,
+    METRIC_BACKGROUND_FILLS,
+    METRIC_BYTES_FROM_CACHE,
+    METRIC_BYTES_FROM_UPSTREAM,
+    METRIC_EVICTIONS,
+    METRIC_UPSTREAM_REJECTED,
+    METRIC_UPSTREAM_ERRORS,
+    METRIC_TIMEOUTS,
+    METRIC_ACCESS_LOG_DROPPED,
+    METRIC_PEER_FETCHES,
+    METRIC_PEER_ERRORS,
+    METRIC_UPSTREAM_GROUP_FETCHES,
+    METRIC_UPSTREAM_EJECTIONS,
+    // Ниже - значения-уровни: потоки прибавляют и вычитают
+    METRIC_ACTIVE_CONNECTIONS,
+    METRIC_HIT_QUEUE,
+    METRIC_UPSTREAM_QUEUE,
+    METRIC_COUNTERS_NUM
+} metric_counter;
+
+typedef enum {
+    STAGE_PARSE,
+    STAGE_LOOKUP,
+    STAGE_CONNECT,
+    STAGE_TTFB,
+    STAGE_TOTAL,
+    STAGES_NUM
+} metric_stage;
+
+void init_metrics(Cache_Map* map);
+
+uint64_t metrics_now_us(void);
+
+void metrics_add(metric_counter c, int64_t n);
+
+void metrics_observe(metric_stage s, uint64_t usec);
+
+// Значение счетчика в шарде текущего потока: разница до и после запроса
+// дает его собственный вклад
+int64_t metrics_local(metric_counter c);
+
+int64_t metrics_value(metric_counter c);
+
+int metrics_render(dynbuf* out);
+
+#endif
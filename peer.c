@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "peer.h"
+#include "hash_ring.h"
+#include "http_utils.h"
+#include "cache_map.h"
+#include "config.h"
+
+// Пиринг соседних прокси: ключи поделены между узлами PROXY_PEERS
+// консистентным хешированием. Промах по чужому ключу идет к его владельцу
+// как к обычному прокси, и в origin за объектом ходит только владелец.
+// Имя этого узла - PROXY_PEER_SELF, по умолчанию 127.0.0.1:PROXY_PORT
+
+struct peer {
+    char name[PEER_NAME_LEN];
+    char host[PEER_NAME_LEN];
+    char port[16];
+    int self;
+    _Atomic int64_t down_until;
+};
+
+static peer peers[MAX_PEERS];
+static int peers_num = 0;
+static hash_ring ring;
+static char self_name[PEER_NAME_LEN];
+
+static int add_peer(const char* name) {
+    while (*name == ' ' || *name == '\t') {
+        name++;
+    }
+    const char* sep = strrchr(name, ':');
+    if (sep == NULL || sep == name || sep[1] == '\0' || peers_num >= MAX_PEERS ||
+        strlen(name) >= PEER_NAME_LEN || strlen(sep + 1) >= sizeof(peers[0].port)) {
+        return -1;
+    }
+
+    peer* p = &peers[peers_num];
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    snprintf(p->host, sizeof(p->host), "%.*s", (int)(sep - name), name);
+    snprintf(p->port, sizeof(p->port), "%s", sep + 1);
+    p->self = strcmp(p->name, self_name) == 0;
+    atomic_init(&p->down_until, 0);
+    peers_num++;
+    return 0;
+}
+
+int init_peers(void) {
+    const char* list = config_get_str("PROXY_PEERS", NULL);
+    if (list == NULL) {
+        return 0;
+    }
+
+    const char* self = config_get_str("PROXY_PEER_SELF", NULL);
+    if (self != NULL) {
+        snprintf(self_name, sizeof(self_name), "%s", self);
+    } else {
+        snprintf(self_name, sizeof(self_name), "127.0.0.1:%s", config_get_str("PROXY_PORT", "5423"));
+    }
+
+    char* copy = strdup(list);
+    if (copy == NULL) {
+        return -1;
+    }
+    char* save = NULL;
+    for (char* tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (add_peer(tok) != 0) {
+            printf("Ignoring peer \"%s\"\n", tok);
+        }
+    }
+    free(copy);
+
+    const char* names[MAX_PEERS];
+    int have_self = 0;
+    for (int i = 0; i < peers_num; i++) {
+        names[i] = peers[i].name;
+        have_self |= peers[i].self;
+    }
+    if (peers_num == 0 || init_hash_ring(&ring, names, peers_num, HASH_RING_VNODES) != 0) {
+        peers_num = 0;
+        return -1;
+    }
+    // Узел не из списка своих ключей не держит и все промахи отдает соседям
+    printf("Peering with %d nodes as %s%s\n", peers_num, self_name, have_self ? "" : " (not in PROXY_PEERS)");
+    return 0;
+}
+
+static int peer_usable(int node, void* arg) {
+    (void)arg;
+    return peers[node].self || cache_clock() >= atomic_load(&peers[node].down_until);
+}
+
+// Владелец ключа, если это не мы; лежащих соседей обходим, и их ключи
+// расходятся по следующим узлам кольца
+const peer* peer_owner(uint64_t key_hash) {
+    if (peers_num == 0) {
+        return NULL;
+    }
+    int node = hash_ring_lookup(&ring, key_hash, peer_usable, NULL);
+    if (node < 0 || peers[node].self) {
+        return NULL;
+    }
+    return &peers[node];
+}
+
+const char* peer_name(const peer* p) {
+    return p->name;
+}
+
+void peer_mark_down(const peer* p) {
+    atomic_store(&peers[p - peers].down_until, cache_clock() + PEER_RETRY_SEC);
+}
+
+int peer_connect(const peer* p) {
+    int sock = connect_hots(p->host, p->port);
+    if (sock < 0) {
+        peer_mark_down(p);
+    }
+    return sock;
+}
+
+int is_peer_request(http_request* req) {
+    return req != NULL && get_http_header(req, PEER_HEADER) != NULL;
+}
+
+// Соседу уходит запрос в форме для прокси и с меткой PEER_HEADER;
+// build_request эту метку дальше в origin не пропускает
+int peer_build_request(const http_request* req, const char* host, const char* port, dynbuf* out) {
+    char tag[PEER_NAME_LEN + 32];
+    int tag_len = snprintf(tag, sizeof(tag), "%s: %s", PEER_HEADER, self_name);
+    if (tag_len < 0 || (size_t)tag_len >= sizeof(tag)) {
+        return -1;
+    }
+    return build_proxy_request(req, host, port, tag, out);
+}
@@ -0,0 +1,33 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdint.h>
+
+#include "http_request.h"
+#include "dynamic_buffer.h"
+
+#define MAX_PEERS 32
+#define PEER_NAME_LEN 128
+#define PEER_RETRY_SEC 5
+// Запрос от соседа: его промах идет прямо в origin, а не дальше по кругу
+#define PEER_HEADER "X-Proxy-Peer"
+
+typedef struct peer peer;
+
+int init_peers(void);
+
+const peer* peer_owner(uint64_t key_hash);
+
+const char* peer_name(const peer* p);
+
+int peer_connect(const peer* p);
+
+// Сосед принял соединение, но не ответил вовремя или ответил 5xx:
+// его ключи на PEER_RETRY_SEC уходят следующему по кольцу
+void peer_mark_down(const peer* p);
+
+int is_peer_request(http_request* req);
+
+int peer_build_request(const http_request* req, const char* host, const char* port, dynbuf* out);
+
+#endif
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "prefork.h"
+
+// Мастер ничего не обслуживает: только держит рабочих и перезапускает
+// упавших. Потоков у него нет, поэтому fork() из него безопасен
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static pid_t spawn_worker(pid_t master) {
+    // Иначе недописанный буфер stdout напечатают и мастер, и рабочий
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    // Мастер умер - рабочим тоже пора, иначе некому будет их перезапускать
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master) {
+        _exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+// Возвращается только в рабочем процессе - с его номером; -1 при ошибке
+int run_prefork(int workers, prefork_reap_fn reap) {
+    if (workers <= 0 || workers > PREFORK_MAX_WORKERS) {
+        return -1;
+    }
+
+    pid_t master = getpid();
+    pid_t pids[PREFORK_MAX_WORKERS];
+    time_t started[PREFORK_MAX_WORKERS];
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    // Без SA_RESTART: waitpid() должен прерваться и увидеть stopping
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (int i = 0; i < workers; i++) {
+        pids[i] = spawn_worker(master);
+        if (pids[i] == 0) {
+            return i;
+        }
+        started[i] = time(NULL);
+        if (pids[i] < 0) {
+            perror("error forking worker");
+        }
+    }
+    printf("Master %d started %d workers\n", (int)master, workers);
+
+    while (!stopping) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Детей нет: все fork() не удались
+            sleep(PREFORK_RESPAWN_DELAY_SEC);
+        }
+
+        for (int i = 0; i < workers; i++) {
+            if (pid > 0 && pids[i] != pid) {
+                continue;
+            }
+            if (pid < 0 && pids[i] > 0) {
+                continue;
+            }
+            if (pid > 0) {
+                if (WIFSIGNALED(status)) {
+                    fprintf(stderr, "worker %d (pid %d) killed by signal %d\n", i, (int)pid, WTERMSIG(status));
+                } else {
+                    fprintf(stderr, "worker %d (pid %d) exited with %d\n", i, (int)pid, WEXITSTATUS(status));
+                }
+                if (reap != NULL) {
+                    reap(i);
+                }
+            }
+            if (stopping) {
+                break;
+            }
+            // Процесс, падающий сразу после старта, не перезапускаем в цикле
+            if (time(NULL) - started[i] < PREFORK_RESPAWN_DELAY_SEC) {
+                sleep(PREFORK_RESPAWN_DELAY_SEC);
+            }
+            pids[i] = spawn_worker(master);
+            if (pids[i] == 0) {
+                return i;
+            }
+            started[i] = time(NULL);
+            if (pids[i] < 0) {
+                perror("error forking worker");
+            }
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    exit(EXIT_SUCCESS);
+}
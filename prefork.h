@@ -0,0 +1,12 @@
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+#define PREFORK_RESPAWN_DELAY_SEC 1
+#define PREFORK_MAX_WORKERS 64
+
+// Вызывается в мастере после waitpid() упавшего или завершившегося рабочего
+typedef void (*prefork_reap_fn)(int worker);
+
+int run_prefork(int workers, prefork_reap_fn reap);
+
+#endif
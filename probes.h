@@ -0,0 +1,58 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+// USDT-точки провайдера proxy. С <sys/sdt.h> (systemtap-sdt-dev) каждая точка -
+// один nop и запись в .note.stapsdt, пока к процессу не подключился bpftrace
+// или perf; без заголовка или с -DPROXY_NO_USDT макросы пустые.
+//
+//   bpftrace -l 'usdt:./proxy_server:proxy:*'
+//   bpftrace -e 'usdt:./proxy_server:proxy:upstream_first_byte { @ttfb = hist(arg1); }'
+//
+// Точки и аргументы (времена в микросекундах):
+//   request_parsed        method, content_length, parse_us
+//   cache_lookup          key_hash, result (probe_lookup_result), lookup_us
+//   upstream_connect_start host, port (строки)
+//   upstream_connect_done fd (-1 при ошибке), connect_us
+//   upstream_first_byte   status, ttfb_us, head_bytes
+//   cache_insert          key_hash, size, encoding
+//   cache_reject          key_hash, size, reason (probe_reject_reason)
+//   evict_start           total_size, max_size, count
+//   evict_done            evicted, freed_bytes, evict_us
+//   conn_close            key_hash, bytes, result (access_result), total_us
+
+#if !defined(PROXY_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROXY_USDT 1
+#endif
+#endif
+
+typedef enum {
+    PROBE_LOOKUP_MISS,
+    PROBE_LOOKUP_FRESH,
+    PROBE_LOOKUP_STALE_REVALIDATE,
+    PROBE_LOOKUP_STALE_IF_ERROR,
+    PROBE_LOOKUP_EXPIRED,
+    PROBE_LOOKUP_ERROR
+} probe_lookup_result;
+
+typedef enum {
+    PROBE_REJECT_STATUS,
+    PROBE_REJECT_LIFETIME,
+    PROBE_REJECT_NO_ROOM,
+    PROBE_REJECT_NOT_BUFFERED
+} probe_reject_reason;
+
+#ifdef PROXY_USDT
+#define PROBE2(name, a, b) DTRACE_PROBE2(proxy, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(proxy, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(proxy, name, a, b, c, d)
+#else
+// Аргументы все равно "используются", чтобы не было предупреждений о
+// переменных, нужных только точкам; побочных эффектов у них нет
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif
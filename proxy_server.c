@@ -11,12 +11,34 @@
 #include <semaphore.h>
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
 
 #include "http_request.h"
 #include "dynamic_buffer.h"
 #include "http_utils.h"
 #include "cache_map.h"
 #include "cleanup_thread.h"
+#include "http_compress.h"
+#include "mem_budget.h"
+#include "config.h"
+#include "mem_pressure.h"
+#include "zerocopy.h"
+#include "uring_io.h"
+#include "listener.h"
+#include "conc_limiter.h"
+#include "conn_deadline.h"
+#include "revalidate.h"
+#include "metrics.h"
+#include "probes.h"
+#include "shm_cache.h"
+#include "prefork.h"
+#include "peer.h"
+#include "upstream.h"
+#include "admin_server.h"
+#include "topk.h"
+#include "access_log.h"
+#include "capture.h"
+#include "upgrade.h"
 
 #define INITIALIZATION_ERROR -1
 #define INVALID_SERVER_PORT -1
@@ -24,17 +46,41 @@
 #define NO_EMPTY_NODE -1
 
 
-#define REQUEST_QUEUE_SIZE 32
-#define MAX_THREADS 2
+// Попадания в кэш обслуживаются отдельной полосой и не ждут медленные промахи
+#define MAX_HIT_THREADS 16
+#define MAX_CONNECTIONS 1024
+// Стек-буферы одного соединения: чтение запроса, заголовок ответа и relay
+#define CONNECTION_IO_BYTES (MAX_BUFFER_SIZE + MAX_RESPONSE_HEAD_SIZE + RELAY_BUFFER_SIZE)
+// Доли от лимита cgroup: весь бюджет процесса и кэш внутри него
+#define MEM_LIMIT_PERCENT 80
+#define CACHE_SHARE_PERCENT 75
+#define CLEANER_INTERVAL_SEC 5
+#define CLEANER_PERCENT_FOR_DEL 50
 
 static Cache_Map cache;
+static compress_policy compress;
+static background_fill_policy bg_fill;
+static stale_policy stale_cfg;
+static int use_splice = 1;
+
+typedef struct server_lanes {
+    sem_t connections;
+    sem_t hits;
+} server_lanes;
 
 typedef struct client_args {
-    sem_t* server_threads_sem;
+    server_lanes* lanes;
     int socket;
 } client_args;
 
+// Время этапа идет и в гистограмму, и в запись журнала запроса
+static void observe_stage(metric_stage s, uint64_t usec) {
+    metrics_observe(s, usec);
+    access_log_stage(s, usec);
+}
+
 static void send_simple_502(int client_sock) {
+    access_log_status(502);
     const char *resp =
         "HTTP/1.0 502 Bad Gateway\r\n"
         "Connection: close\r\n"
@@ -43,10 +89,131 @@ static void send_simple_502(int client_sock) {
     (void)send_all(client_sock, resp, strlen(resp));
 }
 
+static void send_simple_504(int client_sock) {
+    access_log_status(504);
+    const char *resp =
+        "HTTP/1.0 504 Gateway Timeout\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    (void)send_all(client_sock, resp, strlen(resp));
+}
+
+static void send_simple_503(int client_sock) {
+    access_log_status(503);
+    const char *resp =
+        "HTTP/1.0 503 Service Unavailable\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+    (void)send_all(client_sock, resp, strlen(resp));
+}
+
+static int send_cache_node(int client_sock, http_request* req, const Cache_Node* hit) {
+    if (hit->encoding == CACHE_ENC_GZIP) {
+        if (client_accepts_gzip(req)) {
+            return send_cached_gzip(client_sock, hit->response, hit->size, hit->head_len);
+        }
+        return send_cached_gunzip(client_sock, hit->response, hit->size, hit->head_len);
+    }
+    return send_cached_body(client_sock, hit->response, hit->size);
+}
+
+// Отдача из кэша идет через полосу попаданий; ожидающие в ней видны в /metrics.
+// Уведомления zerocopy от медленного клиента ждем уже вне полосы: узел
+// вызывающий держит до выхода отсюда
+static int serve_cache_hit(server_lanes* lanes, int client_sock, http_request* req, const Cache_Node* hit) {
+    metrics_add(METRIC_HIT_QUEUE, 1);
+    sem_wait(&lanes->hits);
+    metrics_add(METRIC_HIT_QUEUE, -1);
+    zerocopy_defer();
+    int rc = send_cache_node(client_sock, req, hit);
+    sem_post(&lanes->hits);
+    if (zerocopy_finish() != 0) {
+        rc = -1;
+    }
+    // В кэш попадают только ответы 200
+    access_log_status(200);
+    if (rc == 0) {
+        metrics_add(METRIC_BYTES_FROM_CACHE, (int64_t)hit->size);
+    }
+    return rc;
+}
+
+static probe_lookup_result lookup_probe_result(int grc, cache_freshness freshness) {
+    if (grc < 0) {
+        return PROBE_LOOKUP_ERROR;
+    }
+    if (grc > 0) {
+        return PROBE_LOOKUP_MISS;
+    }
+    switch (freshness) {
+    case CACHE_FRESH: return PROBE_LOOKUP_FRESH;
+    case CACHE_STALE_REVALIDATE: return PROBE_LOOKUP_STALE_REVALIDATE;
+    case CACHE_STALE_IF_ERROR: return PROBE_LOOKUP_STALE_IF_ERROR;
+    default: return PROBE_LOOKUP_EXPIRED;
+    }
+}
+
+static void store_response(const char* cache_key, const dynbuf* resp) {
+    uint64_t key_hash = cache_key_hash(cache_key);
+    cache_meta meta = {
+        .head_len = response_head_len(resp->data, resp->len),
+        .encoding = CACHE_ENC_IDENTITY
+    };
+
+    // Ошибки и прочие ответы не кэшируем: ими нельзя затирать хорошую копию
+    if (meta.head_len == 0 || parse_response_status(resp->data, meta.head_len) != 200) {
+        PROBE3(cache_reject, key_hash, resp->len, PROBE_REJECT_STATUS);
+        return;
+    }
+    if (cache_lifetime(&stale_cfg, resp->data, meta.head_len, &meta) != 0) {
+        PROBE3(cache_reject, key_hash, resp->len, PROBE_REJECT_LIFETIME);
+        return;
+    }
+
+    if (meta.head_len > 0) {
+        dynbuf packed = {0};
+        if (compress_cache_response(&compress, resp->data, resp->len, meta.head_len, &packed) == 1) {
+            meta.encoding = CACHE_ENC_GZIP;
+            if (add_cache_map(&cache, cache_key, packed.data, packed.len, &meta) == 0) {
+                metrics_add(METRIC_CACHE_FILLS, 1);
+                PROBE3(cache_insert, key_hash, packed.len, meta.encoding);
+            } else {
+                PROBE3(cache_reject, key_hash, packed.len, PROBE_REJECT_NO_ROOM);
+            }
+            free_dynbuf(&packed);
+            return;
+        }
+    }
+
+    if (add_cache_map(&cache, cache_key, resp->data, resp->len, &meta) == 0) {
+        metrics_add(METRIC_CACHE_FILLS, 1);
+        PROBE3(cache_insert, key_hash, resp->len, meta.encoding);
+    } else {
+        PROBE3(cache_reject, key_hash, resp->len, PROBE_REJECT_NO_ROOM);
+    }
+}
+
 void* handle_client(void* vargs)
 {
     client_args *args = (client_args*)vargs;
     int client_sock = args->socket;
+    uint64_t started_us = metrics_now_us();
+    int64_t bytes_before = metrics_local(METRIC_BYTES_FROM_CACHE) + metrics_local(METRIC_BYTES_FROM_UPSTREAM);
+    metrics_add(METRIC_REQUESTS, 1);
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, 1);
+    access_record access = {0};
+    access_log_begin(&access);
+
+    // Кольцо io_uring из пула; без него все идет через обычные recv/send
+    uring_ctx *uring = uring_acquire();
+    uring_bind_thread(uring);
+
+    // Таймер на соединение: медленный или молчащий клиент не держит поток вечно
+    conn_deadline deadline;
+    deadline_begin(&deadline, client_sock);
 
     int host_sock = -1;
     http_request *req = NULL;
@@ -72,6 +239,11 @@ void* handle_client(void* vargs)
                                         req, &req_cl) != 0) {
             ok = 0;
             need_502 = 1;
+        } else {
+            deadline_phase_enter(DEADLINE_TRANSFER);
+            uint64_t parse_us = metrics_now_us() - started_us;
+            observe_stage(STAGE_PARSE, parse_us);
+            PROBE3(request_parsed, req->method, req_cl, parse_us);
         }
     }
 
@@ -83,7 +255,14 @@ void* handle_client(void* vargs)
     }
 
     char cache_key[2048];
+    uint64_t key_hash = 0;
     int cacheable = 0;
+    // Устаревшая копия, которую отдадим, если origin не ответит
+    Cache_Node *stale = NULL;
+    int serve_stale = 0;
+    const peer *owner = NULL;
+    upstream_member *via = NULL;
+    dynbuf built_raw_req = {0};
 
     if (ok) {
         cacheable = (req->method == GET) && (req_cl <= 0);
@@ -91,37 +270,124 @@ void* handle_client(void* vargs)
         if (cacheable) {
             if (build_cache_key(cache_key, sizeof(cache_key), host, port, req) != 0) {
                 cacheable = 0;
+            } else {
+                key_hash = cache_key_hash(cache_key);
             }
         }
 
+        // Промах по ключу соседа пойдет к нему, а не в origin; запросы от
+        // самих соседей дальше не пересылаем
+        if (cacheable && !is_peer_request(req)) {
+            owner = peer_owner(key_hash);
+        }
+
         if (cacheable) {
-            char *cached = NULL;
-            size_t cached_len = 0;
+            Cache_Node *hit = NULL;
 
-            int grc = get_cache_map(&cache, cache_key, &cached, &cached_len);
+            uint64_t lookup_us = metrics_now_us();
+            int grc = get_cache_map(&cache, cache_key, &hit);
+            lookup_us = metrics_now_us() - lookup_us;
+            observe_stage(STAGE_LOOKUP, lookup_us);
+            cache_freshness freshness = CACHE_EXPIRED;
             if (grc == 0) {
-                if (send_all(client_sock, cached, cached_len) != 0) {
+                freshness = cache_node_freshness(hit, cache_clock());
+            }
+            PROBE3(cache_lookup, key_hash, lookup_probe_result(grc, freshness), lookup_us);
+
+            if (grc == 0 && (freshness == CACHE_FRESH || freshness == CACHE_STALE_REVALIDATE)) {
+                // Устаревшее, но в окне stale-while-revalidate: клиент получает
+                // копию сразу, а обновление идет в фоне, одно на ключ
+                if (freshness == CACHE_STALE_REVALIDATE) {
+                    (void)start_revalidation(hit, host, port, key_hash, req);
                 }
-                free(cached);
+
+                // Отдаем прямо из узла: пока держим ссылку, его не освободят
+                metrics_add(freshness == CACHE_FRESH ? METRIC_CACHE_HITS : METRIC_CACHE_STALE_HITS, 1);
+                access.result = freshness == CACHE_FRESH ? ACCESS_HIT : ACCESS_STALE;
+                (void)serve_cache_hit(args->lanes, client_sock, req, hit);
+                release_cache_node(hit);
                 ok = 0;           
                 need_502 = 0;   
+            } else if (grc == 0 && freshness == CACHE_STALE_IF_ERROR) {
+                stale = hit;
+                metrics_add(METRIC_CACHE_MISSES, 1);
+                access.result = ACCESS_MISS;
+            } else if (grc == 0) {
+                release_cache_node(hit);
+                metrics_add(METRIC_CACHE_MISSES, 1);
+                access.result = ACCESS_MISS;
             } else if (grc < 0) {
                 cacheable = 0;
+            } else {
+                metrics_add(METRIC_CACHE_MISSES, 1);
+                access.result = ACCESS_MISS;
+            }
+        }
+    }
+
+    // Лимит параллельности считает только запросы, которые идут в upstream,
+    // и свой для каждого origin'а: медленный сайт не занимает места быстрым
+    conc_permit permit = {0};
+    conc_outcome outcome = CONC_IGNORE;
+    if (ok) {
+        if (conc_acquire(host, port, &permit) != 0) {
+            ok = 0;
+            metrics_add(METRIC_UPSTREAM_REJECTED, 1);
+            if (stale != NULL) {
+                serve_stale = 1;
+            } else {
+                send_simple_503(client_sock);
             }
         }
     }
 
     if (ok) {
-        host_sock = connect_hots(host, port);
+        deadline_phase_enter(DEADLINE_UPSTREAM);
+        PROBE2(upstream_connect_start, host, port);
+        uint64_t connect_us = metrics_now_us();
+        if (owner != NULL) {
+            host_sock = peer_connect(owner);
+            if (host_sock < 0) {
+                // Сосед лежит - за этим объектом сходим сами
+                metrics_add(METRIC_PEER_ERRORS, 1);
+                owner = NULL;
+            } else {
+                metrics_add(METRIC_PEER_FETCHES, 1);
+            }
+        }
+        if (host_sock < 0) {
+            // Группа upstream для хоста: родительский кэш или реплика origin'а
+            host_sock = upstream_connect(host, cacheable ? key_hash : 0, &via);
+            if (host_sock >= 0) {
+                metrics_add(METRIC_UPSTREAM_GROUP_FETCHES, 1);
+            } else if (host_sock == UPSTREAM_DIRECT) {
+                host_sock = connect_hots(host, port);
+            }
+        }
+        connect_us = metrics_now_us() - connect_us;
+        observe_stage(STAGE_CONNECT, connect_us);
+        PROBE2(upstream_connect_done, host_sock, connect_us);
         if (host_sock < 0) {
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
             ok = 0;
-            need_502 = 1;
+            need_502 = (stale == NULL);
+            serve_stale = (stale != NULL);
+            outcome = CONC_DROPPED;
+        } else {
+            deadline_set_upstream(host_sock);
         }
     }
 
-    dynbuf built_raw_req = {0};
     if (ok) {
-        if (build_request(req, &built_raw_req) != 0) {
+        int brc;
+        if (owner != NULL) {
+            brc = peer_build_request(req, host, port, &built_raw_req);
+        } else if (via != NULL) {
+            brc = upstream_build_request(via, req, host, port, &built_raw_req);
+        } else {
+            brc = build_request(req, &built_raw_req);
+        }
+        if (brc != 0) {
             ok = 0;
             need_502 = 1;
         }
@@ -151,8 +417,15 @@ void* handle_client(void* vargs)
         }
     }
 
+    // Канал для splice: тело запроса и некэшируемый ответ идут мимо user space
+    int relay_pipe[2] = {-1, -1};
+    if (ok && use_splice) {
+        (void)open_relay_pipe(relay_pipe);
+    }
+
     if (ok && need_request_body) {
-        if (proxy_body(client_sock, host_sock, &st, io_buf, sizeof(io_buf), &io_len, req_cl) != 0) {
+        deadline_phase_enter(DEADLINE_TRANSFER);
+        if (proxy_body(client_sock, host_sock, &st, io_buf, sizeof(io_buf), &io_len, req_cl, relay_pipe) != 0) {
             ok = 0;
             need_502 = 1;
         }
@@ -160,19 +433,86 @@ void* handle_client(void* vargs)
 
     dynbuf resp_acc = {0};
     int resp_ok = 0;
+    int no_response = 0;
 
     if (ok) {
-        resp_ok = (proxy_response_and_maybe_cache(host_sock, client_sock, cacheable, &resp_acc) == 0);
-        if (!resp_ok) {
+        size_t cache_limit = 0;
+        if (cacheable) {
+            cache_limit = cache_map_available(&cache);
+            if (cache_limit > MAX_SIZE_CACHE_NODE) {
+                cache_limit = MAX_SIZE_CACHE_NODE;
+            }
+        }
+        deadline_phase_enter(DEADLINE_UPSTREAM);
+        int rc = proxy_response_and_maybe_cache(host_sock, client_sock, cache_limit, &resp_acc,
+                                                relay_pipe, &bg_fill, stale != NULL);
+        resp_ok = (rc == 0);
+        if (rc == UPSTREAM_SERVER_ERROR) {
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
             ok = 0;
+            serve_stale = 1;
+            outcome = CONC_DROPPED;
+        } else if (rc == UPSTREAM_NO_RESPONSE) {
+            // Клиенту еще ничего не ушло: старая копия, если есть, иначе 502
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+            no_response = 1;
+            ok = 0;
+            serve_stale = 1;
+            need_502 = 1;
+            outcome = CONC_DROPPED;
+        } else if (!resp_ok) {
+            ok = 0;
+            need_502 = 0;
+        } else {
+            outcome = CONC_SUCCESS;
+        }
+    }
+
+    // После shutdown() по таймауту recv вернет 0, как на обычном конце ответа:
+    // такой ответ мог оборваться, кэшировать его нельзя
+    int timed_out = deadline_expired();
+    if (timed_out) {
+        resp_ok = 0;
+        metrics_add(METRIC_TIMEOUTS, 1);
+    }
+    // Для лимитера это не успех, а неответивший upstream
+    if (timed_out == DEADLINE_UPSTREAM_EXPIRED) {
+        outcome = CONC_DROPPED;
+    }
+    // Ответа не было вовсе, он не успел или это 5xx - ошибка участника группы
+    // и соседа; клиент, ушедший посреди ответа, - нет
+    int upstream_failed = no_response || timed_out == DEADLINE_UPSTREAM_EXPIRED || upstream_last_status() >= 500;
+    upstream_release(via, outcome != CONC_DROPPED && !upstream_failed);
+    if (owner != NULL && upstream_failed) {
+        metrics_add(METRIC_PEER_ERRORS, 1);
+        peer_mark_down(owner);
+    }
+    // Upstream больше не нужен: слот origin'а отдаем, не дожидаясь ответов
+    // из кэша и закрытия соединения
+    conc_release(&permit, outcome);
+    if (timed_out == DEADLINE_UPSTREAM_EXPIRED) {
+        if (stale != NULL) {
+            serve_stale = 1;
+        } else {
+            send_simple_504(client_sock);
             need_502 = 0;
         }
     }
 
-    if (resp_ok && cacheable) {
+    // stale-if-error: origin недоступен, ответил 5xx или не успел - отдаем старую копию
+    if (serve_stale && stale != NULL) {
+        need_502 = 0;
+        metrics_add(METRIC_CACHE_STALE_ERRORS, 1);
+        access.result = ACCESS_STALE_ERROR;
+        (void)serve_cache_hit(args->lanes, client_sock, req, stale);
+    }
+
+    if (resp_ok && cacheable && resp_acc.len > 0) {
         if (resp_acc.len <= (size_t)SSIZE_MAX) {
-            add_cache_map(&cache, cache_key, (const char*)resp_acc.data, resp_acc.len);
+            store_response(cache_key, &resp_acc);
         }
+    } else if (resp_ok && cacheable) {
+        PROBE3(cache_reject, key_hash, 0, PROBE_REJECT_NOT_BUFFERED);
     }
 
     // if (ok) {
@@ -186,6 +526,34 @@ void* handle_client(void* vargs)
         send_simple_502(client_sock);
     }
 
+    // Горячие ключи и origin'ы: байты - все, что этот запрос отдал клиенту
+    if (host != NULL && port != NULL) {
+        uint64_t bytes = (uint64_t)(metrics_local(METRIC_BYTES_FROM_CACHE) +
+                                    metrics_local(METRIC_BYTES_FROM_UPSTREAM) - bytes_before);
+        char origin[TOPK_ITEM_LEN];
+        snprintf(origin, sizeof(origin), "%s:%s", host, port);
+        topk_record(TOPK_ORIGINS, origin, bytes);
+        if (cacheable) {
+            topk_record(TOPK_KEYS, cache_key, bytes);
+            access.key_hash = key_hash;
+        }
+        access.bytes = bytes;
+
+        if (capture_enabled()) {
+            dynbuf head = {0};
+            if (build_request(req, &head) == 0) {
+                capture_request(started_us, host, port, &head, bytes);
+            }
+            free_dynbuf(&head);
+        }
+    }
+    if (req != NULL) {
+        access.method = (uint8_t)req->method;
+    }
+
+    deadline_end();
+    release_cache_node(stale);
+    close_relay_pipe(relay_pipe);
     if (host_sock >= 0) {
         close(host_sock);
     }
@@ -196,52 +564,33 @@ void* handle_client(void* vargs)
     free(host);
     free(port);
 
-    free_dynbuf(&resp_acc);
+    free_dynbuf_accounted(&resp_acc, MEM_FILL_BUFFERS);
     free_dynbuf(&built_raw_req);
     if (req != NULL) {
         free_http_request(&req);
     }
 
-    sem_post(args->server_threads_sem);
+    uring_release(uring);
+    mem_budget_release(MEM_IO_BUFFERS, CONNECTION_IO_BYTES);
+    uint64_t total_us = metrics_now_us() - started_us;
+    observe_stage(STAGE_TOTAL, total_us);
+    PROBE4(conn_close, key_hash, access.bytes, access.result, total_us);
+    access_log_end();
+    metrics_add(METRIC_ACTIVE_CONNECTIONS, -1);
+    sem_post(&args->lanes->connections);
     free(args);
     return NULL;
 }
 
 
-int init_proxy_server(int* server_socket, int server_port, int requests_queue_size) {
-    *server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (*server_socket == -1) {
-        perror("error create socket");
-        return INITIALIZATION_ERROR;
-    }
-    
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY); 
-    server_addr.sin_port = htons(server_port);
-
-    int opt = 1;
-    if (setsockopt(*server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
-    }
-
-    if (bind(*server_socket, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1) {
-        perror("error socket bind");
-        close(*server_socket);
-        *server_socket = -1;
-        return INITIALIZATION_ERROR;
-    }
-
-    if (listen(*server_socket, requests_queue_size) == -1) {
-        perror("error listen socket");
-        close(*server_socket);
-        *server_socket = -1;
+int init_proxy_server(int* server_sockets, int server_port, const listener_opts* opts) {
+    int n = open_listeners(server_port, opts, server_sockets, MAX_LISTENERS);
+    if (n == 0) {
         return INITIALIZATION_ERROR;
     }
 
-    printf("Server was started...\n");
-    return 0;
+    printf("Server was started (%d listeners)...\n", n);
+    return n;
 }
 
 int parse_port(const char *env_port) {
@@ -263,31 +612,34 @@ int parse_port(const char *env_port) {
     return (int)port;
 }
 
-void* run_proxy_server(void* args) {
-    int server_socket;
-    char *env_port = getenv("PROXY_PORT");
-    if (env_port == NULL) {
-        printf("ERRRRORORORORO\n");
-        exit(EXIT_FAILURE);
-    }
-    // printf("%s\n", env_port);
-    int port = parse_port(env_port);
-    if (port == INVALID_SERVER_PORT) {
-        port = 5423;
-        printf("Invalid PROXY_PORT value, port set to default (5423)");
-    }
+typedef struct accept_args {
+    int socket;
+    server_lanes* lanes;
+} accept_args;
 
-    if (init_proxy_server(&server_socket, port, REQUEST_QUEUE_SIZE) == INITIALIZATION_ERROR) {
-        printf("Server was not initted");
-        return NULL;
-    } 
+// Горячее обновление: после передачи сокетов новому процессу потоки accept
+// выходят из цикла, а мы дообслуживаем открытые соединения и завершаемся
+static int published_fds[MAX_LISTENERS];
+static pthread_t published_tids[MAX_LISTENERS];
+static int published_num = 0;
+static _Atomic int listening = 0;
+static _Atomic int draining = 0;
+static _Atomic int accept_loops = 0;
+static pthread_t upgrade_tid;
+static int upgrade_enabled = 0;
 
-    sem_t server_threads_sem;
-    sem_init(&server_threads_sem, 0, MAX_THREADS);
+// SIGUSR1 только будит поток из accept(); SA_RESTART не ставим
+static void on_wakeup(int sig) {
+    (void)sig;
+}
+
+static void* accept_loop(void* vargs) {
+    accept_args* args = (accept_args*)vargs;
+    int server_socket = args->socket;
 
     int client_socket;
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len;
     
     pthread_attr_t attr;
     pthread_attr_init(&attr);
@@ -295,54 +647,337 @@ void* run_proxy_server(void* args) {
     pthread_t client_tid;
     client_args* cl_arg;
 
-    while (1) {
-        client_socket = accept(server_socket, (struct sockaddr*) &client_addr, &addr_len);
+    // Multishot accept: одна заявка в кольце выдает все новые соединения
+    uring_ctx* accept_ring = uring_acquire();
+    atomic_fetch_add(&accept_loops, 1);
+
+    while (!atomic_load(&draining)) {
+        if (accept_ring != NULL) {
+            client_socket = uring_accept_next(accept_ring, server_socket);
+        } else {
+            addr_len = sizeof(client_addr);
+            client_socket = accept4(server_socket, (struct sockaddr*) &client_addr, &addr_len, SOCK_CLOEXEC);
+        }
         if (client_socket == -1) {
+            if (atomic_load(&draining)) {
+                break;
+            }
             perror("error accept socket");
             continue;
         }
         
-        sem_wait(&server_threads_sem);
+        // Здесь ограничиваем только число потоков; попадание это или промах,
+        // станет ясно после разбора запроса. Уже принятое соединение
+        // обслуживаем и во время остановки
+        while (sem_wait(&args->lanes->connections) != 0 && errno == EINTR) {
+        }
+
+        // Если бюджет памяти исчерпан, придерживаем accept: пусть лучше
+        // подождут в очереди ядра, чем процесс упадет по OOM
+        mem_budget_reserve_wait(MEM_IO_BUFFERS, CONNECTION_IO_BYTES, MEM_BACKPRESSURE_WAIT_MS);
 
         // Пока пусть просто будет маллок, а то я уже задушился
         // делать что-то адекватное. Потом переделаю, если что
         cl_arg = malloc(sizeof(client_args));
         if (cl_arg == NULL) {
             perror("error client_args malloc");
-            return NULL;
+            close(client_socket);
+            mem_budget_release(MEM_IO_BUFFERS, CONNECTION_IO_BYTES);
+            sem_post(&args->lanes->connections);
+            continue;
         }
 
-        cl_arg->server_threads_sem = &server_threads_sem;
+        cl_arg->lanes = args->lanes;
         cl_arg->socket = client_socket;
         
-        if (pthread_create(&client_tid, &attr, handle_client, cl_arg) == -1) {
+        if (pthread_create(&client_tid, &attr, handle_client, cl_arg) != 0) {
             perror("pthread_create() error");
             free(cl_arg);
             close(client_socket);
-            sem_post(&server_threads_sem);
+            mem_budget_release(MEM_IO_BUFFERS, CONNECTION_IO_BYTES);
+            sem_post(&args->lanes->connections);
         }
     }
 
-    close(server_socket);
+    atomic_fetch_sub(&accept_loops, 1);
+    uring_release(accept_ring);
     pthread_attr_destroy(&attr);
-    sem_destroy(&server_threads_sem);
+    return NULL;
+}
+
+// Ждет SIGUSR2, передает сокеты новому бинарнику и будит потоки accept,
+// пока все не выйдут из цикла. Если обновление сорвалось, служим дальше
+static void* upgrade_thread(void* arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        if (!atomic_load(&listening)) {
+            printf("Not listening yet, upgrade ignored\n");
+            continue;
+        }
+        if (upgrade_spawn(published_fds, published_num, admin_server_fd(), &cache) == 0) {
+            break;
+        }
+    }
+
+    atomic_store(&draining, 1);
+    uring_stop_accepts();
+    while (atomic_load(&accept_loops) > 0) {
+        for (int i = 0; i < published_num; i++) {
+            pthread_kill(published_tids[i], SIGUSR1);
+        }
+        usleep(100 * 1000);
+    }
+    return NULL;
+}
+
+static void drain_connections(void) {
+    int64_t deadline = cache_clock() + config_get_long("PROXY_DRAIN_TIMEOUT", DEFAULT_DRAIN_TIMEOUT_SEC);
+    int64_t active;
+    while ((active = metrics_value(METRIC_ACTIVE_CONNECTIONS)) > 0 && cache_clock() < deadline) {
+        usleep(100 * 1000);
+    }
+    printf("Drained, %lld connections left\n", (long long)active);
+}
+
+void* run_proxy_server(void* args) {
+    (void)args;
+    int server_sockets[MAX_LISTENERS];
+    char *env_port = getenv("PROXY_PORT");
+    if (env_port == NULL) {
+        printf("ERRRRORORORORO\n");
+        exit(EXIT_FAILURE);
+    }
+    // printf("%s\n", env_port);
+    int port = parse_port(env_port);
+    if (port == INVALID_SERVER_PORT) {
+        port = 5423;
+        printf("Invalid PROXY_PORT value, port set to default (5423)");
+    }
+
+    listener_opts opts;
+    init_listener_opts(&opts);
+
+    // После обновления слушаем сокеты старого процесса: ни одно
+    // соединение из очереди ядра не теряется
+    int listeners = upgrade_listeners(server_sockets, MAX_LISTENERS);
+    if (listeners == 0) {
+        listeners = init_proxy_server(server_sockets, port, &opts);
+    }
+    if (listeners == INITIALIZATION_ERROR) {
+        printf("Server was not initted");
+        return NULL;
+    } 
+
+    server_lanes lanes;
+    sem_init(&lanes.connections, 0, (unsigned)config_get_long("PROXY_MAX_CONNECTIONS", MAX_CONNECTIONS));
+    sem_init(&lanes.hits, 0, (unsigned)config_get_long("PROXY_HIT_CONCURRENCY", MAX_HIT_THREADS));
+
+    // По потоку accept на каждый слушающий сокет; последний крутится здесь
+    accept_args acc[MAX_LISTENERS];
+    pthread_t acc_tids[MAX_LISTENERS];
+    for (int i = 0; i < listeners; i++) {
+        acc[i].socket = server_sockets[i];
+        acc[i].lanes = &lanes;
+        if (i == listeners - 1) {
+            break;
+        }
+        if (pthread_create(&acc_tids[i], NULL, accept_loop, &acc[i]) != 0) {
+            // Сокет без своего потока нельзя оставлять в группе REUSEPORT:
+            // ядро продолжит отдавать ему соединения
+            perror("error creating accept thread");
+            close(server_sockets[i]);
+            server_sockets[i] = -1;
+            continue;
+        }
+    }
+
+    acc_tids[listeners - 1] = pthread_self();
+    for (int i = 0; i < listeners; i++) {
+        if (server_sockets[i] >= 0) {
+            published_fds[published_num] = server_sockets[i];
+            published_tids[published_num] = acc_tids[i];
+            published_num++;
+        }
+    }
+    atomic_store(&listening, 1);
+    upgrade_signal_ready();
+
+    accept_loop(&acc[listeners - 1]);
+
+    // Сюда попадаем только при обновлении; пока поток обновления будит
+    // остальных, их идентификаторы должны оставаться действительными
+    if (upgrade_enabled) {
+        pthread_join(upgrade_tid, NULL);
+    }
+    for (int i = 0; i < listeners - 1; i++) {
+        if (server_sockets[i] >= 0) {
+            pthread_join(acc_tids[i], NULL);
+        }
+    }
+    close_listeners(server_sockets, listeners);
+    if (atomic_load(&draining)) {
+        drain_connections();
+        exit(EXIT_SUCCESS);
+    }
+    sem_destroy(&lanes.connections);
+    sem_destroy(&lanes.hits);
+    return NULL;
+}
+
+static size_t configure_memory(void) {
+    long mem_limit = config_get_long("PROXY_MEM_LIMIT", 0);
+    if (mem_limit <= 0) {
+        size_t detected = detect_memory_limit();
+        if (detected > 0) {
+            mem_limit = (long)(detected / 100 * MEM_LIMIT_PERCENT);
+        } else {
+            mem_limit = (long)DEFAULT_MEM_LIMIT;
+        }
+    }
+    init_mem_budget((size_t)mem_limit);
+
+    long cache_size = config_get_long("PROXY_CACHE_SIZE", 0);
+    if (cache_size <= 0) {
+        cache_size = (long)((size_t)mem_limit / 100 * CACHE_SHARE_PERCENT);
+    }
+
+    printf("Memory budget %ld bytes, cache size %ld bytes\n", mem_limit, cache_size);
+    return (size_t)cache_size;
+}
+
+// Общий кэш режима prefork; мастер снимает через него ссылки упавших рабочих
+static shm_cache* shared_cache = NULL;
+
+static void reap_worker(int worker) {
+    shm_cache_reap_worker(shared_cache, worker);
+}
+
+// Журнал и запись трафика у каждого рабочего свои: ротировать один файл
+// из нескольких процессов нельзя
+static void suffix_worker_path(const char* name, int worker) {
+    const char* path = config_get_str(name, NULL);
+    if (path == NULL) {
+        return;
+    }
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s.w%d", path, worker);
+    setenv(name, buf, 1);
 }
 
-int main() {
+// PROXY_WORKERS > 1: мастер создает общий сегмент кэша и форкает рабочих
+// до того, как появится хоть один поток. Возвращает номер рабочего
+static int start_workers(size_t cache_size) {
+    int workers = (int)config_get_long("PROXY_WORKERS", 1);
+    if (workers <= 1) {
+        return 0;
+    }
+    if (workers > PREFORK_MAX_WORKERS) {
+        workers = PREFORK_MAX_WORKERS;
+    }
+
+    // Ссылок у процесса не больше, чем соединений, плюс фоновые перезапросы
+    size_t pins = (size_t)config_get_long("PROXY_MAX_CONNECTIONS", MAX_CONNECTIONS) * 2 + 256;
+    shared_cache = shm_cache_create(cache_size, workers, pins);
+    if (shared_cache == NULL) {
+        perror("error creating shared cache, running single process");
+        return 0;
+    }
+
+    int worker = run_prefork(workers, reap_worker);
+    if (worker < 0) {
+        printf("Invalid PROXY_WORKERS value, running single process\n");
+        return 0;
+    }
+    shm_cache_attach_worker(shared_cache, worker);
+    cache_map_attach_shared(&cache, shared_cache);
+
+    // Общий сегмент кэша один на всех, а соединения и буферы заполнения у
+    // каждого рабочего свои: остаток бюджета делим между рабочими
+    size_t limit = mem_budget_limit();
+    size_t rest = limit / 100 * (100 - CACHE_SHARE_PERCENT);
+    if (cache_size < limit && limit - cache_size > rest) {
+        rest = limit - cache_size;
+    }
+    init_mem_budget(rest / (size_t)workers);
+    suffix_worker_path("PROXY_ACCESS_LOG", worker);
+    suffix_worker_path("PROXY_CAPTURE", worker);
+    return worker;
+}
+
+int main(int argc, char** argv) {
+    (void)argc;
     signal(SIGPIPE, SIG_IGN);
 
+    // SIGUSR2 ждет поток обновления; маску наследуют все потоки, поэтому
+    // ставим ее до первого из них
+    sigset_t upgrade_set;
+    sigemptyset(&upgrade_set);
+    sigaddset(&upgrade_set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &upgrade_set, NULL);
+    struct sigaction wakeup = {0};
+    wakeup.sa_handler = on_wakeup;
+    sigemptyset(&wakeup.sa_mask);
+    sigaction(SIGUSR1, &wakeup, NULL);
+    init_upgrade(argv);
+
+    size_t cache_size = configure_memory();
     init_cache_map(&cache);
+    int worker = start_workers(cache_size);
+    if (upgrade_receive(&cache) < 0) {
+        printf("Upgrade handover failed, old process keeps serving\n");
+        exit(EXIT_FAILURE);
+    }
+    init_compress_policy(&compress);
+    init_background_fill_policy(&bg_fill);
+    init_stale_policy(&stale_cfg);
+    init_revalidator(&cache, &stale_cfg, store_response);
+    init_conc_limiter();
+    if (init_peers() != 0) {
+        printf("Peering is disabled\n");
+    }
+    if (init_upstreams() != 0) {
+        printf("Upstream groups are disabled\n");
+    }
+    init_metrics(&cache);
+    init_topk();
+    if (init_access_log() != 0) {
+        perror("error opening access log");
+    }
+    if (init_capture() != 0) {
+        perror("error opening capture file");
+    }
+    if (init_conn_deadlines() != 0) {
+        printf("Connection deadlines are disabled\n");
+    }
+    use_splice = config_get_bool("PROXY_SPLICE", 1);
+    init_zerocopy((size_t)config_get_long("PROXY_ZEROCOPY_MIN", DEFAULT_ZEROCOPY_MIN_SIZE));
+
+    const char* io_backend = config_get_str("PROXY_IO_BACKEND", "posix");
+    if (init_uring_backend(strcmp(io_backend, "uring") == 0) != 0) {
+        printf("io_uring is not supported here, falling back to recv/send\n");
+    }
     pthread_t cleaner_tid;
     cache_cleaner_args *ca = malloc(sizeof(*ca));
     if (!ca) {
         perror("error malloc cache_cleaner_args");
     } else {
         ca->map = &cache;
-        ca->interval_sec = 5;                 
-        ca->max_size_bytes = MAX_SIZE_CACHE_MAP;
-        ca->percent_for_del = 50;
+        ca->interval_sec = (unsigned long)config_get_long("PROXY_CLEANER_INTERVAL", CLEANER_INTERVAL_SEC);
+        ca->max_size_bytes = cache_size;
+        ca->percent_for_del = CLEANER_PERCENT_FOR_DEL;
 
-        if (pthread_create(&cleaner_tid, NULL, cache_cleaner_thread, ca) != 0) {
+        if (init_cache_cleaner(ca) != 0) {
+            perror("error init cache cleaner");
+            free(ca);
+        } else if (pthread_create(&cleaner_tid, NULL, cache_cleaner_thread, ca) != 0) {
             perror("error creating cache cleaner thread");
             free(ca);
         } else {
@@ -350,6 +985,30 @@ int main() {
         }
     }
 
+    // Служебный порт только на localhost; 0 - выключен. В режиме prefork его
+    // держит рабочий 0: счетчики в /metrics - его, кэш - общий
+    int admin_port = (int)config_get_long("PROXY_ADMIN_PORT", 0);
+    int admin_fd = upgrade_admin_fd();
+    if ((admin_port > 0 || admin_fd >= 0) && worker == 0) {
+        admin_register("/metrics", metrics_render);
+        admin_register("/topk", topk_render);
+        admin_register("/upstreams", upstream_render);
+        int rc = admin_fd >= 0 ? start_admin_server_on(admin_fd) : start_admin_server(admin_port);
+        if (rc != 0) {
+            perror("error starting admin server");
+        }
+    }
+
+    // Обновление только для одного процесса: рабочих prefork передавать
+    // некому, SIGUSR2 у них так и останется заблокированным
+    if (shared_cache == NULL) {
+        if (pthread_create(&upgrade_tid, NULL, upgrade_thread, NULL) != 0) {
+            perror("error creating upgrade thread");
+        } else {
+            upgrade_enabled = 1;
+        }
+    }
+
     pthread_t server_thread;
 
     if (pthread_create(&server_thread, NULL, run_proxy_server, NULL) != 0) {
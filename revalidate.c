@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "revalidate.h"
+#include "http_utils.h"
+#include "mem_budget.h"
+#include "conc_limiter.h"
+#include "config.h"
+#include "upstream.h"
+
+static Cache_Map* revalidate_map = NULL;
+static stale_policy policy_defaults = {
+    .default_ttl = DEFAULT_CACHE_TTL,
+    .stale_while_revalidate = DEFAULT_STALE_WHILE_REVALIDATE,
+    .stale_if_error = DEFAULT_STALE_IF_ERROR,
+    .max_revalidations = DEFAULT_MAX_REVALIDATIONS
+};
+static revalidate_store_fn store_response_fn = NULL;
+static _Atomic int revalidations = 0;
+
+typedef struct {
+    Cache_Node* stale;
+    char* host;
+    char* port;
+    uint64_t key_hash;
+    // Член группы выбирается уже в потоке обновления, поэтому запрос готов
+    // в обеих формах: обычной для origin и абсолютной для родительского кэша
+    dynbuf request;
+    dynbuf proxy_request;
+} revalidate_job;
+
+void init_stale_policy(stale_policy* policy) {
+    if (policy == NULL) {
+        return;
+    }
+
+    policy->default_ttl = config_get_long("PROXY_CACHE_TTL", DEFAULT_CACHE_TTL);
+    policy->stale_while_revalidate = config_get_long("PROXY_STALE_WHILE_REVALIDATE", DEFAULT_STALE_WHILE_REVALIDATE);
+    policy->stale_if_error = config_get_long("PROXY_STALE_IF_ERROR", DEFAULT_STALE_IF_ERROR);
+    policy->max_revalidations = (int)config_get_long("PROXY_MAX_REVALIDATIONS", DEFAULT_MAX_REVALIDATIONS);
+
+    if (policy->default_ttl < 0) {
+        policy->default_ttl = 0;
+    }
+    if (policy->stale_while_revalidate < 0) {
+        policy->stale_while_revalidate = 0;
+    }
+    if (policy->stale_if_error < 0) {
+        policy->stale_if_error = 0;
+    }
+}
+
+static int directive_value(const char* token, size_t len, const char* name, long* out) {
+    size_t nlen = strlen(name);
+    if (len < nlen || strncasecmp(token, name, nlen) != 0) {
+        return 0;
+    }
+    if (len == nlen) {
+        return 1;
+    }
+    if (token[nlen] != '=' || out == NULL) {
+        return 0;
+    }
+
+    char* end = NULL;
+    long v = strtol(token + nlen + 1, &end, 10);
+    if (end == token + nlen + 1 || v < 0) {
+        return 0;
+    }
+    *out = v;
+    return 1;
+}
+
+// Срок жизни берется из Cache-Control ответа (s-maxage, max-age и окна
+// stale-*), а если его нет - из настроек. -1: ответ кэшировать нельзя
+int cache_lifetime(const stale_policy* policy, const char* head, size_t head_len, cache_meta* meta) {
+    if (policy == NULL) {
+        policy = &policy_defaults;
+    }
+
+    long ttl = policy->default_ttl;
+    long swr = policy->stale_while_revalidate;
+    long sie = policy->stale_if_error;
+    long max_age = -1;
+    long s_maxage = -1;
+    int no_cache = 0;
+
+    char cc[512];
+    if (get_raw_header(head, head_len, "Cache-Control", cc, sizeof(cc)) == 0) {
+        const char* p = cc;
+        while (*p != '\0') {
+            while (*p == ' ' || *p == '\t' || *p == ',') {
+                p++;
+            }
+            const char* end = p;
+            while (*end != '\0' && *end != ',') {
+                end++;
+            }
+            size_t len = (size_t)(end - p);
+            while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+                len--;
+            }
+
+            long v;
+            if (directive_value(p, len, "no-store", NULL) || directive_value(p, len, "private", NULL)) {
+                return -1;
+            } else if (directive_value(p, len, "no-cache", NULL)) {
+                no_cache = 1;
+            } else if (directive_value(p, len, "must-revalidate", NULL) ||
+                       directive_value(p, len, "proxy-revalidate", NULL)) {
+                swr = 0;
+                sie = 0;
+            } else if (directive_value(p, len, "s-maxage", &v)) {
+                s_maxage = v;
+            } else if (directive_value(p, len, "max-age", &v)) {
+                max_age = v;
+            } else if (directive_value(p, len, "stale-while-revalidate", &v)) {
+                swr = v;
+            } else if (directive_value(p, len, "stale-if-error", &v)) {
+                sie = v;
+            }
+            p = end;
+        }
+    }
+
+    if (s_maxage >= 0) {
+        ttl = s_maxage;
+    } else if (max_age >= 0) {
+        ttl = max_age;
+    }
+    // no-cache сильнее любых max-age и окон stale-*: каждое использование
+    // копии должно пройти через origin
+    if (no_cache) {
+        ttl = 0;
+        swr = 0;
+        sie = 0;
+    }
+
+    int64_t now = cache_clock();
+    meta->fresh_until = now + ttl;
+    meta->stale_revalidate_until = meta->fresh_until + swr;
+    meta->stale_error_until = meta->fresh_until + sie;
+    return 0;
+}
+
+cache_freshness cache_node_freshness(const Cache_Node* node, int64_t now) {
+    if (now < node->fresh_until) {
+        return CACHE_FRESH;
+    }
+    if (now < node->stale_revalidate_until) {
+        return CACHE_STALE_REVALIDATE;
+    }
+    if (now < node->stale_error_until) {
+        return CACHE_STALE_IF_ERROR;
+    }
+    return CACHE_EXPIRED;
+}
+
+void init_revalidator(Cache_Map* map, const stale_policy* policy, revalidate_store_fn store) {
+    revalidate_map = map;
+    if (policy != NULL) {
+        policy_defaults = *policy;
+    }
+    store_response_fn = store;
+}
+
+static int is_conditional_header(const char* line, size_t len) {
+    static const char* names[] = {
+        "If-None-Match:", "If-Modified-Since:", "If-Match:", "If-Unmodified-Since:", "If-Range:"
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t n = strlen(names[i]);
+        if (len >= n && strncasecmp(line, names[i], n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Запрос клиента, но условные заголовки - наши: по ETag и Last-Modified
+// сохраненного ответа, чтобы неизменившийся объект пришел как 304
+static int build_conditional_request(const dynbuf* request, const Cache_Node* stale, dynbuf* out) {
+    const char* p = request->data;
+    const char* end = request->data + request->len;
+
+    while (p < end) {
+        const char* eol = find_end_line(p, (size_t)(end - p));
+        if (eol == NULL) {
+            return -1;
+        }
+        size_t len = (size_t)(eol - p);
+        if (len == 0) {
+            break;
+        }
+        if (!is_conditional_header(p, len) && add_dynbuf(out, p, len + 2) != 0) {
+            return -1;
+        }
+        p = eol + 2;
+    }
+
+    char value[256];
+    char line[300];
+    if (get_raw_header(stale->response, stale->head_len, "ETag", value, sizeof(value)) == 0) {
+        snprintf(line, sizeof(line), "If-None-Match: %s\r\n", value);
+        if (dynbuf_append_str(out, line) != 0) {
+            return -1;
+        }
+    }
+    if (get_raw_header(stale->response, stale->head_len, "Last-Modified", value, sizeof(value)) == 0) {
+        snprintf(line, sizeof(line), "If-Modified-Since: %s\r\n", value);
+        if (dynbuf_append_str(out, line) != 0) {
+            return -1;
+        }
+    }
+    return dynbuf_append_str(out, "\r\n");
+}
+
+static int read_whole_response(int sock, dynbuf* out, size_t limit) {
+    char buf[RELAY_BUFFER_SIZE];
+    while (1) {
+        ssize_t n = io_recv(sock, buf, sizeof(buf));
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0 || out->len + (size_t)n > limit ||
+            add_dynbuf_accounted(out, buf, (size_t)n, MEM_FILL_BUFFERS) != 0) {
+            return -1;
+        }
+    }
+}
+
+// 304: тело остается прежним, обновляется только срок жизни
+static int refresh_stale(Cache_Node* stale, const dynbuf* resp, size_t head_len) {
+    cache_meta meta = {.head_len = stale->head_len, .encoding = stale->encoding};
+
+    char cc[8];
+    int rc;
+    if (get_raw_header(resp->data, head_len, "Cache-Control", cc, sizeof(cc)) == 0) {
+        rc = cache_lifetime(&policy_defaults, resp->data, head_len, &meta);
+    } else {
+        rc = cache_lifetime(&policy_defaults, stale->response, stale->head_len, &meta);
+    }
+    if (rc != 0) {
+        return -1;
+    }
+    return refresh_cache_map(revalidate_map, stale, &meta);
+}
+
+static int revalidate(revalidate_job* job) {
+    conc_permit permit;
+    if (conc_acquire(job->host, job->port, &permit) != 0) {
+        return -1;
+    }
+
+    conc_outcome outcome = CONC_DROPPED;
+    int rc = -1;
+    dynbuf req = {0};
+    dynbuf resp = {0};
+
+    // Обновление идет тем же путем, что и промах: через группу upstream хоста
+    upstream_member* via = NULL;
+    int sock = upstream_connect(job->host, job->key_hash, &via);
+    if (sock == UPSTREAM_DIRECT) {
+        sock = connect_hots(job->host, job->port);
+    }
+    const dynbuf* request = (via != NULL && upstream_is_parent(via)) ? &job->proxy_request : &job->request;
+    if (sock >= 0) {
+        // У фонового запроса нет дедлайнов соединения: ограничиваем таймаутами сокета
+        struct timeval tv = {.tv_sec = REVALIDATE_TIMEOUT_SEC, .tv_usec = 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        size_t limit = cache_map_available(revalidate_map);
+        if (limit > MAX_SIZE_CACHE_NODE) {
+            limit = MAX_SIZE_CACHE_NODE;
+        }
+
+        if (build_conditional_request(request, job->stale, &req) == 0 &&
+            send_all(sock, req.data, req.len) == 0 &&
+            read_whole_response(sock, &resp, limit) == 0) {
+            size_t head_len = response_head_len(resp.data, resp.len);
+            int status = parse_response_status(resp.data, head_len);
+            outcome = status >= 500 ? CONC_DROPPED : CONC_SUCCESS;
+
+            if (status == 304) {
+                rc = refresh_stale(job->stale, &resp, head_len);
+            } else if (status == 200 && store_response_fn != NULL) {
+                store_response_fn(job->stale->key, &resp);
+                rc = 0;
+            }
+        }
+        close(sock);
+    }
+
+    upstream_release(via, outcome == CONC_SUCCESS);
+    conc_release(&permit, outcome);
+    free_dynbuf(&req);
+    free_dynbuf_accounted(&resp, MEM_FILL_BUFFERS);
+    return rc;
+}
+
+static void free_job(revalidate_job* job) {
+    free(job->host);
+    free(job->port);
+    free_dynbuf(&job->request);
+    free_dynbuf(&job->proxy_request);
+    free(job);
+}
+
+static void* revalidate_thread(void* arg) {
+    revalidate_job* job = (revalidate_job*)arg;
+
+    if (revalidate(job) != 0) {
+        // Запись осталась старой: не дергаем origin на каждом попадании
+        atomic_store(&job->stale->revalidate_after, cache_clock() + REVALIDATE_BACKOFF_SEC);
+    }
+    atomic_store(&job->stale->revalidating, 0);
+    atomic_fetch_sub(&revalidations, 1);
+
+    release_cache_node(job->stale);
+    free_job(job);
+    return NULL;
+}
+
+int start_revalidation(Cache_Node* stale, const char* host, const char* port, uint64_t key_hash,
+                       const http_request* req) {
+    if (revalidate_map == NULL || stale == NULL || req == NULL) {
+        return -1;
+    }
+    if (cache_clock() < atomic_load(&stale->revalidate_after)) {
+        return -1;
+    }
+
+    // Один фоновый запрос на ключ: остальные клиенты просто получают старую копию
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&stale->revalidating, &expected, 1)) {
+        return -1;
+    }
+    if (atomic_fetch_add(&revalidations, 1) >= policy_defaults.max_revalidations) {
+        atomic_fetch_sub(&revalidations, 1);
+        atomic_store(&stale->revalidating, 0);
+        return -1;
+    }
+
+    revalidate_job* job = calloc(1, sizeof(*job));
+    if (job != NULL) {
+        job->host = strdup(host);
+        job->port = strdup(port);
+    }
+    if (job == NULL || job->host == NULL || job->port == NULL ||
+        build_request(req, &job->request) != 0 ||
+        build_proxy_request(req, host, port, NULL, &job->proxy_request) != 0 ||
+        retain_cache_node(stale) != 0) {
+        if (job != NULL) {
+            free_job(job);
+        }
+        atomic_fetch_sub(&revalidations, 1);
+        atomic_store(&stale->revalidating, 0);
+        return -1;
+    }
+
+    job->stale = stale;
+    job->key_hash = key_hash;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t tid;
+    int rc = pthread_create(&tid, &attr, revalidate_thread, job);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        release_cache_node(stale);
+        atomic_fetch_sub(&revalidations, 1);
+        atomic_store(&stale->revalidating, 0);
+        free_job(job);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __REVALIDATE_H__
+#define __REVALIDATE_H__
+
+#include <stdint.h>
+
+#include "cache_map.h"
+#include "http_request.h"
+#include "dynamic_buffer.h"
+
+// Срок жизни записи кэша и отдача устаревших ответов: пока идет фоновое
+// обновление (stale-while-revalidate) и когда origin недоступен или
+// отвечает 5xx (stale-if-error).
+
+#define DEFAULT_CACHE_TTL 300
+#define DEFAULT_STALE_WHILE_REVALIDATE 60
+#define DEFAULT_STALE_IF_ERROR 3600
+#define DEFAULT_MAX_REVALIDATIONS 16
+#define REVALIDATE_TIMEOUT_SEC 30
+// После неудачного обновления следующая попытка не раньше чем через столько
+#define REVALIDATE_BACKOFF_SEC 5
+
+typedef struct {
+    long default_ttl;
+    long stale_while_revalidate;
+    long stale_if_error;
+    int max_revalidations;
+} stale_policy;
+
+typedef enum {
+    CACHE_FRESH,
+    CACHE_STALE_REVALIDATE,
+    CACHE_STALE_IF_ERROR,
+    CACHE_EXPIRED
+} cache_freshness;
+
+typedef void (*revalidate_store_fn)(const char* key, const dynbuf* resp);
+
+void init_stale_policy(stale_policy* policy);
+
+int cache_lifetime(const stale_policy* policy, const char* head, size_t head_len, cache_meta* meta);
+
+cache_freshness cache_node_freshness(const Cache_Node* node, int64_t now);
+
+void init_revalidator(Cache_Map* map, const stale_policy* policy, revalidate_store_fn store);
+
+int start_revalidation(Cache_Node* stale, const char* host, const char* port, uint64_t key_hash,
+                       const http_request* req);
+
+#endif
@@ -0,0 +1,177 @@
+// Проверки того, что сложно поймать на живом трафике. Запуск: make check
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hash_ring.h"
+#include "shm_cache.h"
+#include "shm_cache_debug.h"
+#include "mem_budget.h"
+
+#define CHECK_KEYS 100000
+#define CHECK_RING_NODES 5
+#define CHECK_SHM_ITEMS 200
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                          \
+    do {                                                          \
+        if (!(cond)) {                                            \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);  \
+            fprintf(stderr, __VA_ARGS__);                         \
+            fprintf(stderr, "\n");                                \
+            failures++;                                           \
+        }                                                         \
+    } while (0)
+
+static int skip_node(int node, void* arg) {
+    return node != *(int*)arg;
+}
+
+// Узел уходит из кольца: переезжают только его ключи, и расходятся они
+// по всем оставшимся, а не достаются одному соседу. Пропуск лежащего узла
+// через accept должен давать то же распределение, что и пересборка без него
+static void check_ring_removal(void) {
+    const char* names[CHECK_RING_NODES] = {"n0:3128", "n1:3128", "n2:3128", "n3:3128", "n4:3128"};
+    const char* rest[CHECK_RING_NODES - 1] = {"n0:3128", "n1:3128", "n3:3128", "n4:3128"};
+    int removed = 2;
+    // Номера узлов в кольце без removed
+    const int renumber[CHECK_RING_NODES] = {0, 1, -1, 2, 3};
+
+    hash_ring full;
+    hash_ring reduced;
+    if (init_hash_ring(&full, names, CHECK_RING_NODES, HASH_RING_VNODES) != 0 ||
+        init_hash_ring(&reduced, rest, CHECK_RING_NODES - 1, HASH_RING_VNODES) != 0) {
+        CHECK(0, "init_hash_ring failed");
+        return;
+    }
+
+    size_t moved = 0;
+    size_t owned = 0;
+    size_t received[CHECK_RING_NODES] = {0};
+    for (uint64_t k = 1; k <= CHECK_KEYS; k++) {
+        uint64_t key = hash_ring_mix(k);
+        int before = hash_ring_lookup(&full, key, NULL, NULL);
+        int skipped = hash_ring_lookup(&full, key, skip_node, &removed);
+        int after = hash_ring_lookup(&reduced, key, NULL, NULL);
+
+        CHECK(skipped != removed, "key %llu still maps to the skipped node", (unsigned long long)k);
+        CHECK(renumber[skipped] == after, "skip and rebuild disagree on key %llu", (unsigned long long)k);
+        if (before == removed) {
+            owned++;
+            received[skipped]++;
+        } else {
+            moved += (renumber[before] != after);
+        }
+    }
+    CHECK(moved == 0, "%zu keys of the remaining nodes moved", moved);
+    CHECK(owned > 0, "removed node owned no keys");
+    for (int n = 0; n < CHECK_RING_NODES; n++) {
+        if (n != removed) {
+            CHECK(received[n] > owned / 10, "node %d got %zu of %zu orphaned keys", n, received[n], owned);
+        }
+    }
+    printf("ring: %zu keys of the removed node spread, others stayed\n", owned);
+
+    free_hash_ring(&full);
+    free_hash_ring(&reduced);
+}
+
+static void item_key(char* buf, size_t cap, int i) {
+    snprintf(buf, cap, "http://check.test/item%d", i);
+}
+
+// Рабочий 1 берет ссылку на живую запись и умирает под блокировкой
+// посреди shm_cache_add(). Следующий shm_lock() получает EOWNERDEAD
+static void crash_worker(shm_cache* c, size_t size) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        shm_cache_attach_worker(c, 1);
+        char key[64];
+        item_key(key, sizeof(key), 0);
+        Cache_Node* pinned = NULL;
+        if (shm_cache_get(c, key, &pinned) != 0) {
+            _exit(2);
+        }
+        shm_cache_crash_in_add(c, size);
+        _exit(2);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "worker failed to set up the crash");
+}
+
+static void check_entries(shm_cache* c, size_t entries_before, size_t bytes_before) {
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t capacity = 0;
+    shm_cache_stats(c, &entries, &bytes, &capacity);
+    CHECK(entries == entries_before && bytes == bytes_before,
+          "after rebuild %zu entries / %zu bytes, expected %zu / %zu", entries, bytes, entries_before, bytes_before);
+
+    char key[64];
+    for (int i = 0; i < CHECK_SHM_ITEMS; i++) {
+        item_key(key, sizeof(key), i);
+        Cache_Node* node = NULL;
+        if (shm_cache_get(c, key, &node) != 0) {
+            CHECK(0, "%s lost after rebuild", key);
+            continue;
+        }
+        CHECK(strcmp(node->key, key) == 0 && node->response[0] == 'z' && node->response[node->size - 1] == 'z',
+              "%s corrupted after rebuild", key);
+        shm_cache_release(c, node);
+    }
+    int bad = shm_cache_verify(c);
+    CHECK(bad == 0, "%d index inconsistencies after rebuild", bad);
+}
+
+// Пересборка после смерти владельца мьютекса: все записи на месте,
+// недописанный чанк, ссылка мертвого и серия страниц без головы убраны
+static void check_shm_rebuild(void) {
+    static char body[3 * SHM_PAGE_SIZE];
+    memset(body, 'z', sizeof(body));
+
+    shm_cache* c = shm_cache_create(64 * SHM_PAGE_SIZE, 2, 64);
+    if (c == NULL) {
+        CHECK(0, "shm_cache_create failed");
+        return;
+    }
+    shm_cache_attach_worker(c, 0);
+
+    char key[64];
+    for (int i = 0; i < CHECK_SHM_ITEMS; i++) {
+        item_key(key, sizeof(key), i);
+        // Каждая десятая запись - на несколько страниц
+        size_t size = (i % 10 == 9) ? SHM_PAGE_SIZE + (size_t)i * 1000 : 100 + (size_t)i * 37;
+        CHECK(shm_cache_add(c, key, body, size, NULL) == 0, "add %s failed", key);
+    }
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t capacity = 0;
+    shm_cache_stats(c, &entries, &bytes, &capacity);
+
+    crash_worker(c, 1000);
+    check_entries(c, entries, bytes);
+    crash_worker(c, 2 * SHM_PAGE_SIZE + SHM_PAGE_SIZE / 2);
+    check_entries(c, entries, bytes);
+
+    // Освобожденное должно снова выделяться: большая запись на три страницы
+    CHECK(shm_cache_add(c, "http://check.test/after", body, 3 * SHM_PAGE_SIZE - 4096, NULL) == 0,
+          "no room for a page run after rebuild");
+    printf("shm: %zu entries survived two lock owner deaths\n", entries);
+}
+
+int main(void) {
+    init_mem_budget(SIZE_MAX / 2);
+    check_ring_removal();
+    check_shm_rebuild();
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all checks passed\n");
+    return EXIT_SUCCESS;
+}
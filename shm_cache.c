@@ -0,0 +1,938 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "shm_cache.h"
+#include "metrics.h"
+
+#define SHM_CACHE_MAGIC 0x48535850u
+#define SHM_MIN_BUCKETS 1024
+#define SHM_AVG_ITEM 4096
+// Ключ не длиннее буфера cache_key в handle_client
+#define SHM_KEY_RESERVE 2048
+// Метки страниц в page_class помимо номеров классов
+#define SHM_PAGE_FREE 0xffff
+#define SHM_PAGE_CONT 0xfffe
+#define SHM_NO_PAGE ((size_t)-1)
+
+// Состояние чанка - единственное, по чему индекс восстанавливается после
+// смерти владельца мьютекса. Нулевая память - свободный чанк
+typedef enum {
+    SHM_CHUNK_FREE,
+    SHM_CHUNK_WRITING,
+    SHM_CHUNK_LINKED,
+    SHM_CHUNK_UNLINKED
+} shm_chunk_state;
+
+// Все ссылки внутри сегмента - смещения от его начала, 0 - пусто.
+// Указатели key и response в узле абсолютные: адрес сегмента общий
+typedef struct shm_item {
+    uint32_t state;
+    uint16_t class_id;
+    int16_t owner;      // кто пишет чанк в состоянии SHM_CHUNK_WRITING
+    uint64_t stamp;
+    uint64_t used;      // момент последнего обращения, для выбора жертвы между классами
+    uint64_t hnext;
+    uint64_t lprev;     // у свободного чанка lnext - следующий свободный
+    uint64_t lnext;
+    Cache_Node node;
+} __attribute__((aligned(SHM_CHUNK_ALIGN))) shm_item;
+
+typedef struct {
+    size_t chunk_size;
+    uint64_t free_head;
+    uint64_t lru_head;  // самый свежий
+    uint64_t lru_tail;
+} shm_class;
+
+typedef struct {
+    uint64_t off;
+    uint32_t count;
+} shm_pin;
+
+typedef struct {
+    pid_t pid;
+    size_t pins_used;
+} shm_worker;
+
+struct shm_cache {
+    uint32_t magic;
+    pthread_mutex_t lock;
+    size_t seg_size;
+    size_t page_size;
+    size_t pages_num;
+    uint64_t pages_off;
+    uint64_t page_class_off;
+    uint64_t buckets_off;
+    size_t buckets_num;
+    uint64_t workers_off;
+    size_t worker_stride;
+    int workers_num;
+    size_t pins_num;
+    uint32_t classes_num;
+    // Последний класс - серии целых страниц подряд для больших ответов
+    uint32_t large_class;
+    shm_class classes[SHM_MAX_CLASSES];
+    size_t count;
+    size_t bytes;
+    uint64_t stamp;
+    uint64_t tick;
+};
+
+// Номер этого рабочего процесса; у мастера -1
+static int self = -1;
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+static size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+static shm_item* item_at(shm_cache* c, uint64_t off) {
+    return off == 0 ? NULL : (shm_item*)((char*)c + off);
+}
+
+static uint64_t off_of(shm_cache* c, const void* p) {
+    return (uint64_t)((const char*)p - (const char*)c);
+}
+
+static uint64_t* bucket_at(shm_cache* c, uint64_t hash) {
+    return (uint64_t*)((char*)c + c->buckets_off) + (hash & (c->buckets_num - 1));
+}
+
+static uint16_t* page_class(shm_cache* c) {
+    return (uint16_t*)((char*)c + c->page_class_off);
+}
+
+static shm_worker* worker_at(shm_cache* c, int w) {
+    return (shm_worker*)((char*)c + c->workers_off + (size_t)w * c->worker_stride);
+}
+
+static shm_pin* worker_pins(shm_worker* w) {
+    return (shm_pin*)(w + 1);
+}
+
+static char* page_at(shm_cache* c, size_t page) {
+    return (char*)c + c->pages_off + page * c->page_size;
+}
+
+static size_t page_of(shm_cache* c, const shm_item* item) {
+    return (off_of(c, item) - c->pages_off) / c->page_size;
+}
+
+static shm_item* chunk_at(shm_cache* c, size_t page, size_t i) {
+    return (shm_item*)(page_at(c, page) + i * c->classes[page_class(c)[page]].chunk_size);
+}
+
+// У свободной страницы и продолжения серии своих чанков нет, у головы серии - один
+static size_t chunks_in_page(shm_cache* c, size_t page) {
+    uint16_t cls = page_class(c)[page];
+    if (cls == SHM_PAGE_FREE || cls == SHM_PAGE_CONT) {
+        return 0;
+    }
+    return c->page_size / c->classes[cls].chunk_size;
+}
+
+static size_t run_pages(shm_cache* c, size_t page) {
+    size_t n = 1;
+    while (page + n < c->pages_num && page_class(c)[page + n] == SHM_PAGE_CONT) {
+        n++;
+    }
+    return n;
+}
+
+static size_t chunk_span(shm_cache* c, size_t page) {
+    uint16_t cls = page_class(c)[page];
+    if (cls == c->large_class) {
+        return run_pages(c, page) * c->page_size;
+    }
+    return c->classes[cls].chunk_size;
+}
+
+static int class_for(const shm_cache* c, size_t total) {
+    for (uint32_t i = 0; i < c->large_class; i++) {
+        if (c->classes[i].chunk_size >= total) {
+            return (int)i;
+        }
+    }
+    return (int)c->large_class;
+}
+
+static size_t find_free_run(shm_cache* c, size_t pages) {
+    size_t len = 0;
+    for (size_t p = 0; p < c->pages_num; p++) {
+        len = (page_class(c)[p] == SHM_PAGE_FREE) ? len + 1 : 0;
+        if (len == pages) {
+            return p + 1 - pages;
+        }
+    }
+    return SHM_NO_PAGE;
+}
+
+static int worker_alive(shm_worker* w) {
+    return w->pid > 0 && (kill(w->pid, 0) == 0 || errno == EPERM);
+}
+
+// ---- Списки и индекс; все под c->lock ----
+
+static void lru_remove(shm_cache* c, shm_item* item) {
+    shm_class* cls = &c->classes[item->class_id];
+    shm_item* prev = item_at(c, item->lprev);
+    shm_item* next = item_at(c, item->lnext);
+    if (prev != NULL) {
+        prev->lnext = item->lnext;
+    } else {
+        cls->lru_head = item->lnext;
+    }
+    if (next != NULL) {
+        next->lprev = item->lprev;
+    } else {
+        cls->lru_tail = item->lprev;
+    }
+    item->lprev = 0;
+    item->lnext = 0;
+}
+
+static void lru_push(shm_cache* c, shm_item* item) {
+    shm_class* cls = &c->classes[item->class_id];
+    uint64_t off = off_of(c, item);
+    item->lprev = 0;
+    item->lnext = cls->lru_head;
+    if (cls->lru_head != 0) {
+        item_at(c, cls->lru_head)->lprev = off;
+    } else {
+        cls->lru_tail = off;
+    }
+    cls->lru_head = off;
+}
+
+static shm_item* hash_find(shm_cache* c, uint64_t hash, const char* key) {
+    shm_item* cur = item_at(c, *bucket_at(c, hash));
+    while (cur != NULL) {
+        if (cur->node.hash == hash && strcmp(cur->node.key, key) == 0) {
+            return cur;
+        }
+        cur = item_at(c, cur->hnext);
+    }
+    return NULL;
+}
+
+static void hash_insert(shm_cache* c, shm_item* item) {
+    uint64_t* bucket = bucket_at(c, item->node.hash);
+    item->hnext = *bucket;
+    *bucket = off_of(c, item);
+}
+
+static void hash_remove(shm_cache* c, shm_item* item) {
+    uint64_t off = off_of(c, item);
+    uint64_t* prev = bucket_at(c, item->node.hash);
+    while (*prev != 0 && *prev != off) {
+        prev = &item_at(c, *prev)->hnext;
+    }
+    if (*prev == off) {
+        *prev = item->hnext;
+    }
+    item->hnext = 0;
+}
+
+// Серия страниц возвращается целиком: сначала голова, чтобы прерванное
+// освобождение оставило только хвосты без головы, а их чистит пересборка
+static void run_free(shm_cache* c, shm_item* item) {
+    size_t page = page_of(c, item);
+    size_t n = run_pages(c, page);
+    item->state = SHM_CHUNK_FREE;
+    for (size_t i = 0; i < n; i++) {
+        page_class(c)[page + i] = SHM_PAGE_FREE;
+    }
+}
+
+static void chunk_free(shm_cache* c, shm_item* item) {
+    if (item->class_id == c->large_class) {
+        run_free(c, item);
+        return;
+    }
+    shm_class* cls = &c->classes[item->class_id];
+    item->state = SHM_CHUNK_FREE;
+    item->hnext = 0;
+    item->lprev = 0;
+    item->lnext = cls->free_head;
+    cls->free_head = off_of(c, item);
+}
+
+static void link_item(shm_cache* c, shm_item* item) {
+    item->used = ++c->tick;
+    hash_insert(c, item);
+    lru_push(c, item);
+    item->state = SHM_CHUNK_LINKED;
+    c->count++;
+    c->bytes += item->node.size;
+}
+
+// Читатели еще могут держать узел - тогда чанк освободит последний из них
+static void unlink_item(shm_cache* c, shm_item* item) {
+    hash_remove(c, item);
+    lru_remove(c, item);
+    c->count--;
+    c->bytes -= item->node.size;
+    if (atomic_load_explicit(&item->node.refs, memory_order_relaxed) == 0) {
+        chunk_free(c, item);
+    } else {
+        item->state = SHM_CHUNK_UNLINKED;
+    }
+}
+
+static void drop_ref(shm_cache* c, shm_item* item, uint32_t n) {
+    uint32_t refs = atomic_load_explicit(&item->node.refs, memory_order_relaxed);
+    refs = refs > n ? refs - n : 0;
+    atomic_store_explicit(&item->node.refs, refs, memory_order_relaxed);
+    if (refs == 0 && item->state == SHM_CHUNK_UNLINKED) {
+        chunk_free(c, item);
+    }
+}
+
+// Чанки нарезаются до того, как страница получит класс: пересборка видит
+// ее либо свободной, либо целиком нарезанной
+static int grow_class(shm_cache* c, int cls_id) {
+    size_t page = find_free_run(c, 1);
+    if (page == SHM_NO_PAGE) {
+        return -1;
+    }
+    size_t size = c->classes[cls_id].chunk_size;
+    for (size_t i = c->page_size / size; i > 0; i--) {
+        shm_item* item = (shm_item*)(page_at(c, page) + (i - 1) * size);
+        item->class_id = (uint16_t)cls_id;
+        chunk_free(c, item);
+    }
+    page_class(c)[page] = (uint16_t)cls_id;
+    return 0;
+}
+
+// Самый давно нужный хвост LRU среди всех классов
+static shm_item* oldest_tail(shm_cache* c) {
+    shm_item* oldest = NULL;
+    for (uint32_t i = 0; i < c->classes_num; i++) {
+        shm_item* tail = item_at(c, c->classes[i].lru_tail);
+        if (tail != NULL && (oldest == NULL || tail->used < oldest->used)) {
+            oldest = tail;
+        }
+    }
+    return oldest;
+}
+
+// Страница класса чанков освобождается целиком, если в ней нет ничего
+// недописанного или удерживаемого читателями
+static int reclaim_page(shm_cache* c, size_t page) {
+    size_t n = chunks_in_page(c, page);
+    for (size_t i = 0; i < n; i++) {
+        shm_item* item = chunk_at(c, page, i);
+        if (item->state != SHM_CHUNK_FREE &&
+            (item->state != SHM_CHUNK_LINKED || atomic_load_explicit(&item->node.refs, memory_order_relaxed) != 0)) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        shm_item* item = chunk_at(c, page, i);
+        if (item->state == SHM_CHUNK_LINKED) {
+            unlink_item(c, item);
+            metrics_add(METRIC_EVICTIONS, 1);
+        }
+    }
+
+    // Теперь все чанки страницы в списке свободных класса - вынимаем их оттуда
+    shm_class* cls = &c->classes[page_class(c)[page]];
+    uint64_t lo = off_of(c, page_at(c, page));
+    uint64_t hi = lo + c->page_size;
+    uint64_t* prev = &cls->free_head;
+    while (*prev != 0) {
+        if (*prev >= lo && *prev < hi) {
+            *prev = item_at(c, *prev)->lnext;
+        } else {
+            prev = &item_at(c, *prev)->lnext;
+        }
+    }
+    page_class(c)[page] = SHM_PAGE_FREE;
+    return 0;
+}
+
+// Место нужно другому классу: забираем страницу жертвы целиком, а если ее
+// держат читатели - вытесняем хотя бы саму жертву. Серия больших ответов
+// освобождается вместе с записью
+static void evict_for_pages(shm_cache* c, shm_item* victim) {
+    if (victim->class_id == c->large_class || reclaim_page(c, page_of(c, victim)) != 0) {
+        unlink_item(c, victim);
+        metrics_add(METRIC_EVICTIONS, 1);
+    }
+}
+
+// Свободных чанков и страниц нет - освобождаем самое давно нужное во всем
+// кэше. Если это чужой класс, его страница переходит к нашему: иначе класс,
+// не успевший получить страниц до заполнения кэша, не смог бы хранить ничего
+static shm_item* alloc_chunk(shm_cache* c, int cls_id) {
+    shm_class* cls = &c->classes[cls_id];
+    for (int i = 0; i < SHM_EVICT_TRIES && cls->free_head == 0; i++) {
+        if (grow_class(c, cls_id) == 0) {
+            break;
+        }
+        shm_item* victim = oldest_tail(c);
+        if (victim == NULL) {
+            break;
+        }
+        if (victim->class_id == cls_id) {
+            unlink_item(c, victim);
+            metrics_add(METRIC_EVICTIONS, 1);
+        } else {
+            evict_for_pages(c, victim);
+        }
+    }
+
+    shm_item* item = item_at(c, cls->free_head);
+    if (item != NULL) {
+        cls->free_head = item->lnext;
+        item->lnext = 0;
+    }
+    return item;
+}
+
+// Большой ответ занимает серию страниц подряд: голова с классом large_class,
+// дальше метки SHM_PAGE_CONT. Голова помечается последней
+static shm_item* alloc_run(shm_cache* c, size_t pages) {
+    size_t first = find_free_run(c, pages);
+    for (size_t i = 0; i < SHM_EVICT_TRIES + pages && first == SHM_NO_PAGE; i++) {
+        shm_item* victim = oldest_tail(c);
+        if (victim == NULL) {
+            break;
+        }
+        evict_for_pages(c, victim);
+        first = find_free_run(c, pages);
+    }
+    if (first == SHM_NO_PAGE) {
+        return NULL;
+    }
+
+    shm_item* item = (shm_item*)page_at(c, first);
+    item->state = SHM_CHUNK_FREE;
+    item->class_id = (uint16_t)c->large_class;
+    item->hnext = 0;
+    item->lprev = 0;
+    item->lnext = 0;
+    for (size_t i = 1; i < pages; i++) {
+        page_class(c)[first + i] = SHM_PAGE_CONT;
+    }
+    page_class(c)[first] = (uint16_t)c->large_class;
+    return item;
+}
+
+// ---- Таблица ссылок процесса: открытая адресация по смещению чанка ----
+
+static size_t pin_home(shm_cache* c, uint64_t off) {
+    return (size_t)((off / SHM_CHUNK_ALIGN) * 0x9e3779b97f4a7c15ULL >> 17) & (c->pins_num - 1);
+}
+
+static int pin_add(shm_cache* c, shm_worker* w, uint64_t off) {
+    shm_pin* pins = worker_pins(w);
+    size_t mask = c->pins_num - 1;
+    for (size_t i = pin_home(c, off), n = 0; n < c->pins_num; i = (i + 1) & mask, n++) {
+        if (pins[i].off == off) {
+            pins[i].count++;
+            return 0;
+        }
+        if (pins[i].off == 0) {
+            // Не заполняем больше чем на три четверти, иначе пробы длинные
+            if (w->pins_used >= c->pins_num / 4 * 3) {
+                return -1;
+            }
+            pins[i].off = off;
+            pins[i].count = 1;
+            w->pins_used++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void pin_remove(shm_cache* c, shm_worker* w, uint64_t off) {
+    shm_pin* pins = worker_pins(w);
+    size_t mask = c->pins_num - 1;
+    size_t i = pin_home(c, off);
+    while (pins[i].off != off) {
+        if (pins[i].off == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    if (--pins[i].count > 0) {
+        return;
+    }
+
+    // Удаление со сдвигом назад, чтобы цепочки проб не рвались
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; pins[j].off != 0; j = (j + 1) & mask) {
+        size_t home = pin_home(c, pins[j].off);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            pins[hole] = pins[j];
+            hole = j;
+        }
+    }
+    pins[hole].off = 0;
+    pins[hole].count = 0;
+    w->pins_used--;
+}
+
+// ---- Восстановление после смерти владельца мьютекса ----
+
+static int chunk_valid(shm_cache* c, shm_item* item, size_t page) {
+    if (item->class_id != page_class(c)[page]) {
+        return 0;
+    }
+    const char* lo = (const char*)(item + 1);
+    const char* hi = (const char*)item + chunk_span(c, page);
+    return item->node.key >= lo && item->node.key < hi &&
+           item->node.response >= lo && item->node.response + item->node.size <= hi;
+}
+
+// Индекс, LRU и списки свободных собираются заново по состояниям чанков,
+// счетчики ссылок - по таблицам живых процессов. Порядок LRU теряется
+static void shm_rebuild(shm_cache* c) {
+    memset((char*)c + c->buckets_off, 0, c->buckets_num * sizeof(uint64_t));
+    for (uint32_t i = 0; i < c->classes_num; i++) {
+        c->classes[i].free_head = 0;
+        c->classes[i].lru_head = 0;
+        c->classes[i].lru_tail = 0;
+    }
+    c->count = 0;
+    c->bytes = 0;
+
+    // Продолжения серии без головы остались от прерванного выделения или освобождения
+    for (size_t p = 0; p < c->pages_num; p++) {
+        uint16_t prev = p > 0 ? page_class(c)[p - 1] : SHM_PAGE_FREE;
+        if (page_class(c)[p] == SHM_PAGE_CONT && prev != SHM_PAGE_CONT && prev != c->large_class) {
+            page_class(c)[p] = SHM_PAGE_FREE;
+        }
+    }
+
+    for (size_t p = 0; p < c->pages_num; p++) {
+        for (size_t i = 0; i < chunks_in_page(c, p); i++) {
+            atomic_store_explicit(&chunk_at(c, p, i)->node.refs, 0, memory_order_relaxed);
+        }
+    }
+    for (int w = 0; w < c->workers_num; w++) {
+        shm_worker* worker = worker_at(c, w);
+        shm_pin* pins = worker_pins(worker);
+        int alive = worker_alive(worker);
+        for (size_t i = 0; i < c->pins_num; i++) {
+            if (pins[i].off == 0) {
+                continue;
+            }
+            if (alive && pins[i].off >= c->pages_off && pins[i].off < c->seg_size) {
+                atomic_fetch_add_explicit(&item_at(c, pins[i].off)->node.refs, pins[i].count,
+                                          memory_order_relaxed);
+            } else {
+                pins[i].off = 0;
+                pins[i].count = 0;
+            }
+        }
+        if (!alive) {
+            worker->pid = 0;
+            worker->pins_used = 0;
+        }
+    }
+
+    for (size_t p = 0; p < c->pages_num; p++) {
+        for (size_t i = 0; i < chunks_in_page(c, p); i++) {
+            shm_item* item = chunk_at(c, p, i);
+            item->class_id = page_class(c)[p];
+            uint32_t refs = atomic_load_explicit(&item->node.refs, memory_order_relaxed);
+
+            if (item->state == SHM_CHUNK_LINKED && chunk_valid(c, item, p)) {
+                shm_item* dup = hash_find(c, item->node.hash, item->node.key);
+                if (dup != NULL && dup->stamp > item->stamp) {
+                    item->state = SHM_CHUNK_UNLINKED;
+                } else {
+                    if (dup != NULL) {
+                        unlink_item(c, dup);
+                    }
+                    link_item(c, item);
+                    continue;
+                }
+            }
+            if (item->state == SHM_CHUNK_WRITING && item->owner >= 0 && item->owner < c->workers_num &&
+                worker_alive(worker_at(c, item->owner))) {
+                continue;
+            }
+            if (item->state == SHM_CHUNK_UNLINKED && refs > 0) {
+                continue;
+            }
+            chunk_free(c, item);
+        }
+    }
+}
+
+static void shm_lock(shm_cache* c) {
+    if (pthread_mutex_lock(&c->lock) == EOWNERDEAD) {
+        fprintf(stderr, "shared cache: lock owner died, rebuilding index\n");
+        shm_rebuild(c);
+        pthread_mutex_consistent(&c->lock);
+    }
+}
+
+static void shm_unlock(shm_cache* c) {
+    pthread_mutex_unlock(&c->lock);
+}
+
+// ---- Публичная часть ----
+
+shm_cache* shm_cache_create(size_t bytes, int workers, size_t pins_per_worker) {
+    if (workers <= 0 || bytes == 0) {
+        return NULL;
+    }
+
+    size_t page_size = SHM_PAGE_SIZE;
+    size_t pages_num = bytes / page_size;
+    if (pages_num == 0) {
+        pages_num = 1;
+    }
+    size_t buckets_num = next_pow2(bytes / SHM_AVG_ITEM);
+    if (buckets_num < SHM_MIN_BUCKETS) {
+        buckets_num = SHM_MIN_BUCKETS;
+    }
+    size_t pins_num = next_pow2(pins_per_worker);
+    size_t worker_stride = round_up(sizeof(shm_worker) + pins_num * sizeof(shm_pin), SHM_CHUNK_ALIGN);
+
+    size_t page_class_off = round_up(sizeof(shm_cache), SHM_CHUNK_ALIGN);
+    size_t buckets_off = round_up(page_class_off + pages_num * sizeof(uint16_t), SHM_CHUNK_ALIGN);
+    size_t workers_off = round_up(buckets_off + buckets_num * sizeof(uint64_t), SHM_CHUNK_ALIGN);
+    size_t pages_off = round_up(workers_off + (size_t)workers * worker_stride, 4096);
+    size_t seg_size = pages_off + pages_num * page_size;
+
+    void* base = MAP_FAILED;
+    int fd = memfd_create("proxy_cache", MFD_CLOEXEC);
+    if (fd >= 0) {
+        if (ftruncate(fd, (off_t)seg_size) == 0) {
+            base = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    } else {
+        base = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    shm_cache* c = (shm_cache*)base;
+    c->seg_size = seg_size;
+    c->page_size = page_size;
+    c->pages_num = pages_num;
+    c->pages_off = pages_off;
+    c->page_class_off = page_class_off;
+    c->buckets_off = buckets_off;
+    c->buckets_num = buckets_num;
+    c->workers_off = workers_off;
+    c->worker_stride = worker_stride;
+    c->workers_num = workers;
+    c->pins_num = pins_num;
+
+    for (size_t p = 0; p < pages_num; p++) {
+        page_class(c)[p] = SHM_PAGE_FREE;
+    }
+
+    // Классы растут в 1.25 раза, последний - серии целых страниц
+    uint32_t n = 0;
+    size_t size = SHM_MIN_CHUNK;
+    while (n < SHM_MAX_CLASSES - 1 && size < page_size) {
+        c->classes[n++].chunk_size = size;
+        size = round_up(size * 5 / 4, SHM_CHUNK_ALIGN);
+    }
+    c->large_class = n;
+    c->classes[n++].chunk_size = page_size;
+    c->classes_num = n;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    c->magic = SHM_CACHE_MAGIC;
+    return c;
+}
+
+void shm_cache_attach_worker(shm_cache* c, int worker) {
+    if (c == NULL || worker < 0 || worker >= c->workers_num) {
+        return;
+    }
+    shm_lock(c);
+    shm_worker* w = worker_at(c, worker);
+    memset(worker_pins(w), 0, c->pins_num * sizeof(shm_pin));
+    w->pins_used = 0;
+    w->pid = getpid();
+    self = worker;
+    shm_unlock(c);
+}
+
+// Зовет мастер после waitpid(): снимает ссылки упавшего процесса и
+// освобождает чанки, которые тот не успел дописать
+void shm_cache_reap_worker(shm_cache* c, int worker) {
+    if (c == NULL || worker < 0 || worker >= c->workers_num) {
+        return;
+    }
+    shm_lock(c);
+    shm_worker* w = worker_at(c, worker);
+    shm_pin* pins = worker_pins(w);
+    for (size_t i = 0; i < c->pins_num; i++) {
+        if (pins[i].off == 0) {
+            continue;
+        }
+        shm_item* item = item_at(c, pins[i].off);
+        // Ссылку мог держать и фоновый перезапрос - флаг больше некому снять
+        atomic_store(&item->node.revalidating, 0);
+        drop_ref(c, item, pins[i].count);
+        pins[i].off = 0;
+        pins[i].count = 0;
+    }
+    w->pins_used = 0;
+    w->pid = 0;
+
+    for (size_t p = 0; p < c->pages_num; p++) {
+        for (size_t i = 0; i < chunks_in_page(c, p); i++) {
+            shm_item* item = chunk_at(c, p, i);
+            if (item->state == SHM_CHUNK_WRITING && item->owner == worker) {
+                chunk_free(c, item);
+            }
+        }
+    }
+    shm_unlock(c);
+}
+
+int shm_cache_owns(const shm_cache* c, const void* ptr) {
+    return c != NULL && (const char*)ptr >= (const char*)c && (const char*)ptr < (const char*)c + c->seg_size;
+}
+
+int shm_cache_get(shm_cache* c, const char* key, Cache_Node** out) {
+    if (c == NULL || key == NULL) {
+        return -1;
+    }
+    uint64_t hash = cache_key_hash(key);
+
+    shm_lock(c);
+    shm_item* item = hash_find(c, hash, key);
+    if (item == NULL) {
+        shm_unlock(c);
+        return 1;
+    }
+    atomic_fetch_add_explicit(&item->node.hits, 1, memory_order_relaxed);
+    item->used = ++c->tick;
+    lru_remove(c, item);
+    lru_push(c, item);
+
+    if (out != NULL) {
+        // Ссылку, которую некуда записать, мастер не сможет снять - лучше промах
+        if (self < 0 || pin_add(c, worker_at(c, self), off_of(c, item)) != 0) {
+            shm_unlock(c);
+            return 1;
+        }
+        atomic_fetch_add_explicit(&item->node.refs, 1, memory_order_relaxed);
+        *out = &item->node;
+    }
+    shm_unlock(c);
+    return 0;
+}
+
+int shm_cache_retain(shm_cache* c, Cache_Node* node) {
+    if (c == NULL || node == NULL || self < 0) {
+        return -1;
+    }
+    shm_item* item = (shm_item*)((char*)node - offsetof(shm_item, node));
+    shm_lock(c);
+    int rc = pin_add(c, worker_at(c, self), off_of(c, item));
+    if (rc == 0) {
+        atomic_fetch_add_explicit(&item->node.refs, 1, memory_order_relaxed);
+    }
+    shm_unlock(c);
+    return rc;
+}
+
+void shm_cache_release(shm_cache* c, Cache_Node* node) {
+    if (c == NULL || node == NULL) {
+        return;
+    }
+    shm_item* item = (shm_item*)((char*)node - offsetof(shm_item, node));
+    shm_lock(c);
+    if (self >= 0) {
+        pin_remove(c, worker_at(c, self), off_of(c, item));
+    }
+    drop_ref(c, item, 1);
+    shm_unlock(c);
+}
+
+int shm_cache_add(shm_cache* c, const char* key, const char* response, size_t size, const cache_meta* meta) {
+    if (c == NULL || key == NULL || response == NULL) {
+        return -1;
+    }
+    size_t key_len = strlen(key) + 1;
+    size_t total = sizeof(shm_item) + key_len + size;
+    if (size > shm_cache_max_item(c) || key_len > SHM_KEY_RESERVE) {
+        return -1;
+    }
+    int cls = class_for(c, total);
+
+    shm_lock(c);
+    shm_item* item = (cls == (int)c->large_class) ? alloc_run(c, (total + c->page_size - 1) / c->page_size)
+                                                   : alloc_chunk(c, cls);
+    if (item == NULL) {
+        shm_unlock(c);
+        return -1;
+    }
+    item->state = SHM_CHUNK_WRITING;
+    item->owner = (int16_t)self;
+    item->stamp = ++c->stamp;
+    shm_unlock(c);
+
+    // Тело копируем без блокировки: чанк пока ничей, кроме нашего
+    Cache_Node* node = &item->node;
+    memset(node, 0, sizeof(*node));
+    node->key = (char*)(item + 1);
+    node->response = node->key + key_len;
+    memcpy(node->key, key, key_len);
+    memcpy(node->response, response, size);
+    node->size = size;
+    node->hash = cache_key_hash(key);
+    node->encoding = CACHE_ENC_IDENTITY;
+    node->fresh_until = INT64_MAX;
+    node->stale_revalidate_until = INT64_MAX;
+    node->stale_error_until = INT64_MAX;
+    if (meta != NULL) {
+        node->head_len = meta->head_len;
+        node->encoding = meta->encoding;
+        node->fresh_until = meta->fresh_until;
+        node->stale_revalidate_until = meta->stale_revalidate_until;
+        node->stale_error_until = meta->stale_error_until;
+    }
+
+    shm_lock(c);
+    shm_item* old = hash_find(c, node->hash, key);
+    if (old != NULL) {
+        unlink_item(c, old);
+    }
+    link_item(c, item);
+    shm_unlock(c);
+    return 0;
+}
+
+// Продление на месте: запись держит ссылку вызывающего, поэтому не
+// освобождена, но могла быть уже заменена по ключу
+int shm_cache_refresh(shm_cache* c, Cache_Node* node, const cache_meta* meta) {
+    if (c == NULL || node == NULL || meta == NULL) {
+        return -1;
+    }
+    shm_item* item = (shm_item*)((char*)node - offsetof(shm_item, node));
+    shm_lock(c);
+    int found = hash_find(c, node->hash, node->key) == item;
+    if (found) {
+        node->fresh_until = meta->fresh_until;
+        node->stale_revalidate_until = meta->stale_revalidate_until;
+        node->stale_error_until = meta->stale_error_until;
+    }
+    shm_unlock(c);
+    return found ? 0 : -1;
+}
+
+// Одна запись не больше 1/SHM_MAX_ITEM_SHARE сегмента, но не меньше страницы
+size_t shm_cache_max_item(const shm_cache* c) {
+    if (c == NULL) {
+        return 0;
+    }
+    size_t pages = c->pages_num / SHM_MAX_ITEM_SHARE;
+    if (pages == 0) {
+        pages = 1;
+    }
+    size_t max = pages * c->page_size - sizeof(shm_item) - SHM_KEY_RESERVE;
+    return max < MAX_SIZE_CACHE_NODE ? max : MAX_SIZE_CACHE_NODE;
+}
+
+void shm_cache_stats(shm_cache* c, size_t* entries, size_t* bytes, size_t* capacity) {
+    shm_lock(c);
+    *entries = c->count;
+    *bytes = c->bytes;
+    *capacity = c->pages_num * c->page_size;
+    shm_unlock(c);
+}
+
+// ---- Проверки для make check, см. shm_cache_debug.h ----
+
+static uint32_t pin_count(shm_cache* c, shm_worker* w, uint64_t off) {
+    shm_pin* pins = worker_pins(w);
+    size_t mask = c->pins_num - 1;
+    for (size_t i = pin_home(c, off), n = 0; n < c->pins_num && pins[i].off != 0; i = (i + 1) & mask, n++) {
+        if (pins[i].off == off) {
+            return pins[i].count;
+        }
+    }
+    return 0;
+}
+
+int shm_cache_verify(shm_cache* c) {
+    int bad = 0;
+    size_t count = 0;
+    size_t bytes = 0;
+    shm_lock(c);
+    for (size_t p = 0; p < c->pages_num; p++) {
+        uint16_t prev = p > 0 ? page_class(c)[p - 1] : SHM_PAGE_FREE;
+        if (page_class(c)[p] == SHM_PAGE_CONT && prev != SHM_PAGE_CONT && prev != c->large_class) {
+            bad++;
+        }
+        for (size_t i = 0; i < chunks_in_page(c, p); i++) {
+            shm_item* item = chunk_at(c, p, i);
+            if (item->state == SHM_CHUNK_LINKED) {
+                count++;
+                bytes += item->node.size;
+                bad += hash_find(c, item->node.hash, item->node.key) != item;
+            }
+            if (item->state == SHM_CHUNK_WRITING &&
+                (item->owner < 0 || item->owner >= c->workers_num || !worker_alive(worker_at(c, item->owner)))) {
+                bad++;
+            }
+            uint32_t pinned = 0;
+            for (int w = 0; w < c->workers_num; w++) {
+                pinned += pin_count(c, worker_at(c, w), off_of(c, item));
+            }
+            bad += atomic_load_explicit(&item->node.refs, memory_order_relaxed) != pinned;
+        }
+    }
+    bad += (count != c->count || bytes != c->bytes);
+    shm_unlock(c);
+    return bad;
+}
+
+void shm_cache_crash_in_add(shm_cache* c, size_t size) {
+    size_t total = sizeof(shm_item) + SHM_KEY_RESERVE + size;
+    int cls = class_for(c, total);
+    shm_lock(c);
+    if (cls == (int)c->large_class) {
+        size_t pages = (total + c->page_size - 1) / c->page_size;
+        size_t first = find_free_run(c, pages);
+        for (size_t i = 1; first != SHM_NO_PAGE && i < pages; i++) {
+            page_class(c)[first + i] = SHM_PAGE_CONT;
+        }
+    } else {
+        shm_item* item = alloc_chunk(c, cls);
+        if (item != NULL) {
+            item->state = SHM_CHUNK_WRITING;
+            item->owner = (int16_t)self;
+        }
+    }
+    _exit(0);
+}
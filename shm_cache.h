@@ -0,0 +1,54 @@
+#ifndef __SHM_CACHE_H__
+#define __SHM_CACHE_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cache_map.h"
+
+// Кэш в общей памяти для режима prefork. Сегмент создает мастер до fork(),
+// поэтому у всех рабочих процессов он отображен по одному адресу и узлы
+// Cache_Node лежат прямо в нем: остальной код работает с ними как с обычными.
+//
+// Память - страницы, нарезанные на чанки классов размеров (как в memcached),
+// у каждого класса свой LRU. Ответ больше чанка самого крупного класса
+// занимает серию страниц подряд. Когда свободных страниц нет, место берется
+// у самого давно нужного хвоста LRU во всем кэше: если он чужого класса,
+// его страница освобождается целиком и переходит к тому, кому не хватило. Все изменения под одним robust-мьютексом; если
+// процесс умер с ним, следующий владелец пересобирает индекс по состояниям
+// чанков. Ссылки читателей записаны в таблицы процессов, и мастер снимает их
+// за упавшим процессом, так что кэш переживает падение любого рабочего.
+
+#define SHM_PAGE_SIZE (1024 * 1024)
+#define SHM_MIN_CHUNK 256
+#define SHM_CHUNK_ALIGN 64
+#define SHM_MAX_CLASSES 64
+#define SHM_EVICT_TRIES 8
+// Большая запись занимает не больше такой доли сегмента
+#define SHM_MAX_ITEM_SHARE 8
+
+typedef struct shm_cache shm_cache;
+
+shm_cache* shm_cache_create(size_t bytes, int workers, size_t pins_per_worker);
+
+void shm_cache_attach_worker(shm_cache* c, int worker);
+
+void shm_cache_reap_worker(shm_cache* c, int worker);
+
+int shm_cache_owns(const shm_cache* c, const void* ptr);
+
+int shm_cache_get(shm_cache* c, const char* key, Cache_Node** out);
+
+int shm_cache_retain(shm_cache* c, Cache_Node* node);
+
+void shm_cache_release(shm_cache* c, Cache_Node* node);
+
+int shm_cache_add(shm_cache* c, const char* key, const char* response, size_t size, const cache_meta* meta);
+
+int shm_cache_refresh(shm_cache* c, Cache_Node* node, const cache_meta* meta);
+
+size_t shm_cache_max_item(const shm_cache* c);
+
+void shm_cache_stats(shm_cache* c, size_t* entries, size_t* bytes, size_t* capacity);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __SHM_CACHE_DEBUG_H__
+#define __SHM_CACHE_DEBUG_H__
+
+#include "shm_cache.h"
+
+// Только для make check, прокси это не вызывает.
+
+// Сверяет индекс, счетчики и ссылки с состояниями чанков и таблицами
+// процессов; возвращает число расхождений
+int shm_cache_verify(shm_cache* c);
+
+// Падение рабочего посреди shm_cache_add(): место под size байт уже взято,
+// запись не дописана, процесс завершается, не отпустив блокировку
+void shm_cache_crash_in_add(shm_cache* c, size_t size);
+
+#endif
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Локальный origin для trace_replay и bench_load: на GET /s<размер>/... отдает
+// 200 с телом ровно такого размера, ничего не читая с диска; /c<размер>/...
+// - то же самое, но chunked. Размер зашит в путь, поэтому один и тот же URL
+// всегда дает один и тот же ответ и нормально кэшируется.
+//
+// stub_origin [-d задержка_мс] [-m max-age] порт
+
+#define STUB_REQUEST_SIZE 16384
+#define STUB_PATTERN_SIZE 65536
+#define STUB_DEFAULT_SIZE 1024
+#define STUB_CHUNK_SIZE 16384
+
+static char pattern[STUB_PATTERN_SIZE];
+static long delay_ms = 0;
+static long max_age = -1;
+
+static int send_all(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_chunked(int sock, unsigned long long size) {
+    char line[32];
+    while (size > 0) {
+        size_t chunk = size < STUB_CHUNK_SIZE ? (size_t)size : STUB_CHUNK_SIZE;
+        int n = snprintf(line, sizeof(line), "%zx\r\n", chunk);
+        if (send_all(sock, line, (size_t)n) != 0 || send_all(sock, pattern, chunk) != 0 ||
+            send_all(sock, "\r\n", 2) != 0) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return send_all(sock, "0\r\n\r\n", 5);
+}
+
+static void serve(int sock) {
+    char req[STUB_REQUEST_SIZE];
+    size_t len = 0;
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(sock, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0) {
+            return;
+        }
+        len += (size_t)n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    int head_only = strncmp(req, "HEAD ", 5) == 0;
+    const char* path = strchr(req, ' ');
+    unsigned long long size = STUB_DEFAULT_SIZE;
+    int chunked = 0;
+    if (path != NULL && (strncmp(path + 1, "/s", 2) == 0 || strncmp(path + 1, "/c", 2) == 0)) {
+        chunked = path[2] == 'c';
+        size = strtoull(path + 3, NULL, 10);
+    }
+
+    if (delay_ms > 0) {
+        usleep((useconds_t)delay_ms * 1000);
+    }
+
+    char cache_control[64] = "";
+    if (max_age >= 0) {
+        snprintf(cache_control, sizeof(cache_control), "Cache-Control: max-age=%ld\r\n", max_age);
+    }
+    char head[256];
+    int n;
+    if (chunked) {
+        n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n%s"
+                     "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n", cache_control);
+    } else {
+        n = snprintf(head, sizeof(head),
+                     "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n%s"
+                     "Content-Length: %llu\r\n\r\n", cache_control, size);
+    }
+    if (send_all(sock, head, (size_t)n) != 0 || head_only) {
+        return;
+    }
+    if (chunked) {
+        (void)send_chunked(sock, size);
+        return;
+    }
+
+    while (size > 0) {
+        size_t chunk = size < sizeof(pattern) ? (size_t)size : sizeof(pattern);
+        if (send_all(sock, pattern, chunk) != 0) {
+            return;
+        }
+        size -= chunk;
+    }
+}
+
+static void* client_thread(void* arg) {
+    int sock = (int)(long)arg;
+    serve(sock);
+    close(sock);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:m:")) != -1) {
+        switch (opt) {
+        case 'd':
+            delay_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_age = strtol(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d delay_ms] [-m max_age] port\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-d delay_ms] [-m max_age] port\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[optind]);
+
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (char)('a' + i % 26);
+    }
+
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(server, 1024) == -1) {
+        perror("stub origin bind");
+        return EXIT_FAILURE;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int sock = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            continue;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, client_thread, (void*)(long)sock) != 0) {
+            close(sock);
+        }
+    }
+}
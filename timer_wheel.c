@@ -0,0 +1,180 @@
+#include <time.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void init_timer_wheel(timer_wheel* w) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            timer_entry* head = &w->slots[level][i];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+    w->current = 0;
+    w->start_ms = timer_now_ms();
+    w->count = 0;
+    pthread_mutex_init(&w->lock, NULL);
+}
+
+static void list_append(timer_entry* head, timer_entry* t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_unlink(timer_entry* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+// Уровень выбирается по расстоянию до срабатывания, слот - по битам
+// абсолютного времени этого уровня
+static void place_timer(timer_wheel* w, timer_entry* t) {
+    if (t->expires < w->current) {
+        t->expires = w->current;
+    }
+
+    uint64_t delta = t->expires - w->current;
+    uint64_t max_delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if (delta > max_delta) {
+        t->expires = w->current + max_delta;
+        delta = max_delta;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    unsigned slot = (unsigned)(t->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    list_append(&w->slots[level][slot], t);
+}
+
+static uint64_t ms_to_tick(const timer_wheel* w, uint64_t ms) {
+    if (ms < w->start_ms) {
+        return 0;
+    }
+    return (ms - w->start_ms) / TIMER_TICK_MS;
+}
+
+void timer_wheel_add(timer_wheel* w, timer_entry* t, uint64_t delay_ms) {
+    pthread_mutex_lock(&w->lock);
+    if (t->pending) {
+        list_unlink(t);
+        w->count--;
+    }
+    t->expires = ms_to_tick(w, timer_now_ms()) + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    t->pending = 1;
+    place_timer(w, t);
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Колбэки вызываются под тем же мьютексом, поэтому после возврата отсюда
+// таймер точно не выполняется и больше не сработает
+void timer_wheel_cancel(timer_wheel* w, timer_entry* t) {
+    pthread_mutex_lock(&w->lock);
+    if (t->pending) {
+        list_unlink(t);
+        t->pending = 0;
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static unsigned cascade(timer_wheel* w, int level) {
+    unsigned slot = (unsigned)(w->current >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    timer_entry* head = &w->slots[level][slot];
+
+    timer_entry* t = head->next;
+    head->next = head;
+    head->prev = head;
+    while (t != head) {
+        timer_entry* next = t->next;
+        place_timer(w, t);
+        t = next;
+    }
+    return slot;
+}
+
+static void run_tick(timer_wheel* w, uint64_t now_ms) {
+    unsigned slot = (unsigned)w->current & (TIMER_WHEEL_SLOTS - 1);
+    if (slot == 0) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (cascade(w, level) != 0) {
+                break;
+            }
+        }
+    }
+
+    timer_entry expired;
+    timer_entry* head = &w->slots[0][slot];
+    if (head->next == head) {
+        w->current++;
+        return;
+    }
+    expired.next = head->next;
+    expired.prev = head->prev;
+    expired.next->prev = &expired;
+    expired.prev->next = &expired;
+    head->next = head;
+    head->prev = head;
+
+    // Сдвигаем время до колбэков: перевзведенный таймер должен попасть
+    // в будущий слот, а не в только что опустошенный
+    w->current++;
+
+    while (expired.next != &expired) {
+        timer_entry* t = expired.next;
+        list_unlink(t);
+        t->pending = 0;
+        w->count--;
+
+        uint64_t again_ms = t->fn(t, now_ms);
+        if (again_ms > 0) {
+            t->expires = w->current + (again_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS - 1;
+            t->pending = 1;
+            place_timer(w, t);
+            w->count++;
+        }
+    }
+}
+
+void timer_wheel_advance(timer_wheel* w, uint64_t now_ms) {
+    pthread_mutex_lock(&w->lock);
+    uint64_t target = ms_to_tick(w, now_ms);
+    while (w->current <= target) {
+        // Пустое колесо можно перемотать сразу, не перебирая тики
+        if (w->count == 0) {
+            w->current = target + 1;
+            break;
+        }
+        run_tick(w, now_ms);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+void* timer_wheel_thread(void* arg) {
+    timer_wheel* w = (timer_wheel*)arg;
+    struct timespec tick = {
+        .tv_sec = TIMER_TICK_MS / 1000,
+        .tv_nsec = (TIMER_TICK_MS % 1000) * 1000000L
+    };
+
+    while (1) {
+        nanosleep(&tick, NULL);
+        timer_wheel_advance(w, timer_now_ms());
+    }
+    return NULL;
+}
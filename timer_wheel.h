@@ -0,0 +1,49 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Иерархическое колесо таймеров: добавление и отмена за O(1), каждый тик
+// трогает только один слот. Дальние таймеры лежат на верхних уровнях и
+// спускаются вниз (cascade), когда до них остается меньше оборота.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_TICK_MS 100
+
+typedef struct timer_entry timer_entry;
+
+// Возвращает, через сколько миллисекунд вызвать снова; 0 - таймер закончен
+typedef uint64_t (*timer_fn)(timer_entry* t, uint64_t now_ms);
+
+struct timer_entry {
+    timer_entry* next;
+    timer_entry* prev;
+    uint64_t expires;   // в тиках
+    timer_fn fn;
+    int pending;
+};
+
+typedef struct {
+    timer_entry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t current;   // следующий необработанный тик
+    uint64_t start_ms;
+    unsigned long count;
+    pthread_mutex_t lock;
+} timer_wheel;
+
+uint64_t timer_now_ms(void);
+
+void init_timer_wheel(timer_wheel* w);
+
+void timer_wheel_add(timer_wheel* w, timer_entry* t, uint64_t delay_ms);
+
+void timer_wheel_cancel(timer_wheel* w, timer_entry* t);
+
+void timer_wheel_advance(timer_wheel* w, uint64_t now_ms);
+
+void* timer_wheel_thread(void* arg);
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "topk.h"
+#include "config.h"
+#include "timer_wheel.h"
+#include "cache_map.h"
+
+#define TOPK_RANKS 2
+#define TOPK_WINDOWS 2
+// Веса хранятся умноженными на exp((t - landmark) / tau), чтобы не пересчитывать
+// затухание у всех записей на каждом запросе. Раньше, чем множитель
+// переполнит double, сдвигаем landmark и масштабируем таблицы
+#define TOPK_RENORM_TAUS 200.0
+
+typedef struct {
+    uint64_t hash;
+    double value;
+    double error;
+    char item[TOPK_ITEM_LEN];
+} topk_entry;
+
+typedef struct {
+    topk_entry entries[TOPK_CAPACITY];
+    int used;
+} topk_table;
+
+typedef struct {
+    pthread_mutex_t lock;
+    double landmark;
+    topk_table tables[TOPK_RANKS][TOPK_WINDOWS];
+} __attribute__((aligned(64))) topk_shard;
+
+static const char* dimension_names[TOPK_DIMENSIONS] = {"key", "origin"};
+static const char* rank_names[TOPK_RANKS] = {"requests", "bytes"};
+static const char* window_names[TOPK_WINDOWS] = {"1m", "1h"};
+static const double window_tau[TOPK_WINDOWS] = {60.0, 3600.0};
+
+static topk_shard* shards[TOPK_DIMENSIONS];
+static int report_size = DEFAULT_TOPK_REPORT;
+
+static double topk_now(void) {
+    return (double)timer_now_ms() / 1000.0;
+}
+
+// PROXY_TOPK - сколько строк отдавать в отчете, 0 выключает учет
+void init_topk(void) {
+    report_size = (int)config_get_long("PROXY_TOPK", DEFAULT_TOPK_REPORT);
+    if (report_size <= 0) {
+        return;
+    }
+    if (report_size > TOPK_SHARDS * TOPK_CAPACITY) {
+        report_size = TOPK_SHARDS * TOPK_CAPACITY;
+    }
+
+    double now = topk_now();
+    for (int d = 0; d < TOPK_DIMENSIONS; d++) {
+        shards[d] = calloc(TOPK_SHARDS, sizeof(topk_shard));
+        if (shards[d] == NULL) {
+            continue;
+        }
+        for (int s = 0; s < TOPK_SHARDS; s++) {
+            pthread_mutex_init(&shards[d][s].lock, NULL);
+            shards[d][s].landmark = now;
+        }
+    }
+}
+
+static void renormalize(topk_shard* shard, double now) {
+    for (int w = 0; w < TOPK_WINDOWS; w++) {
+        double scale = exp(-(now - shard->landmark) / window_tau[w]);
+        for (int r = 0; r < TOPK_RANKS; r++) {
+            topk_table* t = &shard->tables[r][w];
+            for (int i = 0; i < t->used; i++) {
+                t->entries[i].value *= scale;
+                t->entries[i].error *= scale;
+            }
+        }
+    }
+    shard->landmark = now;
+}
+
+// Space-Saving: если элемента нет и мест нет, он вытесняет самый легкий,
+// наследуя его вес как верхнюю оценку ошибки
+static void table_add(topk_table* t, uint64_t hash, const char* item, double weight) {
+    int min_i = 0;
+    for (int i = 0; i < t->used; i++) {
+        topk_entry* e = &t->entries[i];
+        // Хранится только префикс ключа; хеш посчитан по полному, так что
+        // длинные URL с разными хвостами не склеиваются
+        if (e->hash == hash && strncmp(e->item, item, TOPK_ITEM_LEN - 1) == 0) {
+            e->value += weight;
+            return;
+        }
+        if (e->value < t->entries[min_i].value) {
+            min_i = i;
+        }
+    }
+
+    topk_entry* e;
+    double base = 0;
+    if (t->used < TOPK_CAPACITY) {
+        e = &t->entries[t->used++];
+    } else {
+        e = &t->entries[min_i];
+        base = e->value;
+    }
+    e->hash = hash;
+    e->value = base + weight;
+    e->error = base;
+    snprintf(e->item, sizeof(e->item), "%s", item);
+}
+
+void topk_record(topk_dimension dim, const char* item, uint64_t bytes) {
+    if (report_size <= 0 || item == NULL || shards[dim] == NULL) {
+        return;
+    }
+
+    uint64_t hash = cache_key_hash(item);
+    topk_shard* shard = &shards[dim][hash % TOPK_SHARDS];
+    double now = topk_now();
+
+    pthread_mutex_lock(&shard->lock);
+    if (now - shard->landmark > TOPK_RENORM_TAUS * window_tau[0]) {
+        renormalize(shard, now);
+    }
+    for (int w = 0; w < TOPK_WINDOWS; w++) {
+        double boost = exp((now - shard->landmark) / window_tau[w]);
+        table_add(&shard->tables[0][w], hash, item, boost);
+        if (bytes > 0) {
+            table_add(&shard->tables[1][w], hash, item, (double)bytes * boost);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+typedef struct {
+    double value;
+    double error;
+    char item[TOPK_ITEM_LEN];
+} topk_row;
+
+static int compare_rows(const void* a, const void* b) {
+    double va = ((const topk_row*)a)->value;
+    double vb = ((const topk_row*)b)->value;
+    return (va < vb) - (va > vb);
+}
+
+// Элементы разнесены по шардам по хэшу, поэтому слияние - просто объединение
+static int render_table(dynbuf* out, topk_row* rows, int dim, int r, int w, double now) {
+    int n = 0;
+    for (int s = 0; s < TOPK_SHARDS; s++) {
+        topk_shard* shard = &shards[dim][s];
+        pthread_mutex_lock(&shard->lock);
+        double scale = exp(-(now - shard->landmark) / window_tau[w]);
+        topk_table* t = &shard->tables[r][w];
+        for (int i = 0; i < t->used; i++) {
+            rows[n].value = t->entries[i].value * scale;
+            rows[n].error = t->entries[i].error * scale;
+            memcpy(rows[n].item, t->entries[i].item, TOPK_ITEM_LEN);
+            n++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    qsort(rows, (size_t)n, sizeof(*rows), compare_rows);
+
+    char line[TOPK_ITEM_LEN + 128];
+    int len = snprintf(line, sizeof(line), "# %s by %s, window %s: value error item\n",
+                       dimension_names[dim], rank_names[r], window_names[w]);
+    if (add_dynbuf(out, line, (size_t)len) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < n && i < report_size; i++) {
+        len = snprintf(line, sizeof(line), "%.1f %.1f %s\n", rows[i].value, rows[i].error, rows[i].item);
+        if (add_dynbuf(out, line, (size_t)len) != 0) {
+            return -1;
+        }
+    }
+    return add_dynbuf(out, "\n", 1);
+}
+
+int topk_render(dynbuf* out) {
+    if (report_size <= 0) {
+        return dynbuf_append_str(out, "top-k tracking is disabled\n");
+    }
+
+    topk_row* rows = malloc(sizeof(topk_row) * TOPK_SHARDS * TOPK_CAPACITY);
+    if (rows == NULL) {
+        return -1;
+    }
+
+    double now = topk_now();
+    int rc = 0;
+    for (int d = 0; d < TOPK_DIMENSIONS && rc == 0; d++) {
+        if (shards[d] == NULL) {
+            continue;
+        }
+        for (int r = 0; r < TOPK_RANKS && rc == 0; r++) {
+            for (int w = 0; w < TOPK_WINDOWS && rc == 0; w++) {
+                rc = render_table(out, rows, d, r, w, now);
+            }
+        }
+    }
+    free(rows);
+    return rc;
+}
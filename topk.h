@@ -0,0 +1,30 @@
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dynamic_buffer.h"
+
+// Самые горячие ключи кэша и origin'ы: Space-Saving с экспоненциальным
+// затуханием, отдельно по числу запросов и по байтам, за ~1 минуту и ~1 час.
+
+#define TOPK_SHARDS 8
+// Мест в одной таблице шарда; всего отслеживается TOPK_SHARDS * TOPK_CAPACITY
+#define TOPK_CAPACITY 64
+#define TOPK_ITEM_LEN 160
+#define DEFAULT_TOPK_REPORT 20
+
+typedef enum {
+    TOPK_KEYS,
+    TOPK_ORIGINS,
+    TOPK_DIMENSIONS
+} topk_dimension;
+
+void init_topk(void);
+
+void topk_record(topk_dimension dim, const char* item, uint64_t bytes);
+
+int topk_render(dynbuf* out);
+
+#endif
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+
+// Проигрывание трассы, записанной с PROXY_CAPTURE, через прокси в stub_origin.
+// Каждый запрос уходит в момент, когда он пришел в записи (деленный на -s),
+// или с постоянной частотой -r. Задержка считается от запланированного
+// момента, а не от фактической отправки: если прокси не успевает, очередь
+// попадает в перцентили, а не прячется.
+//
+// trace_replay -p порт_прокси -o порт_stub [-s ускорение] [-r запросов/с]
+//              [-c потоков] [-n лимит] [-a админ_порт] трасса
+
+#define REPLAY_RECV_BUF 65536
+#define DEFAULT_REPLAY_THREADS 64
+
+typedef struct {
+    uint64_t offset_us;
+    uint64_t bytes;
+    char* request;
+    size_t request_len;
+    // Результат
+    uint64_t latency_us;
+    uint64_t received;
+    int status;
+} replay_item;
+
+typedef struct {
+    int proxy_port;
+    int stub_port;
+    double speed;
+    double rate;
+    int threads;
+    long limit;
+    int admin_port;
+} replay_opts;
+
+static replay_item* items = NULL;
+static size_t items_num = 0;
+static _Atomic size_t next_item = 0;
+static uint64_t start_us = 0;
+static replay_opts opts = {.speed = 1.0, .threads = DEFAULT_REPLAY_THREADS, .limit = -1};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int append(char** buf, size_t* len, size_t* cap, const char* s, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t new_cap = (*cap == 0 ? 512 : *cap * 2) + n;
+        char* p = realloc(*buf, new_cap);
+        if (p == NULL) {
+            return -1;
+        }
+        *buf = p;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+// Переписываем запрос на stub: абсолютный URL /s<размер>/<host:port><путь>,
+// свои Host и Connection; прочие заголовки (Accept-Encoding и т.п.) как были
+static int rewrite_request(replay_item* item, const char* origin, const char* head, size_t head_len) {
+    const char* line_end = memchr(head, '\n', head_len);
+    if (line_end == NULL) {
+        return -1;
+    }
+    char method[16];
+    char path[4096];
+    if (sscanf(head, "%15s %4095s", method, path) != 2) {
+        return -1;
+    }
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        return -1;
+    }
+
+    char* out = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char line[8192];
+    int n = snprintf(line, sizeof(line), "%s http://127.0.0.1:%d/s%llu/%s%s HTTP/1.0\r\n", method,
+                     opts.stub_port, (unsigned long long)item->bytes, origin, path);
+    if (n < 0 || (size_t)n >= sizeof(line) || append(&out, &len, &cap, line, (size_t)n) != 0) {
+        free(out);
+        return -1;
+    }
+
+    const char* p = line_end + 1;
+    const char* end = head + head_len;
+    while (p < end) {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (eol == NULL) {
+            break;
+        }
+        size_t l = (size_t)(eol - p + 1);
+        if (l <= 2) {
+            break;
+        }
+        if (strncasecmp(p, "Host:", 5) != 0 && strncasecmp(p, "Connection:", 11) != 0 &&
+            strncasecmp(p, "Proxy-Connection:", 17) != 0 && strncasecmp(p, "Keep-Alive:", 11) != 0) {
+            if (append(&out, &len, &cap, p, l) != 0) {
+                free(out);
+                return -1;
+            }
+        }
+        p = eol + 1;
+    }
+
+    n = snprintf(line, sizeof(line), "Host: 127.0.0.1:%d\r\nConnection: close\r\n\r\n", opts.stub_port);
+    if (append(&out, &len, &cap, line, (size_t)n) != 0) {
+        free(out);
+        return -1;
+    }
+    item->request = out;
+    item->request_len = len;
+    return 0;
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    uint64_t x = ((const replay_item*)a)->offset_us;
+    uint64_t y = ((const replay_item*)b)->offset_us;
+    return (x > y) - (x < y);
+}
+
+static int load_trace(const char* path, size_t* skipped) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char magic[sizeof(CAPTURE_MAGIC)];
+    if (fread(magic, 1, strlen(CAPTURE_MAGIC), f) != strlen(CAPTURE_MAGIC) ||
+        memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    size_t cap = 0;
+    unsigned long long offset, bytes;
+    size_t head_len;
+    char origin[512];
+    while (fscanf(f, "%llu %llu %511s %zu", &offset, &bytes, origin, &head_len) == 4) {
+        if (fgetc(f) != '\n' || head_len > (1 << 20)) {
+            break;
+        }
+        char* head = malloc(head_len);
+        if (head == NULL || fread(head, 1, head_len, f) != head_len) {
+            free(head);
+            break;
+        }
+
+        if (items_num == cap) {
+            cap = cap == 0 ? 1024 : cap * 2;
+            replay_item* p = realloc(items, cap * sizeof(*items));
+            if (p == NULL) {
+                free(head);
+                break;
+            }
+            items = p;
+        }
+        replay_item* item = &items[items_num];
+        memset(item, 0, sizeof(*item));
+        item->offset_us = offset;
+        item->bytes = bytes;
+        if (rewrite_request(item, origin, head, head_len) == 0) {
+            items_num++;
+        } else {
+            (*skipped)++;
+        }
+        free(head);
+    }
+    fclose(f);
+
+    qsort(items, items_num, sizeof(*items), compare_offsets);
+    if (opts.limit >= 0 && (size_t)opts.limit < items_num) {
+        items_num = (size_t)opts.limit;
+    }
+    return 0;
+}
+
+static uint64_t scheduled_us(size_t i) {
+    if (opts.rate > 0) {
+        return (uint64_t)((double)i * 1e6 / opts.rate);
+    }
+    return (uint64_t)((double)(items[i].offset_us - items[0].offset_us) / opts.speed);
+}
+
+static int connect_to(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void run_item(replay_item* item, char* buf) {
+    int sock = connect_to(opts.proxy_port);
+    if (sock == -1) {
+        return;
+    }
+    size_t off = 0;
+    while (off < item->request_len) {
+        ssize_t n = send(sock, item->request + off, item->request_len - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            close(sock);
+            return;
+        }
+        off += (size_t)n;
+    }
+
+    ssize_t n;
+    while ((n = recv(sock, buf, REPLAY_RECV_BUF, 0)) > 0) {
+        if (item->received == 0 && n >= 12 && strncmp(buf, "HTTP/1.", 7) == 0) {
+            item->status = atoi(buf + 9);
+        }
+        item->received += (uint64_t)n;
+    }
+    close(sock);
+}
+
+static void* replay_worker(void* arg) {
+    (void)arg;
+    char* buf = malloc(REPLAY_RECV_BUF);
+    if (buf == NULL) {
+        return NULL;
+    }
+    while (1) {
+        size_t i = atomic_fetch_add(&next_item, 1);
+        if (i >= items_num) {
+            break;
+        }
+        uint64_t due = start_us + scheduled_us(i);
+        uint64_t now = now_us();
+        if (due > now) {
+            usleep((useconds_t)(due - now));
+        }
+        run_item(&items[i], buf);
+        items[i].latency_us = now_us() - due;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Попадания берем из /metrics самого прокси: в ответ он их не пишет
+static int scrape_cache_counters(long long* hits, long long* misses) {
+    if (opts.admin_port <= 0) {
+        return -1;
+    }
+    int sock = connect_to(opts.admin_port);
+    if (sock == -1) {
+        return -1;
+    }
+    const char* req = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (send(sock, req, strlen(req), MSG_NOSIGNAL) != (ssize_t)strlen(req)) {
+        close(sock);
+        return -1;
+    }
+    char* body = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = recv(sock, chunk, sizeof(chunk), 0)) > 0) {
+        if (append(&body, &len, &cap, chunk, (size_t)n) != 0) {
+            break;
+        }
+    }
+    close(sock);
+    if (body == NULL) {
+        return -1;
+    }
+
+    long long stale = 0;
+    const char* p;
+    *hits = *misses = 0;
+    if ((p = strstr(body, "\nproxy_cache_hits_total ")) != NULL) {
+        *hits = atoll(p + strlen("\nproxy_cache_hits_total "));
+    }
+    if ((p = strstr(body, "\nproxy_cache_stale_while_revalidate_total ")) != NULL) {
+        stale = atoll(p + strlen("\nproxy_cache_stale_while_revalidate_total "));
+    }
+    if ((p = strstr(body, "\nproxy_cache_misses_total ")) != NULL) {
+        *misses = atoll(p + strlen("\nproxy_cache_misses_total "));
+    }
+    *hits += stale;
+    free(body);
+    return 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(uint64_t elapsed_us, size_t skipped, int have_cache, long long hits, long long misses) {
+    uint64_t* lat = malloc(items_num * sizeof(*lat));
+    if (lat == NULL) {
+        return;
+    }
+    size_t ok = 0;
+    size_t errors = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < items_num; i++) {
+        if (items[i].status >= 200 && items[i].status < 400) {
+            lat[ok++] = items[i].latency_us;
+        } else {
+            errors++;
+        }
+        bytes += items[i].received;
+    }
+    qsort(lat, ok, sizeof(*lat), compare_u64);
+
+    double sec = (double)elapsed_us / 1e6;
+    printf("requests      %zu (ok %zu, errors %zu, skipped %zu)\n", items_num, ok, errors, skipped);
+    printf("duration      %.3f s\n", sec);
+    printf("throughput    %.1f req/s, %.2f MB/s\n", (double)items_num / sec, (double)bytes / sec / 1e6);
+    if (ok > 0) {
+        static const double q[] = {0.5, 0.9, 0.99, 0.999};
+        printf("latency       ");
+        for (size_t i = 0; i < sizeof(q) / sizeof(q[0]); i++) {
+            size_t idx = (size_t)(q[i] * (double)(ok - 1));
+            printf("p%g=%.3fms ", q[i] * 100, (double)lat[idx] / 1000.0);
+        }
+        printf("max=%.3fms\n", (double)lat[ok - 1] / 1000.0);
+    }
+    if (have_cache && hits + misses > 0) {
+        printf("hit ratio     %.2f%% (%lld hits, %lld misses)\n", 100.0 * (double)hits / (double)(hits + misses),
+               hits, misses);
+    }
+    free(lat);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s -p proxy_port -o stub_port [-s speed] [-r rate] [-c threads] "
+                    "[-n limit] [-a admin_port] trace\n", name);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:o:s:r:c:n:a:")) != -1) {
+        switch (opt) {
+        case 'p': opts.proxy_port = atoi(optarg); break;
+        case 'o': opts.stub_port = atoi(optarg); break;
+        case 's': opts.speed = atof(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'c': opts.threads = atoi(optarg); break;
+        case 'n': opts.limit = atol(optarg); break;
+        case 'a': opts.admin_port = atoi(optarg); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || opts.proxy_port <= 0 || opts.stub_port <= 0 || opts.speed <= 0 ||
+        opts.threads <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t skipped = 0;
+    if (load_trace(argv[optind], &skipped) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (items_num == 0) {
+        fprintf(stderr, "nothing to replay\n");
+        return EXIT_FAILURE;
+    }
+
+    long long hits0 = 0, misses0 = 0, hits1 = 0, misses1 = 0;
+    int have_cache = scrape_cache_counters(&hits0, &misses0) == 0;
+
+    pthread_t* tids = calloc((size_t)opts.threads, sizeof(*tids));
+    if (tids == NULL) {
+        return EXIT_FAILURE;
+    }
+    start_us = now_us();
+    int started = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        if (pthread_create(&tids[i], NULL, replay_worker, NULL) == 0) {
+            started++;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed = now_us() - start_us;
+
+    have_cache = have_cache && scrape_cache_counters(&hits1, &misses1) == 0;
+    report(elapsed, skipped, have_cache, hits1 - hits0, misses1 - misses0);
+
+    for (size_t i = 0; i < items_num; i++) {
+        free(items[i].request);
+    }
+    free(items);
+    free(tids);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "upgrade.h"
+#include "epoch.h"
+#include "config.h"
+#include "mem_budget.h"
+
+// Передача идет по socketpair: сначала заголовок с дескрипторами,
+// затем записи кэша до записи с key_len == 0, в конце новый процесс
+// отвечает одним байтом 'R', когда его потоки accept уже запущены
+
+typedef struct {
+    uint32_t magic;
+    uint32_t listeners;
+    uint32_t has_admin;
+} upgrade_header;
+
+typedef struct {
+    uint32_t key_len;
+    uint32_t encoding;
+    uint64_t size;
+    uint64_t head_len;
+    int64_t fresh_until;
+    int64_t stale_revalidate_until;
+    int64_t stale_error_until;
+} upgrade_record;
+
+typedef struct {
+    Cache_Node* node;
+    uint32_t hits;
+} upgrade_candidate;
+
+extern char** environ;
+
+static char** saved_argv = NULL;
+static char exe_path[PATH_MAX];
+
+static int channel = -1;
+static int inherited[MAX_LISTENERS];
+static int inherited_num = 0;
+static int inherited_admin = -1;
+
+void init_upgrade(char** argv) {
+    saved_argv = argv;
+    // Путь берем на старте: после замены файла /proc/self/exe указывает
+    // на удаленный старый бинарник
+    ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[n > 0 ? n : 0] = '\0';
+}
+
+static int write_full(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int skip_full(int fd, size_t len) {
+    char buf[16384];
+    while (len > 0) {
+        size_t part = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_full(fd, buf, part) != 0) {
+            return -1;
+        }
+        len -= part;
+    }
+    return 0;
+}
+
+// Окружение копируем до fork(): в потомке многопоточного процесса
+// malloc звать нельзя
+static char** build_env(int fd) {
+    size_t n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char** env = calloc(n + 2, sizeof(char*));
+    if (env == NULL) {
+        return NULL;
+    }
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], "PROXY_UPGRADE_FD=", 17) != 0) {
+            env[j++] = environ[i];
+        }
+    }
+    if (asprintf(&env[j], "PROXY_UPGRADE_FD=%d", fd) < 0) {
+        free(env);
+        return NULL;
+    }
+    return env;
+}
+
+static int send_fds(int sock, const int* fds, int n, int admin_fd) {
+    upgrade_header hdr = {UPGRADE_MAGIC, (uint32_t)n, admin_fd >= 0};
+    int all[UPGRADE_MAX_FDS];
+    memcpy(all, fds, (size_t)n * sizeof(int));
+    if (admin_fd >= 0) {
+        all[n++] = admin_fd;
+    }
+
+    char ctrl[CMSG_SPACE(sizeof(all))];
+    memset(ctrl, 0, sizeof(ctrl));
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = CMSG_SPACE((size_t)n * sizeof(int));
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN((size_t)n * sizeof(int));
+    memcpy(CMSG_DATA(cm), all, (size_t)n * sizeof(int));
+
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int send_node(int sock, const Cache_Node* node) {
+    upgrade_record rec = {
+        .key_len = (uint32_t)strlen(node->key),
+        .encoding = (uint32_t)node->encoding,
+        .size = node->size,
+        .head_len = node->head_len,
+        .fresh_until = node->fresh_until,
+        .stale_revalidate_until = node->stale_revalidate_until,
+        .stale_error_until = node->stale_error_until,
+    };
+    if (write_full(sock, &rec, sizeof(rec)) != 0 ||
+        write_full(sock, node->key, rec.key_len) != 0 ||
+        write_full(sock, node->response, node->size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Под эпохой только берем ссылки на узлы, пишем в сокет уже вне ее:
+// медленный приемник не должен держать эпоху, а с ней и все вытесненное
+static int collect_nodes(Cache_Map* map, upgrade_candidate** out, size_t* num) {
+    size_t cap = map->count + 64;
+    upgrade_candidate* list = malloc(cap * sizeof(upgrade_candidate));
+    if (list == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t b = 0; b < CACHE_MAP_BUCKETS; b++) {
+        epoch_enter();
+        Cache_Node* node = atomic_load_explicit(&map->buckets[b], memory_order_acquire);
+        while (node != NULL) {
+            if (n == cap) {
+                upgrade_candidate* grown = realloc(list, cap * 2 * sizeof(upgrade_candidate));
+                if (grown == NULL) {
+                    break;
+                }
+                list = grown;
+                cap *= 2;
+            }
+            if (retain_cache_node(node) == 0) {
+                list[n].node = node;
+                list[n].hits = atomic_load_explicit(&node->hits, memory_order_relaxed);
+                n++;
+            }
+            node = atomic_load_explicit(&node->next, memory_order_acquire);
+        }
+        epoch_exit();
+    }
+    *out = list;
+    *num = n;
+    return 0;
+}
+
+static int compare_hotter(const void* a, const void* b) {
+    uint32_t ha = ((const upgrade_candidate*)a)->hits;
+    uint32_t hb = ((const upgrade_candidate*)b)->hits;
+    return (ha < hb) - (ha > hb);
+}
+
+// Новый процесс строит свою копию, пока старый еще держит свою: передаем
+// не больше свободной части бюджета, чтобы вдвоем за него не выйти
+static size_t upgrade_cache_budget(void) {
+    size_t cap = (size_t)config_get_long("PROXY_UPGRADE_CACHE_MAX", DEFAULT_UPGRADE_CACHE_MAX);
+    size_t limit = mem_budget_limit();
+    size_t used = mem_budget_used();
+    size_t headroom = used < limit ? limit - used : 0;
+    return cap < headroom ? cap : headroom;
+}
+
+// Время кэша - CLOCK_MONOTONIC, общее для всех процессов, так что сроки
+// свежести переносятся как есть. Сначала идут самые популярные записи,
+// что не влезло в бюджет - новый процесс наберет заново
+static int send_cache(int sock, Cache_Map* map, size_t* sent) {
+    *sent = 0;
+    upgrade_candidate* list = NULL;
+    size_t num = 0;
+    if (collect_nodes(map, &list, &num) != 0) {
+        return -1;
+    }
+    qsort(list, num, sizeof(upgrade_candidate), compare_hotter);
+
+    size_t budget = upgrade_cache_budget();
+    int rc = 0;
+    for (size_t i = 0; i < num; i++) {
+        Cache_Node* node = list[i].node;
+        if (rc == 0 && node->size <= budget) {
+            if (send_node(sock, node) != 0) {
+                rc = -1;
+            } else {
+                budget -= node->size;
+                (*sent)++;
+            }
+        }
+        release_cache_node(node);
+    }
+    free(list);
+    if (rc != 0) {
+        return -1;
+    }
+    upgrade_record end = {0};
+    return write_full(sock, &end, sizeof(end));
+}
+
+static int wait_ready(int sock) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    int rc;
+    do {
+        rc = poll(&pfd, 1, UPGRADE_READY_TIMEOUT_SEC * 1000);
+    } while (rc < 0 && errno == EINTR);
+    char c = 0;
+    if (rc <= 0 || read(sock, &c, 1) != 1 || c != 'R') {
+        return -1;
+    }
+    return 0;
+}
+
+int upgrade_spawn(const int* fds, int n, int admin_fd, Cache_Map* map) {
+    if (n <= 0 || n > MAX_LISTENERS || exe_path[0] == '\0' || map == NULL || map->shared != NULL) {
+        return -1;
+    }
+    const char* path = config_get_str("PROXY_UPGRADE_BINARY", exe_path);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -1;
+    }
+    char** env = build_env(sv[1]);
+    if (env == NULL) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Маску сигналов exec сохраняет, а новому процессу SIGUSR2 нужен
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(sv[1], F_SETFD, 0);
+        execve(path, saved_argv, env);
+        _exit(127);
+    }
+    size_t env_n = 0;
+    while (env[env_n] != NULL) {
+        env_n++;
+    }
+    free(env[env_n - 1]);
+    free(env);
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+
+    // Завис новый процесс - не ждем его вечно, а продолжаем работать сами
+    struct timeval tv = {.tv_sec = UPGRADE_SEND_TIMEOUT_SEC, .tv_usec = 0};
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    size_t sent = 0;
+    if (send_fds(sv[0], fds, n, admin_fd) != 0 || send_cache(sv[0], map, &sent) != 0 || wait_ready(sv[0]) != 0) {
+        printf("Upgrade to %s failed, keep serving\n", path);
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    close(sv[0]);
+    printf("Upgraded to %s (pid %d), %zu cache entries handed over\n", path, (int)pid, sent);
+    return 0;
+}
+
+static int recv_fds(int sock) {
+    upgrade_header hdr;
+    char ctrl[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    ssize_t rc;
+    do {
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc < 0 && errno == EINTR);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    if (rc != (ssize_t)sizeof(hdr) || hdr.magic != UPGRADE_MAGIC || cm == NULL ||
+        cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+
+    int got = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int fds[UPGRADE_MAX_FDS];
+    memcpy(fds, CMSG_DATA(cm), (size_t)got * sizeof(int));
+    int want = (int)hdr.listeners + (hdr.has_admin ? 1 : 0);
+    if (got != want || hdr.listeners == 0 || hdr.listeners > MAX_LISTENERS) {
+        for (int i = 0; i < got; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    memcpy(inherited, fds, hdr.listeners * sizeof(int));
+    inherited_num = (int)hdr.listeners;
+    inherited_admin = hdr.has_admin ? fds[hdr.listeners] : -1;
+    return 0;
+}
+
+// Записи, которые не влезли в наш бюджет или лимит, читаем и выбрасываем,
+// не выделяя под них память: кэш не обязан переехать целиком
+static int recv_cache(int sock, Cache_Map* map, size_t* added) {
+    *added = 0;
+    char* key = NULL;
+    char* body = NULL;
+    int rc = -1;
+    while (1) {
+        upgrade_record rec;
+        if (read_full(sock, &rec, sizeof(rec)) != 0) {
+            break;
+        }
+        if (rec.key_len == 0) {
+            rc = 0;
+            break;
+        }
+        if (rec.key_len > UPGRADE_MAX_KEY_LEN || rec.size > MAX_SIZE_CACHE_NODE || rec.head_len > rec.size) {
+            break;
+        }
+        if (rec.size > cache_map_available(map) || !mem_budget_admit_fill(rec.size)) {
+            if (skip_full(sock, rec.key_len + rec.size) != 0) {
+                break;
+            }
+            continue;
+        }
+        key = malloc(rec.key_len + 1);
+        body = malloc(rec.size > 0 ? rec.size : 1);
+        if (key == NULL || body == NULL ||
+            read_full(sock, key, rec.key_len) != 0 || read_full(sock, body, rec.size) != 0) {
+            break;
+        }
+        key[rec.key_len] = '\0';
+
+        cache_meta meta = {
+            .head_len = rec.head_len,
+            .encoding = (cache_encoding)rec.encoding,
+            .fresh_until = rec.fresh_until,
+            .stale_revalidate_until = rec.stale_revalidate_until,
+            .stale_error_until = rec.stale_error_until,
+        };
+        if (add_cache_map(map, key, body, rec.size, &meta) == 0) {
+            (*added)++;
+        }
+        free(key);
+        free(body);
+        key = NULL;
+        body = NULL;
+    }
+    free(key);
+    free(body);
+    return rc;
+}
+
+int upgrade_receive(Cache_Map* map) {
+    const char* env = getenv("PROXY_UPGRADE_FD");
+    if (env == NULL) {
+        return 0;
+    }
+    channel = atoi(env);
+    unsetenv("PROXY_UPGRADE_FD");
+    if (channel < 0 || fcntl(channel, F_SETFD, FD_CLOEXEC) != 0) {
+        return -1;
+    }
+
+    size_t added = 0;
+    if (recv_fds(channel) != 0 || recv_cache(channel, map, &added) != 0) {
+        close(channel);
+        channel = -1;
+        return -1;
+    }
+    printf("Took over %d listeners and %zu cache entries\n", inherited_num, added);
+    return 1;
+}
+
+int upgrade_listeners(int* fds, int max_fds) {
+    int n = inherited_num < max_fds ? inherited_num : max_fds;
+    memcpy(fds, inherited, (size_t)n * sizeof(int));
+    return n;
+}
+
+int upgrade_admin_fd(void) {
+    return inherited_admin;
+}
+
+void upgrade_signal_ready(void) {
+    if (channel < 0) {
+        return;
+    }
+    char c = 'R';
+    write_full(channel, &c, 1);
+    close(channel);
+    channel = -1;
+}
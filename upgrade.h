@@ -0,0 +1,36 @@
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "cache_map.h"
+#include "listener.h"
+
+// Обновление бинарника без простоя: по SIGUSR2 процесс запускает новую
+// версию, передает ей слушающие сокеты (SCM_RIGHTS) и содержимое кэша,
+// а сам, дождавшись готовности, перестает принимать и дообслуживает
+// открытые соединения.
+
+#define UPGRADE_MAGIC 0x50555850u
+#define UPGRADE_READY_TIMEOUT_SEC 30
+#define DEFAULT_DRAIN_TIMEOUT_SEC 60
+#define UPGRADE_MAX_FDS (MAX_LISTENERS + 1)
+#define UPGRADE_MAX_KEY_LEN 4096
+#define UPGRADE_SEND_TIMEOUT_SEC 10
+// Больше этого кэш при обновлении не переносится, даже если бюджет позволяет
+#define DEFAULT_UPGRADE_CACHE_MAX (512L * 1024 * 1024)
+
+void init_upgrade(char** argv);
+
+// Старый процесс: 0 - новый принял сокеты и кэш и уже слушает
+int upgrade_spawn(const int* fds, int n, int admin_fd, Cache_Map* map);
+
+// Новый процесс: 1 - нас запустили на обновление и все получено,
+// 0 - обычный старт, -1 - передача сорвалась
+int upgrade_receive(Cache_Map* map);
+
+int upgrade_listeners(int* fds, int max_fds);
+
+int upgrade_admin_fd(void);
+
+void upgrade_signal_ready(void);
+
+#endif
@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "upstream.h"
+#include "hash_ring.h"
+#include "http_utils.h"
+#include "cache_map.h"
+#include "metrics.h"
+#include "config.h"
+
+// Нижняя граница для ограниченной нагрузки: при малом числе запросов
+// в работе шард не размываем, иначе родители начнут дублировать объекты
+#define UPSTREAM_LOAD_FLOOR 8
+
+typedef enum {
+    GROUP_PARENT,
+    GROUP_ORIGIN,
+} group_kind;
+
+struct upstream_group;
+
+struct upstream_member {
+    char name[UPSTREAM_NAME_LEN];
+    char host[UPSTREAM_NAME_LEN];
+    char port[16];
+    struct upstream_group* group;
+
+    _Atomic int outstanding;
+    // Активная проверка; отказ соединения в живом трафике тоже снимает флаг
+    _Atomic int healthy;
+    int check_fails;
+    // Ошибки живого трафика подряд и выброс по ним
+    _Atomic int errors;
+    _Atomic int ejections;
+    _Atomic int64_t ejected_until;
+
+    _Atomic uint64_t requests;
+    _Atomic uint64_t failures;
+};
+
+typedef struct upstream_group {
+    group_kind kind;
+    char match[UPSTREAM_NAME_LEN];
+    upstream_member members[MAX_UPSTREAM_MEMBERS];
+    int num;
+    hash_ring ring;
+    // Равные по нагрузке участники перебираются по кругу
+    _Atomic unsigned next;
+    pthread_mutex_t eject_lock;
+} upstream_group;
+
+static upstream_group groups[MAX_UPSTREAM_GROUPS];
+static int groups_num = 0;
+static int eject_errors = DEFAULT_UPSTREAM_EJECT_ERRORS;
+static long check_interval = DEFAULT_UPSTREAM_CHECK_INTERVAL_SEC;
+
+static char* trim(char* s) {
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+    size_t n = strlen(s);
+    while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t')) {
+        s[--n] = '\0';
+    }
+    return s;
+}
+
+static int add_member(upstream_group* g, char* name) {
+    name = trim(name);
+    const char* sep = strrchr(name, ':');
+    if (sep == NULL || sep == name || sep[1] == '\0' || g->num >= MAX_UPSTREAM_MEMBERS ||
+        strlen(name) >= UPSTREAM_NAME_LEN || strlen(sep + 1) >= sizeof(g->members[0].port)) {
+        return -1;
+    }
+
+    upstream_member* m = &g->members[g->num];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    snprintf(m->host, sizeof(m->host), "%.*s", (int)(sep - name), name);
+    snprintf(m->port, sizeof(m->port), "%s", sep + 1);
+    m->group = g;
+    atomic_init(&m->outstanding, 0);
+    atomic_init(&m->healthy, 1);
+    atomic_init(&m->errors, 0);
+    atomic_init(&m->ejections, 0);
+    atomic_init(&m->ejected_until, 0);
+    atomic_init(&m->requests, 0);
+    atomic_init(&m->failures, 0);
+    g->num++;
+    return 0;
+}
+
+// "<parent|origin> <шаблон>=<host:port>,<host:port>"
+static int add_group(char* spec) {
+    spec = trim(spec);
+    char* eq = strchr(spec, '=');
+    char* sp = strpbrk(spec, " \t");
+    if (eq == NULL || sp == NULL || sp > eq || groups_num >= MAX_UPSTREAM_GROUPS) {
+        return -1;
+    }
+    *sp = '\0';
+    *eq = '\0';
+
+    upstream_group* g = &groups[groups_num];
+    if (strcmp(spec, "parent") == 0) {
+        g->kind = GROUP_PARENT;
+    } else if (strcmp(spec, "origin") == 0) {
+        g->kind = GROUP_ORIGIN;
+    } else {
+        return -1;
+    }
+    char* match = trim(sp + 1);
+    if (*match == '\0' || strlen(match) >= sizeof(g->match)) {
+        return -1;
+    }
+    snprintf(g->match, sizeof(g->match), "%s", match);
+
+    g->num = 0;
+    char* save = NULL;
+    for (char* tok = strtok_r(eq + 1, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (add_member(g, tok) != 0) {
+            printf("Ignoring upstream \"%s\" in group %s\n", tok, g->match);
+        }
+    }
+    if (g->num == 0) {
+        return -1;
+    }
+
+    const char* names[MAX_UPSTREAM_MEMBERS];
+    for (int i = 0; i < g->num; i++) {
+        names[i] = g->members[i].name;
+    }
+    if (g->kind == GROUP_PARENT && init_hash_ring(&g->ring, names, g->num, HASH_RING_VNODES) != 0) {
+        return -1;
+    }
+    atomic_init(&g->next, 0);
+    pthread_mutex_init(&g->eject_lock, NULL);
+    groups_num++;
+    return 0;
+}
+
+static int probe_member(const upstream_member* m) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_INET;
+
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(m->host, m->port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    int rc = -1;
+    int sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (sock >= 0) {
+        if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+            rc = 0;
+        } else if (errno == EINPROGRESS) {
+            struct pollfd pfd = {sock, POLLOUT, 0};
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (poll(&pfd, 1, UPSTREAM_CHECK_TIMEOUT_MS) == 1 &&
+                getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                rc = 0;
+            }
+        }
+        close(sock);
+    }
+    freeaddrinfo(res);
+    return rc;
+}
+
+// Проверка - TCP connect с таймаутом: подняться участнику хватает одной
+// удачной, упасть - UPSTREAM_CHECK_FALLS подряд
+static void* check_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        for (int i = 0; i < groups_num; i++) {
+            for (int j = 0; j < groups[i].num; j++) {
+                upstream_member* m = &groups[i].members[j];
+                if (probe_member(m) == 0) {
+                    m->check_fails = 0;
+                    if (!atomic_exchange(&m->healthy, 1)) {
+                        printf("Upstream %s is up\n", m->name);
+                    }
+                } else if (++m->check_fails >= UPSTREAM_CHECK_FALLS && atomic_exchange(&m->healthy, 0)) {
+                    printf("Upstream %s is down\n", m->name);
+                }
+            }
+        }
+        sleep((unsigned)check_interval);
+    }
+    return NULL;
+}
+
+int init_upstreams(void) {
+    const char* list = config_get_str("PROXY_UPSTREAMS", NULL);
+    if (list == NULL) {
+        return 0;
+    }
+    eject_errors = (int)config_get_long("PROXY_UPSTREAM_EJECT_ERRORS", DEFAULT_UPSTREAM_EJECT_ERRORS);
+    check_interval = config_get_long("PROXY_UPSTREAM_CHECK_INTERVAL", DEFAULT_UPSTREAM_CHECK_INTERVAL_SEC);
+
+    char* copy = strdup(list);
+    if (copy == NULL) {
+        return -1;
+    }
+    char* save = NULL;
+    for (char* tok = strtok_r(copy, ";", &save); tok != NULL; tok = strtok_r(NULL, ";", &save)) {
+        char spec[1024];
+        snprintf(spec, sizeof(spec), "%s", tok);
+        if (add_group(tok) != 0) {
+            printf("Ignoring upstream group \"%s\"\n", trim(spec));
+        }
+    }
+    free(copy);
+    if (groups_num == 0) {
+        return -1;
+    }
+
+    if (check_interval > 0) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, check_thread, NULL) != 0) {
+            perror("error creating upstream check thread");
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    printf("Upstream groups: %d\n", groups_num);
+    return 0;
+}
+
+static upstream_group* find_group(const char* host) {
+    size_t host_len = strlen(host);
+    for (int i = 0; i < groups_num; i++) {
+        const char* match = groups[i].match;
+        if (strcmp(match, "*") == 0 || strcasecmp(match, host) == 0) {
+            return &groups[i];
+        }
+        // "*.example.com" - любой поддомен, но не сам example.com
+        size_t suffix_len = strlen(match + 1);
+        if (match[0] == '*' && match[1] == '.' && host_len > suffix_len &&
+            strcasecmp(host + host_len - suffix_len, match + 1) == 0) {
+            return &groups[i];
+        }
+    }
+    return NULL;
+}
+
+static int member_usable(upstream_member* m, int64_t now) {
+    return atomic_load(&m->healthy) && now >= atomic_load(&m->ejected_until);
+}
+
+typedef struct {
+    upstream_group* group;
+    const upstream_member* skip;
+    int64_t now;
+    int bound;
+} ring_filter;
+
+static int ring_accept(int node, void* arg) {
+    ring_filter* f = (ring_filter*)arg;
+    upstream_member* m = &f->group->members[node];
+    if (m == f->skip || !member_usable(m, f->now)) {
+        return 0;
+    }
+    return atomic_load(&m->outstanding) < f->bound;
+}
+
+// Сколько запросов в работе можно держать одному участнику:
+// ceil(factor * (всего + 1) / живых), но не меньше UPSTREAM_LOAD_FLOOR
+static int load_bound(upstream_group* g, int64_t now) {
+    long total = 0;
+    long alive = 0;
+    for (int i = 0; i < g->num; i++) {
+        if (member_usable(&g->members[i], now)) {
+            total += atomic_load(&g->members[i].outstanding);
+            alive++;
+        }
+    }
+    if (alive == 0) {
+        return 0;
+    }
+    long bound = ((total + 1) * UPSTREAM_LOAD_FACTOR_PERCENT + 100 * alive - 1) / (100 * alive);
+    return bound < UPSTREAM_LOAD_FLOOR ? UPSTREAM_LOAD_FLOOR : (int)bound;
+}
+
+// any - не смотреть на здоровье: если лежат все, лучше попробовать, чем
+// сразу ответить 502
+static upstream_member* pick_least(upstream_group* g, int64_t now, const upstream_member* skip, int any) {
+    upstream_member* best = NULL;
+    int best_load = 0;
+    unsigned start = atomic_fetch_add_explicit(&g->next, 1, memory_order_relaxed);
+    for (int i = 0; i < g->num; i++) {
+        upstream_member* m = &g->members[(start + (unsigned)i) % (unsigned)g->num];
+        if (m == skip || (!any && !member_usable(m, now))) {
+            continue;
+        }
+        int load = atomic_load(&m->outstanding);
+        if (best == NULL || load < best_load) {
+            best = m;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static upstream_member* select_member(upstream_group* g, uint64_t key_hash, const upstream_member* skip) {
+    int64_t now = cache_clock();
+    upstream_member* m = NULL;
+    if (g->kind == GROUP_PARENT && key_hash != 0) {
+        ring_filter f = {g, skip, now, load_bound(g, now)};
+        int node = hash_ring_lookup(&g->ring, key_hash, ring_accept, &f);
+        if (node >= 0) {
+            m = &g->members[node];
+        }
+    }
+    if (m == NULL) {
+        m = pick_least(g, now, skip, 0);
+    }
+    if (m == NULL) {
+        m = pick_least(g, now, skip, 1);
+    }
+    if (m != NULL) {
+        atomic_fetch_add(&m->outstanding, 1);
+    }
+    return m;
+}
+
+int upstream_connect(const char* host, uint64_t key_hash, upstream_member** used) {
+    *used = NULL;
+    upstream_group* g = (host != NULL) ? find_group(host) : NULL;
+    if (g == NULL) {
+        return UPSTREAM_DIRECT;
+    }
+
+    const upstream_member* failed = NULL;
+    for (int t = 0; t < UPSTREAM_MAX_TRIES; t++) {
+        upstream_member* m = select_member(g, key_hash, failed);
+        if (m == NULL) {
+            break;
+        }
+        int sock = connect_hots(m->host, m->port);
+        if (sock >= 0) {
+            atomic_fetch_add_explicit(&m->requests, 1, memory_order_relaxed);
+            *used = m;
+            return sock;
+        }
+        // Отказ соединения - не ждем следующей проверки, ее удача вернет участника
+        atomic_store(&m->healthy, 0);
+        upstream_release(m, 0);
+        failed = m;
+    }
+    return -1;
+}
+
+int upstream_build_request(const upstream_member* m, const http_request* req,
+                           const char* host, const char* port, dynbuf* out) {
+    if (m->group->kind == GROUP_PARENT) {
+        return build_proxy_request(req, host, port, NULL, out);
+    }
+    return build_request(req, out);
+}
+
+static void try_eject(upstream_member* m) {
+    upstream_group* g = m->group;
+    pthread_mutex_lock(&g->eject_lock);
+    int64_t now = cache_clock();
+    int ejected = 0;
+    for (int i = 0; i < g->num; i++) {
+        ejected += now < atomic_load(&g->members[i].ejected_until);
+    }
+    if (now >= atomic_load(&m->ejected_until) &&
+        (ejected + 1) * 100 <= g->num * UPSTREAM_MAX_EJECT_PERCENT) {
+        int times = atomic_fetch_add(&m->ejections, 1) + 1;
+        int64_t sec = (int64_t)UPSTREAM_EJECT_BASE_SEC * times;
+        if (sec > UPSTREAM_EJECT_MAX_SEC) {
+            sec = UPSTREAM_EJECT_MAX_SEC;
+        }
+        atomic_store(&m->ejected_until, now + sec);
+        atomic_store(&m->errors, 0);
+        metrics_add(METRIC_UPSTREAM_EJECTIONS, 1);
+        printf("Upstream %s ejected for %lld sec\n", m->name, (long long)sec);
+    }
+    pthread_mutex_unlock(&g->eject_lock);
+}
+
+// ok == 0 - участник не ответил, ответил 5xx или не успел
+void upstream_release(upstream_member* m, int ok) {
+    if (m == NULL) {
+        return;
+    }
+    atomic_fetch_sub(&m->outstanding, 1);
+    if (ok) {
+        atomic_store(&m->errors, 0);
+        // Давно вернувшийся участник снова выпадает ненадолго, а не на максимум
+        if (atomic_load(&m->ejections) > 0 &&
+            cache_clock() >= atomic_load(&m->ejected_until) + UPSTREAM_EJECT_FORGET_SEC) {
+            atomic_store(&m->ejections, 0);
+        }
+        return;
+    }
+    atomic_fetch_add_explicit(&m->failures, 1, memory_order_relaxed);
+    if (eject_errors > 0 && atomic_fetch_add(&m->errors, 1) + 1 >= eject_errors) {
+        try_eject(m);
+    }
+}
+
+const char* upstream_member_name(const upstream_member* m) {
+    return m->name;
+}
+
+int upstream_is_parent(const upstream_member* m) {
+    return m->group->kind == GROUP_PARENT;
+}
+
+int upstream_render(dynbuf* out) {
+    if (groups_num == 0) {
+        return dynbuf_append_str(out, "upstream groups are not configured\n");
+    }
+
+    int64_t now = cache_clock();
+    char line[512];
+    for (int i = 0; i < groups_num; i++) {
+        upstream_group* g = &groups[i];
+        snprintf(line, sizeof(line), "%s %s\n", g->kind == GROUP_PARENT ? "parent" : "origin", g->match);
+        if (dynbuf_append_str(out, line) != 0) {
+            return -1;
+        }
+        for (int j = 0; j < g->num; j++) {
+            upstream_member* m = &g->members[j];
+            int64_t ejected = atomic_load(&m->ejected_until) - now;
+            snprintf(line, sizeof(line),
+                     "  %-32s %-4s outstanding=%d requests=%llu failures=%llu ejections=%d ejected_sec=%lld\n",
+                     m->name, atomic_load(&m->healthy) ? "up" : "down", atomic_load(&m->outstanding),
+                     (unsigned long long)atomic_load(&m->requests), (unsigned long long)atomic_load(&m->failures),
+                     atomic_load(&m->ejections), (long long)(ejected > 0 ? ejected : 0));
+            if (dynbuf_append_str(out, line) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
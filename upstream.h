@@ -0,0 +1,61 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdint.h>
+
+#include "http_request.h"
+#include "dynamic_buffer.h"
+
+// Группы upstream из PROXY_UPSTREAMS: промахи идут не прямо по Host, а
+// через родительские кэши или пул реплик origin'а. Формат:
+//   "parent *=p1:3128,p2:3128; origin img.example.com=10.0.0.1:80,10.0.0.2:80"
+// Шаблон - имя хоста, "*.домен" или "*"; побеждает первая подходящая группа.
+// parent - это прокси: запрос уходит с абсолютным URI, участник выбирается
+// консистентным хешем ключа кэша. origin - реплики одного сайта, запрос
+// обычный, выбирается участник с наименьшим числом запросов в работе.
+
+#define MAX_UPSTREAM_GROUPS 16
+#define MAX_UPSTREAM_MEMBERS 32
+#define UPSTREAM_NAME_LEN 128
+#define UPSTREAM_MAX_TRIES 2
+// Без группы для хоста идем напрямую
+#define UPSTREAM_DIRECT -2
+
+#define DEFAULT_UPSTREAM_CHECK_INTERVAL_SEC 5
+#define UPSTREAM_CHECK_TIMEOUT_MS 1000
+// Столько проверок подряд должно провалиться, чтобы участник считался лежащим
+#define UPSTREAM_CHECK_FALLS 2
+
+// Выброс по ошибкам живого трафика: после N ошибок подряд участник
+// выпадает на base * число выбросов секунд, но не больше половины группы
+#define DEFAULT_UPSTREAM_EJECT_ERRORS 5
+#define UPSTREAM_EJECT_BASE_SEC 10
+#define UPSTREAM_EJECT_MAX_SEC 300
+#define UPSTREAM_MAX_EJECT_PERCENT 50
+// Столько секунд без выбросов после возврата - и счетчик выбросов обнуляется
+#define UPSTREAM_EJECT_FORGET_SEC 60
+
+// Консистентный хеш с ограниченной нагрузкой: владелец ключа, у которого
+// в работе больше 125% от средней, уступает следующему по кольцу
+#define UPSTREAM_LOAD_FACTOR_PERCENT 125
+
+typedef struct upstream_member upstream_member;
+
+int init_upstreams(void);
+
+// Сокет к участнику группы для host: key_hash != 0 - кэшируемый запрос,
+// его шард определяется кольцом. UPSTREAM_DIRECT - группы нет
+int upstream_connect(const char* host, uint64_t key_hash, upstream_member** used);
+
+int upstream_build_request(const upstream_member* m, const http_request* req,
+                           const char* host, const char* port, dynbuf* out);
+
+void upstream_release(upstream_member* m, int ok);
+
+const char* upstream_member_name(const upstream_member* m);
+
+int upstream_is_parent(const upstream_member* m);
+
+int upstream_render(dynbuf* out);
+
+#endif
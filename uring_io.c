@@ -0,0 +1,727 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "uring_io.h"
+#include "mem_budget.h"
+#include "http_utils.h"
+#include "conn_deadline.h"
+
+// io_uring без liburing: кольца поднимаются напрямую через syscall и mmap.
+// Соединения обслуживаются отдельными потоками, поэтому кольца не создаются
+// на каждое соединение, а берутся из пула и возвращаются в него.
+
+#define TAG_RECV 1
+#define TAG_SEND_HEAD 2
+#define TAG_SEND_BODY 3
+#define TAG_ACCEPT 4
+#define TAG_CANCEL 5
+#define TAG_RELAY_RECV 6
+#define TAG_RELAY_SEND 7
+
+#define URING_BUF_GROUP 1
+
+struct uring_ctx {
+    int ring_fd;
+
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+
+    _Atomic unsigned* sq_head;
+    _Atomic unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    unsigned to_submit;
+
+    _Atomic unsigned* cq_head;
+    _Atomic unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // Кольцо выданных ядру буферов для multishot recv
+    struct io_uring_buf_ring* br;
+    size_t br_len;
+    char* bufs;
+    unsigned br_tail;
+
+    int accept_fd;
+    int accept_armed;
+    int accept_q[URING_ACCEPT_QUEUE];
+    unsigned accept_head;
+    unsigned accept_tail;
+
+    struct uring_ctx* next_free;
+};
+
+static int uring_enabled = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static uring_ctx* pool = NULL;
+static __thread uring_ctx* current_ctx = NULL;
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void recycle_buffer(uring_ctx* ctx, unsigned bid) {
+    unsigned mask = URING_BUF_COUNT - 1;
+    struct io_uring_buf* b = &ctx->br->bufs[ctx->br_tail & mask];
+    b->addr = (uint64_t)(uintptr_t)(ctx->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = (uint16_t)bid;
+    ctx->br_tail++;
+    __atomic_store_n(&ctx->br->tail, (uint16_t)ctx->br_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffer_ring(uring_ctx* ctx) {
+    ctx->br_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ctx->br = mmap(NULL, ctx->br_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ctx->br == MAP_FAILED) {
+        ctx->br = NULL;
+        return -1;
+    }
+    ctx->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ctx->bufs == NULL) {
+        munmap(ctx->br, ctx->br_len);
+        ctx->br = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ctx->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_uring_register(ctx->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        // Ядро старше 5.19: multishot recv недоступен, остаются обычные операции
+        free(ctx->bufs);
+        munmap(ctx->br, ctx->br_len);
+        ctx->bufs = NULL;
+        ctx->br = NULL;
+        return -1;
+    }
+
+    ctx->br_tail = 0;
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++) {
+        recycle_buffer(ctx, i);
+    }
+    return 0;
+}
+
+static void destroy_ctx(uring_ctx* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    if (ctx->bufs != NULL) {
+        free(ctx->bufs);
+        mem_budget_release(MEM_IO_BUFFERS, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    }
+    if (ctx->br != NULL) {
+        munmap(ctx->br, ctx->br_len);
+    }
+    if (ctx->sqes != NULL) {
+        munmap(ctx->sqes, ctx->sqes_len);
+    }
+    if (ctx->cq_ptr != NULL && ctx->cq_ptr != ctx->sq_ptr) {
+        munmap(ctx->cq_ptr, ctx->cq_len);
+    }
+    if (ctx->sq_ptr != NULL) {
+        munmap(ctx->sq_ptr, ctx->sq_len);
+    }
+    if (ctx->ring_fd >= 0) {
+        close(ctx->ring_fd);
+    }
+    free(ctx);
+}
+
+static uring_ctx* create_ctx(void) {
+    uring_ctx* ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->ring_fd = -1;
+    ctx->accept_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    ctx->ring_fd = sys_uring_setup(URING_ENTRIES, &p);
+    if (ctx->ring_fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ctx->ring_fd = sys_uring_setup(URING_ENTRIES, &p);
+    }
+    if (ctx->ring_fd < 0) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ctx->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ctx->cq_len > ctx->sq_len) {
+            ctx->sq_len = ctx->cq_len;
+        }
+        ctx->cq_len = ctx->sq_len;
+    }
+
+    ctx->sq_ptr = mmap(NULL, ctx->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ctx->ring_fd, IORING_OFF_SQ_RING);
+    if (ctx->sq_ptr == MAP_FAILED) {
+        ctx->sq_ptr = NULL;
+        destroy_ctx(ctx);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ctx->cq_ptr = ctx->sq_ptr;
+    } else {
+        ctx->cq_ptr = mmap(NULL, ctx->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ctx->ring_fd, IORING_OFF_CQ_RING);
+        if (ctx->cq_ptr == MAP_FAILED) {
+            ctx->cq_ptr = NULL;
+            destroy_ctx(ctx);
+            return NULL;
+        }
+    }
+
+    ctx->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sqes = mmap(NULL, ctx->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ctx->ring_fd, IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED) {
+        ctx->sqes = NULL;
+        destroy_ctx(ctx);
+        return NULL;
+    }
+
+    char* sq = (char*)ctx->sq_ptr;
+    ctx->sq_head = (_Atomic unsigned*)(sq + p.sq_off.head);
+    ctx->sq_tail = (_Atomic unsigned*)(sq + p.sq_off.tail);
+    ctx->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ctx->sq_entries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    ctx->sq_array = (unsigned*)(sq + p.sq_off.array);
+
+    char* cq = (char*)ctx->cq_ptr;
+    ctx->cq_head = (_Atomic unsigned*)(cq + p.cq_off.head);
+    ctx->cq_tail = (_Atomic unsigned*)(cq + p.cq_off.tail);
+    ctx->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ctx->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    if (setup_buffer_ring(ctx) == 0) {
+        mem_budget_force_reserve(MEM_IO_BUFFERS, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    }
+    return ctx;
+}
+
+int init_uring_backend(int enabled) {
+    uring_enabled = 0;
+    if (!enabled) {
+        return 0;
+    }
+
+    // Проверяем, что ядро умеет io_uring (и что его не запретили sysctl/seccomp)
+    uring_ctx* probe = create_ctx();
+    if (probe == NULL) {
+        return -1;
+    }
+    uring_enabled = 1;
+    uring_release(probe);
+    return 0;
+}
+
+int uring_backend_enabled(void) {
+    return uring_enabled;
+}
+
+uring_ctx* uring_acquire(void) {
+    if (!uring_enabled) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    uring_ctx* ctx = pool;
+    if (ctx != NULL) {
+        pool = ctx->next_free;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (ctx == NULL) {
+        ctx = create_ctx();
+    }
+    return ctx;
+}
+
+void uring_release(uring_ctx* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    if (current_ctx == ctx) {
+        current_ctx = NULL;
+    }
+    // Кольцо с незавершенными операциями в пул возвращать нельзя
+    if (ctx->to_submit != 0 || ctx->accept_armed) {
+        destroy_ctx(ctx);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    ctx->next_free = pool;
+    pool = ctx;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void uring_bind_thread(uring_ctx* ctx) {
+    current_ctx = ctx;
+}
+
+uring_ctx* uring_current(void) {
+    return current_ctx;
+}
+
+static struct io_uring_sqe* get_sqe(uring_ctx* ctx) {
+    unsigned tail = atomic_load_explicit(ctx->sq_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(ctx->sq_head, memory_order_acquire);
+    if (tail - head >= ctx->sq_entries) {
+        if (sys_uring_enter(ctx->ring_fd, ctx->to_submit, 0, 0) < 0) {
+            return NULL;
+        }
+        ctx->to_submit = 0;
+        head = atomic_load_explicit(ctx->sq_head, memory_order_acquire);
+        if (tail - head >= ctx->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = tail & ctx->sq_mask;
+    struct io_uring_sqe* sqe = &ctx->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ctx->sq_array[idx] = idx;
+    atomic_store_explicit(ctx->sq_tail, tail + 1, memory_order_release);
+    ctx->to_submit++;
+    return sqe;
+}
+
+static int peek_cqe(uring_ctx* ctx, struct io_uring_cqe* out) {
+    unsigned head = atomic_load_explicit(ctx->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ctx->cq_tail, memory_order_acquire);
+    if (head == tail) {
+        return 0;
+    }
+    *out = ctx->cqes[head & ctx->cq_mask];
+    atomic_store_explicit(ctx->cq_head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Пока в CQ есть готовые завершения, новые SQE копятся; когда CQ пуст,
+// один вызов отправляет все накопленное и ждет хотя бы одно завершение
+static int wait_cqe(uring_ctx* ctx, struct io_uring_cqe* out) {
+    while (1) {
+        if (peek_cqe(ctx, out)) {
+            return 0;
+        }
+        int rc = sys_uring_enter(ctx->ring_fd, ctx->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ctx->to_submit = 0;
+    }
+}
+
+static void prep_rw(struct io_uring_sqe* sqe, int op, int fd, const void* addr, size_t len, uint64_t tag) {
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = tag;
+}
+
+int uring_send2(uring_ctx* ctx, int fd, const void* a, size_t a_len, const void* b, size_t b_len) {
+    const char* parts[2] = {(const char*)a, (const char*)b};
+    size_t lens[2] = {a_len, b_len};
+
+    while (lens[0] > 0 || lens[1] > 0) {
+        // Заголовок и тело связаны IOSQE_IO_LINK: уходят одним submit и строго по порядку
+        int queued = 0;
+        for (int i = 0; i < 2; i++) {
+            if (lens[i] == 0) {
+                continue;
+            }
+            struct io_uring_sqe* sqe = get_sqe(ctx);
+            if (sqe == NULL) {
+                return -1;
+            }
+            size_t want = lens[i] < SEND_CHUNK_SIZE ? lens[i] : SEND_CHUNK_SIZE;
+            prep_rw(sqe, IORING_OP_SEND, fd, parts[i], want, i == 0 ? TAG_SEND_HEAD : TAG_SEND_BODY);
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            queued++;
+            if (i == 0 && want < lens[0]) {
+                // Заголовок уходит по частям - тело подождет следующего круга
+                break;
+            }
+            if (i == 0 && lens[1] > 0) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+        }
+
+        int failed = 0;
+        while (queued > 0) {
+            struct io_uring_cqe cqe;
+            if (wait_cqe(ctx, &cqe) != 0) {
+                return -1;
+            }
+            if (cqe.user_data != TAG_SEND_HEAD && cqe.user_data != TAG_SEND_BODY) {
+                continue;
+            }
+            queued--;
+
+            int i = (cqe.user_data == TAG_SEND_HEAD) ? 0 : 1;
+            if (cqe.res <= 0) {
+                // Тело отменяется, если заголовок ушел не целиком - тогда просто повторим
+                if (cqe.res != -ECANCELED && cqe.res != -EINTR) {
+                    failed = 1;
+                }
+                continue;
+            }
+            deadline_touch((size_t)cqe.res);
+            parts[i] += cqe.res;
+            lens[i] -= (size_t)cqe.res;
+        }
+        if (failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cancel_and_drain(uring_ctx* ctx, uint64_t tag) {
+    struct io_uring_sqe* sqe = get_sqe(ctx);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag;
+    sqe->user_data = TAG_CANCEL;
+
+    // Ждем финальный CQE самой операции (без F_MORE) и ответ на отмену
+    int op_done = 0;
+    int cancel_done = 0;
+    int not_found = 0;
+    while (!op_done || !cancel_done) {
+        struct io_uring_cqe cqe;
+        if (not_found) {
+            // Операция завершилась раньше отмены: ее CQE уже лежат в CQ или их нет
+            if (!peek_cqe(ctx, &cqe)) {
+                break;
+            }
+        } else if (wait_cqe(ctx, &cqe) != 0) {
+            return -1;
+        }
+
+        if (cqe.user_data == TAG_CANCEL) {
+            cancel_done = 1;
+            not_found = (cqe.res == -ENOENT);
+        } else if (cqe.user_data == tag) {
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                recycle_buffer(ctx, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                op_done = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int arm_multishot_recv(uring_ctx* ctx, int fd) {
+    struct io_uring_sqe* sqe = get_sqe(ctx);
+    if (sqe == NULL) {
+        return -1;
+    }
+    prep_rw(sqe, IORING_OP_RECV, fd, NULL, 0, TAG_RELAY_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    return 0;
+}
+
+static int queue_relay_send(uring_ctx* ctx, int fd, unsigned bid, size_t off, size_t len) {
+    struct io_uring_sqe* sqe = get_sqe(ctx);
+    if (sqe == NULL) {
+        return -1;
+    }
+    prep_rw(sqe, IORING_OP_SEND, fd, ctx->bufs + (size_t)bid * URING_BUF_SIZE + off, len, TAG_RELAY_SEND);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+long uring_relay(uring_ctx* ctx, int from_fd, int to_fd, uring_data_cb on_data, void* arg) {
+    if (ctx == NULL || ctx->br == NULL) {
+        return SPLICE_UNSUPPORTED;
+    }
+
+    // Очередь буферов, ждущих отправки: в полете одна отправка, чтобы
+    // данные на сокет клиента уходили строго по порядку
+    unsigned q_bid[URING_BUF_COUNT];
+    unsigned q_len[URING_BUF_COUNT];
+    unsigned q_head = 0, q_tail = 0;
+    size_t send_off = 0;
+    int send_inflight = 0;
+
+    int recv_armed = 0;
+    int eof = 0;
+    int error = 0;
+    long total = 0;
+
+    if (arm_multishot_recv(ctx, from_fd) != 0) {
+        return SPLICE_UNSUPPORTED;
+    }
+    recv_armed = 1;
+
+    while (!error && (!eof || q_head != q_tail || send_inflight)) {
+        struct io_uring_cqe cqe;
+        if (wait_cqe(ctx, &cqe) != 0) {
+            error = 1;
+            break;
+        }
+
+        if (cqe.user_data == TAG_RELAY_RECV) {
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                recv_armed = 0;
+            }
+
+            if (cqe.res > 0) {
+                unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (on_data != NULL) {
+                    on_data(arg, ctx->bufs + (size_t)bid * URING_BUF_SIZE, (size_t)cqe.res);
+                }
+                q_bid[q_tail % URING_BUF_COUNT] = bid;
+                q_len[q_tail % URING_BUF_COUNT] = (unsigned)cqe.res;
+                q_tail++;
+                total += cqe.res;
+            } else if (cqe.res == 0) {
+                eof = 1;
+            } else if (cqe.res != -ENOBUFS) {
+                error = 1;
+            }
+
+            // Multishot мог закончиться сам - взводим снова. Если кончились
+            // буферы, взведем после того, как отправка вернет хотя бы один
+            if (!recv_armed && !eof && !error && (cqe.res != -ENOBUFS || q_head == q_tail)) {
+                if (arm_multishot_recv(ctx, from_fd) != 0) {
+                    error = 1;
+                } else {
+                    recv_armed = 1;
+                }
+            }
+        } else if (cqe.user_data == TAG_RELAY_SEND) {
+            send_inflight = 0;
+            if (cqe.res <= 0) {
+                error = 1;
+                break;
+            }
+            unsigned slot = q_head % URING_BUF_COUNT;
+            deadline_touch((size_t)cqe.res);
+            send_off += (size_t)cqe.res;
+            if (send_off >= q_len[slot]) {
+                recycle_buffer(ctx, q_bid[slot]);
+                q_head++;
+                send_off = 0;
+
+                if (!recv_armed && !eof) {
+                    if (arm_multishot_recv(ctx, from_fd) != 0) {
+                        error = 1;
+                        break;
+                    }
+                    recv_armed = 1;
+                }
+            }
+        }
+
+        if (!error && !send_inflight && q_head != q_tail) {
+            unsigned slot = q_head % URING_BUF_COUNT;
+            if (queue_relay_send(ctx, to_fd, q_bid[slot], send_off, q_len[slot] - send_off) != 0) {
+                error = 1;
+                break;
+            }
+            send_inflight = 1;
+        }
+    }
+
+    // Кольцо вернется в пул, поэтому все операции должны быть завершены
+    if (recv_armed) {
+        cancel_and_drain(ctx, TAG_RELAY_RECV);
+    }
+    while (send_inflight) {
+        struct io_uring_cqe cqe;
+        if (wait_cqe(ctx, &cqe) != 0) {
+            break;
+        }
+        if (cqe.user_data == TAG_RELAY_SEND) {
+            send_inflight = 0;
+        }
+    }
+    while (q_head != q_tail) {
+        recycle_buffer(ctx, q_bid[q_head % URING_BUF_COUNT]);
+        q_head++;
+    }
+
+    return error ? -1 : total;
+}
+
+// Процесс уходит на покой (горячее обновление): потоки accept досыпают
+// до сигнала, снимают multishot accept и больше ничего не принимают
+static _Atomic int accepts_stopped = 0;
+
+void uring_stop_accepts(void) {
+    atomic_store(&accepts_stopped, 1);
+}
+
+static void queue_accepted(uring_ctx* ctx, int fd) {
+    if (ctx->accept_tail - ctx->accept_head < URING_ACCEPT_QUEUE) {
+        ctx->accept_q[ctx->accept_tail % URING_ACCEPT_QUEUE] = fd;
+        ctx->accept_tail++;
+    } else {
+        close(fd);
+    }
+}
+
+// Как wait_cqe, но сигнал после uring_stop_accepts() прерывает ожидание
+static int wait_accept_cqe(uring_ctx* ctx, struct io_uring_cqe* out) {
+    while (1) {
+        if (peek_cqe(ctx, out)) {
+            return 0;
+        }
+        if (atomic_load(&accepts_stopped)) {
+            errno = ECANCELED;
+            return -1;
+        }
+        int rc = sys_uring_enter(ctx->ring_fd, ctx->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ctx->to_submit = 0;
+    }
+}
+
+// Отменяем multishot accept; соединения, которые ядро успело принять,
+// остаются в очереди - их еще обслужат
+static void cancel_accept(uring_ctx* ctx) {
+    struct io_uring_sqe* sqe = get_sqe(ctx);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = TAG_ACCEPT;
+    sqe->user_data = TAG_CANCEL;
+
+    int op_done = 0;
+    int cancel_done = 0;
+    while (!op_done || !cancel_done) {
+        struct io_uring_cqe cqe;
+        if (cancel_done && !peek_cqe(ctx, &cqe)) {
+            break;
+        }
+        if (!cancel_done && wait_cqe(ctx, &cqe) != 0) {
+            break;
+        }
+        if (cqe.user_data == TAG_CANCEL) {
+            cancel_done = 1;
+        } else if (cqe.user_data == TAG_ACCEPT) {
+            if (cqe.res >= 0) {
+                queue_accepted(ctx, cqe.res);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                op_done = 1;
+            }
+        }
+    }
+    ctx->accept_armed = 0;
+}
+
+int uring_accept_next(uring_ctx* ctx, int listen_fd) {
+    if (ctx->accept_fd != listen_fd) {
+        ctx->accept_fd = listen_fd;
+        ctx->accept_armed = 0;
+    }
+
+    while (ctx->accept_head == ctx->accept_tail) {
+        if (atomic_load(&accepts_stopped)) {
+            if (ctx->accept_armed) {
+                cancel_accept(ctx);
+                continue;
+            }
+            errno = ECANCELED;
+            return -1;
+        }
+        if (!ctx->accept_armed) {
+            // Один multishot accept выдает CQE на каждое новое соединение
+            struct io_uring_sqe* sqe = get_sqe(ctx);
+            if (sqe == NULL) {
+                return -1;
+            }
+            prep_rw(sqe, IORING_OP_ACCEPT, listen_fd, NULL, 0, TAG_ACCEPT);
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            ctx->accept_armed = 1;
+        }
+
+        struct io_uring_cqe cqe;
+        if (wait_accept_cqe(ctx, &cqe) != 0) {
+            if (errno == ECANCELED) {
+                continue;
+            }
+            return -1;
+        }
+        if (cqe.user_data != TAG_ACCEPT) {
+            continue;
+        }
+
+        // Забираем все готовые accept за один проход по CQ
+        do {
+            if (cqe.user_data != TAG_ACCEPT) {
+                continue;
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                ctx->accept_armed = 0;
+            }
+            if (cqe.res >= 0) {
+                queue_accepted(ctx, cqe.res);
+            } else if (ctx->accept_head == ctx->accept_tail) {
+                errno = -cqe.res;
+                return -1;
+            }
+        } while (peek_cqe(ctx, &cqe));
+    }
+
+    int fd = ctx->accept_q[ctx->accept_head % URING_ACCEPT_QUEUE];
+    ctx->accept_head++;
+    return fd;
+}
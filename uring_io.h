@@ -0,0 +1,37 @@
+#ifndef __URING_IO_H__
+#define __URING_IO_H__
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define URING_ENTRIES 64
+#define URING_BUF_COUNT 32
+#define URING_BUF_SIZE 16384
+#define URING_ACCEPT_QUEUE 64
+
+typedef struct uring_ctx uring_ctx;
+
+// Вызывается на каждый принятый из upstream кусок до его отправки клиенту
+typedef int (*uring_data_cb)(void* arg, const char* data, size_t n);
+
+int init_uring_backend(int enabled);
+
+int uring_backend_enabled(void);
+
+uring_ctx* uring_acquire(void);
+
+void uring_release(uring_ctx* ctx);
+
+void uring_bind_thread(uring_ctx* ctx);
+
+uring_ctx* uring_current(void);
+
+int uring_send2(uring_ctx* ctx, int fd, const void* a, size_t a_len, const void* b, size_t b_len);
+
+long uring_relay(uring_ctx* ctx, int from_fd, int to_fd, uring_data_cb on_data, void* arg);
+
+int uring_accept_next(uring_ctx* ctx, int listen_fd);
+
+void uring_stop_accepts(void);
+
+#endif
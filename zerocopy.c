@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "zerocopy.h"
+#include "http_utils.h"
+#include "conn_deadline.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+static size_t zerocopy_min_size = DEFAULT_ZEROCOPY_MIN_SIZE;
+
+void init_zerocopy(size_t min_size) {
+    zerocopy_min_size = min_size;
+}
+
+size_t zerocopy_threshold(void) {
+    return zerocopy_min_size == 0 ? SIZE_MAX : zerocopy_min_size;
+}
+
+// Разбирает уведомления из очереди ошибок сокета. Каждое покрывает
+// диапазон номеров send-вызовов, чьи страницы ядро больше не держит.
+static int read_completions(int sock, uint32_t* completed) {
+    while (1) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rc = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            *completed += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+}
+
+// Клиент, который не читает, может держать страницы сколько угодно. По
+// таймауту сбрасываем соединение: connect(AF_UNSPEC) выбрасывает очередь
+// отправки, сокет остается открытым, и уведомления все равно приходят.
+// Без всех уведомлений не выходим - иначе узел кэша освободят, а ядро
+// продолжит отправлять из его памяти
+static int drain_completions(int sock, uint32_t issued, uint32_t* completed) {
+    int rc = 0;
+    int waited = 0;
+    while (*completed < issued) {
+        if (read_completions(sock, completed) != 0) {
+            rc = -1;
+        }
+        if (*completed >= issued) {
+            break;
+        }
+        if (waited == ZEROCOPY_DRAIN_TIMEOUT_MS) {
+            struct sockaddr unspec;
+            memset(&unspec, 0, sizeof(unspec));
+            unspec.sa_family = AF_UNSPEC;
+            (void)connect(sock, &unspec, sizeof(unspec));
+            rc = -1;
+        }
+
+        // Уведомления приходят как POLLERR
+        struct pollfd pfd = {.fd = sock, .events = 0};
+        (void)poll(&pfd, 1, 100);
+        waited += 100;
+    }
+    return rc;
+}
+
+// Отложенное ожидание уведомлений этого потока
+static __thread int defer_drain = 0;
+static __thread int pending_sock = -1;
+static __thread uint32_t pending_issued = 0;
+static __thread uint32_t pending_completed = 0;
+static __thread int pending_rc = 0;
+
+void zerocopy_defer(void) {
+    defer_drain = 1;
+}
+
+int zerocopy_finish(void) {
+    defer_drain = 0;
+    if (pending_sock < 0) {
+        return 0;
+    }
+    int rc = pending_rc;
+    if (drain_completions(pending_sock, pending_issued, &pending_completed) != 0) {
+        rc = -1;
+    }
+    pending_sock = -1;
+    return rc;
+}
+
+int send_all_zerocopy(int sock, const void* buf, size_t len) {
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return send_all(sock, buf, len);
+    }
+
+    // Отложенной может быть только одна отправка
+    int defer = defer_drain;
+    if (pending_sock >= 0) {
+        defer_drain = 0;
+        (void)zerocopy_finish();
+        defer_drain = defer;
+    }
+
+    const char* p = (const char*)buf;
+    uint32_t issued = 0;
+    uint32_t completed = 0;
+    int rc = 0;
+
+    while (len > 0) {
+        size_t want = len < ZEROCOPY_CHUNK_SIZE ? len : ZEROCOPY_CHUNK_SIZE;
+        ssize_t n = send(sock, p, want, MSG_ZEROCOPY);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS) {
+                // Кончился optmem под закрепленные страницы: если уведомлений
+                // не прибавилось, отправляем этот кусок обычной копией
+                uint32_t before = completed;
+                if (read_completions(sock, &completed) != 0 || completed == before) {
+                    if (send_all(sock, p, want) != 0) {
+                        rc = -1;
+                        break;
+                    }
+                    p += want;
+                    len -= want;
+                }
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        if (n == 0) {
+            rc = -1;
+            break;
+        }
+        issued++;
+        deadline_touch((size_t)n);
+        p += (size_t)n;
+        len -= (size_t)n;
+
+        if (read_completions(sock, &completed) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    if (defer && issued > completed) {
+        pending_sock = sock;
+        pending_issued = issued;
+        pending_completed = completed;
+        pending_rc = rc;
+        return rc;
+    }
+
+    // Пока ядро не вернуло все уведомления, память ответа трогать нельзя:
+    // вызывающий держит ссылку на узел кэша до выхода отсюда
+    if (drain_completions(sock, issued, &completed) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+int send_cached_body(int sock, const void* buf, size_t len) {
+    if (zerocopy_min_size == 0 || len < zerocopy_min_size) {
+        return send_all(sock, buf, len);
+    }
+    return send_all_zerocopy(sock, buf, len);
+}
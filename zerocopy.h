@@ -0,0 +1,25 @@
+#ifndef __ZEROCOPY_H__
+#define __ZEROCOPY_H__
+
+#include <stdlib.h>
+
+// Объекты меньше порога идут обычным send: для них копия дешевле уведомлений
+#define DEFAULT_ZEROCOPY_MIN_SIZE (1024 * 1024)
+#define ZEROCOPY_CHUNK_SIZE (256 * 1024)
+#define ZEROCOPY_DRAIN_TIMEOUT_MS 30000
+
+void init_zerocopy(size_t min_size);
+
+size_t zerocopy_threshold(void);
+
+int send_all_zerocopy(int sock, const void* buf, size_t len);
+
+// Ожидание уведомлений переносится на zerocopy_finish(): вызывающий успевает
+// отпустить общие ресурсы, но память ответа держит до него
+void zerocopy_defer(void);
+
+int zerocopy_finish(void);
+
+int send_cached_body(int sock, const void* buf, size_t len);
+
+#endif